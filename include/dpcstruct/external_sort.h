@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <unistd.h>
+
+#include <dpcstruct/sort.h>
+
+#define EXTERNAL_MERGE_BUFFER 65536   // Max records buffered per run during the merge
+#define EXTERNAL_MERGE_MIN_BUFFER 1024 // Min records buffered per run, below it the merge takes more passes
+#define EXTERNAL_MERGE_MAX_FANIN 512   // Runs open at once, well below the usual file descriptor limit
+
+namespace detail {
+// Sorters of every record type share the numbering of their run files
+inline std::atomic<int> externalSorterInstances{0};
+}
+
+// Out-of-core sort of fixed-size records wrt an unsigned key (see radix_sort).
+// Records are buffered up to a memory budget. Full buffers are sorted and spilled
+// to run files in `tmpDir`, and merge() streams the runs back with a k-way merge.
+// The run buffers of the merge share the same budget: with more runs than they allow,
+// consecutive runs are first merged into longer ones. Data that fits in the budget
+// never touches the disk.
+template <typename Record, typename KeyFn>
+class ExternalSorter {
+public:
+    using Key = std::invoke_result_t<KeyFn, const Record&>;
+
+    // `memoryBytes` bounds the internal buffer together with the radix sort scratch space
+    ExternalSorter(KeyFn key, uint64_t memoryBytes, const std::string& tmpDir, int numThreads = 1)
+        : key(key), capacity(std::max<uint64_t>(1, memoryBytes / (2 * sizeof(Record)))),
+          mergeBudget(std::max<uint64_t>(1, memoryBytes / sizeof(Record))), numThreads(numThreads),
+          numRunFiles(0), spilled(0) {
+        runPrefix = (std::filesystem::path(tmpDir) / ("dpcstruct-sort-" + std::to_string(getpid()) + "-" +
+                    std::to_string(detail::externalSorterInstances++) + ".run")).string();
+    }
+
+    ~ExternalSorter() {
+        for (const auto& runPath : runPaths) {
+            std::error_code ec;
+            std::filesystem::remove(runPath, ec);
+        }
+    }
+
+    ExternalSorter(const ExternalSorter&) = delete;
+    ExternalSorter& operator=(const ExternalSorter&) = delete;
+
+    // Records per run when the budget is split among `parts` buffers (see spill)
+    uint64_t run_capacity(int parts = 1) const { return std::max<uint64_t>(1, capacity / parts); }
+
+    void push(const Record& record) {
+        buffer.push_back(record);
+        if (buffer.size() >= capacity) spill(buffer, numThreads);
+    }
+
+    void push(const Record* records, uint64_t count) {
+        while (count > 0) {
+            if (buffer.empty()) buffer.reserve(std::min<uint64_t>(capacity, count));
+            uint64_t n = std::min<uint64_t>(count, capacity - buffer.size());
+            buffer.insert(buffer.end(), records, records + n);
+            records += n;
+            count -= n;
+            if (buffer.size() >= capacity) spill(buffer, numThreads);
+        }
+    }
+
+    // Sorts `records` and writes them as a new run, leaving `records` empty.
+    // Threads may spill their own buffers concurrently: runs are merged in creation order.
+    void spill(std::vector<Record>& records, int sortThreads = 1) {
+        if (records.empty()) return;
+
+        radix_sort(records.data(), records.size(), key, sortThreads);
+
+        std::string runPath = new_run();
+        std::ofstream runFile(runPath, std::ios::binary);
+        runFile.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Record));
+        if (!runFile) {
+            throw std::runtime_error("Failed to write run file: " + runPath);
+        }
+
+        spilled += records.size();
+        records.clear();
+    }
+
+    uint64_t size() const { return spilled + buffer.size(); }
+
+    size_t num_runs() const { return runPaths.size(); }
+
+    // Streams all the records in key order to consume(const Record* records, uint64_t count).
+    // Equal keys keep the order in which they were pushed (or spilled).
+    template <typename Consumer>
+    void merge(Consumer&& consume) {
+        // Everything fits in memory
+        if (runPaths.empty()) {
+            radix_sort(buffer.data(), buffer.size(), key, numThreads);
+            if (!buffer.empty()) consume(buffer.data(), buffer.size());
+            std::vector<Record>().swap(buffer);
+            return;
+        }
+
+        spill(buffer, numThreads);
+        std::vector<Record>().swap(buffer);
+
+        // The output buffer and one buffer per merged run fit in the budget, with at least two runs merged at once
+        uint64_t runBuffer = std::clamp<uint64_t>(mergeBudget / (runPaths.size() + 1), EXTERNAL_MERGE_MIN_BUFFER,
+                                                  EXTERNAL_MERGE_BUFFER);
+        size_t fanIn = std::clamp<uint64_t>(mergeBudget / runBuffer, 3, EXTERNAL_MERGE_MAX_FANIN + 1) - 1;
+
+        // Intermediate passes merge consecutive runs, so equal keys keep their order
+        while (runPaths.size() > fanIn) {
+            size_t numRuns = runPaths.size();
+            std::vector<std::string> merged;
+            for (size_t first = 0; first < numRuns; first += fanIn) {
+                size_t last = std::min(numRuns, first + fanIn);
+                if (last - first == 1) {
+                    merged.push_back(runPaths[first]);
+                    continue;
+                }
+
+                std::string runPath = new_run();
+                std::ofstream runFile(runPath, std::ios::binary);
+                merge_runs(first, last, runBuffer, [&](const Record* records, uint64_t count) {
+                    runFile.write(reinterpret_cast<const char*>(records), count * sizeof(Record));
+                });
+                runFile.close();
+                if (!runFile) {
+                    throw std::runtime_error("Failed to write run file: " + runPath);
+                }
+
+                for (size_t r = first; r < last; ++r) {
+                    std::error_code ec;
+                    std::filesystem::remove(runPaths[r], ec);
+                }
+                merged.push_back(runPath);
+            }
+            runPaths = std::move(merged);
+        }
+
+        merge_runs(0, runPaths.size(), runBuffer, consume);
+    }
+
+private:
+    // Buffered sequential reader over a spilled run
+    struct RunReader {
+        std::ifstream file;
+        std::vector<Record> records;
+        size_t pos = 0;
+        uint64_t bufferRecords;
+
+        RunReader(const std::string& runPath, uint64_t bufferRecords)
+            : file(runPath, std::ios::binary), bufferRecords(bufferRecords) {
+            if (!file) {
+                throw std::runtime_error("Failed to open run file: " + runPath);
+            }
+            refill();
+        }
+
+        bool empty() const { return pos >= records.size(); }
+        const Record& front() const { return records[pos]; }
+
+        void pop() {
+            if (++pos >= records.size()) refill();
+        }
+
+        void refill() {
+            records.resize(bufferRecords);
+            file.read(reinterpret_cast<char*>(records.data()), bufferRecords * sizeof(Record));
+            records.resize(file.gcount() / sizeof(Record));
+            pos = 0;
+        }
+    };
+
+    // Name of a new run file, removed with the sorter
+    std::string new_run() {
+        std::lock_guard<std::mutex> lock(runMutex);
+        std::string runPath = runPrefix + std::to_string(numRunFiles++);
+        runPaths.push_back(runPath);
+        return runPath;
+    }
+
+    // k-way merge of the runs [first, last), with `bufferRecords` records buffered per run
+    template <typename Consumer>
+    void merge_runs(size_t first, size_t last, uint64_t bufferRecords, Consumer&& consume) {
+        std::vector<RunReader> readers;
+        readers.reserve(last - first);
+        for (size_t r = first; r < last; ++r) {
+            readers.emplace_back(runPaths[r], bufferRecords);
+        }
+
+        // Min-heap on (key, run index)
+        auto greater = [this, &readers](size_t a, size_t b) {
+            Key ka = key(readers[a].front());
+            Key kb = key(readers[b].front());
+            return ka != kb ? ka > kb : a > b;
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+        for (size_t r = 0; r < readers.size(); ++r) {
+            if (!readers[r].empty()) heap.push(r);
+        }
+
+        std::vector<Record> outBuffer;
+        outBuffer.reserve(bufferRecords);
+
+        while (!heap.empty()) {
+            size_t r = heap.top();
+            heap.pop();
+
+            outBuffer.push_back(readers[r].front());
+            readers[r].pop();
+            if (!readers[r].empty()) heap.push(r);
+
+            if (outBuffer.size() == bufferRecords) {
+                consume(outBuffer.data(), outBuffer.size());
+                outBuffer.clear();
+            }
+        }
+        if (!outBuffer.empty()) consume(outBuffer.data(), outBuffer.size());
+    }
+
+    KeyFn key;
+    uint64_t capacity;     // records held in memory before spilling
+    uint64_t mergeBudget;  // records buffered by the merge
+    int numThreads;
+    std::string runPrefix;
+
+    std::vector<Record> buffer;
+    std::vector<std::string> runPaths;  // runs left to merge, in creation order
+    uint64_t numRunFiles;
+    std::mutex runMutex;
+    std::atomic<uint64_t> spilled;
+};
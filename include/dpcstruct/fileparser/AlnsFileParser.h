@@ -14,9 +14,15 @@ public:
     AlnsFileParser(const std::string& filename);
     void loadAlignments(std::vector<Alignment>& aligns, uint64_t skipRows = 0);
 
+    // Streaming access: locate the next block of lines sharing the same queryID.
+    // Only the block boundaries are found here, parsing is left to parseBlock.
+    bool nextQueryBlock(const char*& blockStart, const char*& blockEnd);
+    void parseBlock(const char* blockStart, const char* blockEnd, std::vector<Alignment>& aligns);
+
 private:
     std::string filename;
     MemoryMapped data;
+    uint64_t cursor;  // position of the next unread line in streaming mode
 
     void parseLine(const char* lineStart, const char* lineEnd, std::vector<Alignment>& localAligns);
 };
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <dpcstruct/types/ProducerConsumer.h>
+#include <memorymapped/MemoryMapped.h>
+
+// Formats of a distance file:
+//  - pairs: a flat array of NormalizedPair, sorted by (ID1, ID2)
+//  - compact: a header, then rows of the pairs of each ID1 with varint-encoded fields:
+//    ID1 delta to the previous row, number of pairs, then per pair the ID2 delta to the
+//    previous pair of the row (to 0 for the first one) and the Ratio num and denom.
+//    The distances decoded from the Ratio are exactly those of the pairs format.
+enum class DistanceFormat {
+    Pairs,
+    Compact
+};
+
+DistanceFormat parse_distance_format(const std::string& name);
+const char* distance_format_name(DistanceFormat format);
+
+// Header of a compact distance file, written last so a partial file has no magic
+struct CompactDistanceHeader {
+    char magic[8];
+    uint64_t pairs;
+    uint64_t rows;
+    uint64_t bytes;           // encoded rows after the header
+};
+
+CompactDistanceHeader compact_distance_header(uint64_t pairs, uint64_t rows, uint64_t bytes);
+
+// Appends the rows of `count` pair counts sorted by (ID1, ID2), the previous row being
+// `previousID1`. Returns the number of rows, whose offsets in `out` go to `rowOffsets` if given.
+uint64_t encode_distance_rows(const PairCount* counts, uint64_t count, uint32_t previousID1, std::vector<uint8_t>& out,
+                              std::vector<uint64_t>* rowOffsets = nullptr);
+// Appends the pairs of `bytes` of encoded rows
+void decode_distance_rows(const uint8_t* data, uint64_t bytes, std::vector<NormalizedPair>& out);
+
+DistanceFormat distance_file_format(const std::string& filename);
+// Whether a file of either format was completely written with `pairs` pairs
+bool distance_file_complete(const std::string& filename, uint64_t pairs);
+// Reads the pairs of a distance file of either format into `pairs`
+void read_distance_file(const std::string& filename, std::vector<NormalizedPair>& pairs);
+
+#define INDEX_ROWS_PER_BUCKET 1 // Rows of the index per bucket of its lookup table, on average
+
+// Sparse CSR index written next to a distance file: the distinct ID1s of the rows in increasing
+// order, and the row pointers of their pairs, in pairs for the pairs format and in bytes after the
+// header for the compact one. A table on the high bits of ID1 - firstID1 gives the first row of
+// each bucket, and a lookup binary searches the rows of its bucket: a few when the ID1s are evenly
+// spread, more when they are skewed.
+// Layout: header, numRows + 1 row pointers, numBuckets first rows, numRows ID1s.
+struct DistanceIndexHeader {
+    char magic[8];
+    uint32_t format;          // DistanceFormat of the distance file
+    uint32_t shift;           // bucket of ID1: (ID1 - firstID1) >> shift
+    uint32_t firstID1;
+    uint32_t reserved;
+    uint64_t numRows;
+    uint64_t numBuckets;
+    uint64_t total;           // pairs or bytes of the distance file, the last row pointer
+};
+
+std::string distance_index_path(const std::string& filename);
+// `rowIDs` are the ID1s of the rows, `rowPtr` their numRows + 1 pointers
+void write_distance_index(const std::string& indexPath, DistanceFormat format, const std::vector<uint32_t>& rowIDs,
+                          const std::vector<uint64_t>& rowPtr);
+
+// Maps a distance file and its index to look up the pairs of an ID1 without scanning the file
+class DistanceFileView {
+public:
+    explicit DistanceFileView(const std::string& filename);
+
+    DistanceFormat format() const { return fileFormat; }
+    uint64_t num_pairs() const { return pairs; }
+    // ID1s with pairs, in increasing order
+    std::span<const uint32_t> row_ids() const { return {rowIDs, numRows}; }
+
+    // Pairs of ID1 in a pairs file, in O(log rows of its bucket)
+    std::span<const NormalizedPair> row(uint32_t ID1) const;
+    // Encoded row of ID1 in a compact file, in O(log rows of its bucket)
+    std::span<const uint8_t> encoded_row(uint32_t ID1) const;
+    // Appends the pairs of ID1 in either format
+    void read_row(uint32_t ID1, std::vector<NormalizedPair>& out) const;
+
+private:
+    // Bounds of the row of ID1 in the units of the format
+    std::pair<uint64_t, uint64_t> row_bounds(uint32_t ID1) const;
+
+    std::string filename;
+    MemoryMapped data;
+    MemoryMapped index;
+    DistanceFormat fileFormat;
+    uint64_t pairs;
+    uint32_t firstID1;
+    uint32_t shift;
+    uint64_t numRows;
+    uint64_t numBuckets;
+    const uint64_t* rowPtr;
+    const uint64_t* bucketRows;
+    const uint32_t* rowIDs;
+    const unsigned char* payload;  // pairs or encoded rows
+};
@@ -3,6 +3,7 @@
 #include <vector>
 #include <dpcstruct/types/PrimaryCluster.h>
 #include <dpcstruct/fileparser/PCsFileParser.h>
+#include <dpcstruct/fileparser/ShardManifest.h>
 #include <memorymapped/MemoryMapped.h>
 
 class PCsFileParser {
@@ -13,7 +14,8 @@ public:
     // Destructor to clean up the allocated buffer
     ~PCsFileParser();
 
-    // Function to load primary clusters into the buffer
+    // Function to load primary clusters into the buffer. A shard manifest loads
+    // all its shards, one after the other, so the buffer stays sorted by sID.
     void loadPCs();
 
     // Access to the buffer
@@ -22,13 +24,18 @@ public:
     // Access to the total number of lines
     uint64_t getTotalLines() const { return totalLines; }
 
+    // Offsets of the loaded shards in the buffer, {0, totalLines} for a single file
+    const std::vector<uint64_t>& getShardOffsets() const { return shardOffsets; }
+
 private:
     std::string filename;
     char* data;      // Pointer to the buffer holding raw binary data
     uint64_t totalLines;  // Total number of loaded lines
     size_t dataSize;  // Size of the buffer
+    std::vector<uint64_t> shardOffsets;
 
     // Helper function to read binary data from file
     void readBinaryData(size_t elementSize);
+    void readShards(size_t elementSize);
 
 };
\ No newline at end of file
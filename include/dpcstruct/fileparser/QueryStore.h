@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fstream>
+
+#include <dpcstruct/types/Alignment.h>
+#include <dpcstruct/types/PrimaryCluster.h>
+#include <memorymapped/MemoryMapped.h>
+
+// Memoization store of the primary clusters emitted by each query. A query is identified by
+// its queryID and a hash of its alignment block, so a rerun only reclusters the queries
+// whose alignments changed. Layout: header, SmallPC records, index entries, trailer.
+
+// Index entry of a query, offset and count in records
+struct QueryStoreEntry {
+    uint32_t queryID;
+    uint32_t reserved;
+    uint64_t hash;
+    uint64_t offset;
+    uint64_t count;
+};
+
+// Hash of the alignment fields the clustering depends on (FNV-1a, stable across runs)
+uint64_t hash_query_block(std::span<const Alignment> alignments);
+
+class QueryStore {
+public:
+    // Maps an existing store. `fingerprint` identifies the clustering parameters:
+    // a store written with other parameters is not used.
+    QueryStore(const std::string& filename, uint64_t fingerprint);
+
+    // Records stored for the query, if its alignment block is unchanged
+    bool lookup(uint32_t queryID, uint64_t hash, std::span<const SmallPC>& pcs) const;
+
+    bool valid() const { return compatible; }
+    size_t size() const { return index.size(); }
+
+private:
+    struct Entry {
+        uint64_t hash;
+        uint64_t offset;  // in records
+        uint64_t count;
+    };
+
+    std::string filename;
+    MemoryMapped data;
+    bool compatible;
+    const SmallPC* records;
+    std::unordered_map<uint32_t, Entry> index;
+};
+
+// Writes a store as queries are clustered. append() is thread-safe.
+class QueryStoreWriter {
+public:
+    QueryStoreWriter(const std::string& filename, uint64_t fingerprint);
+    ~QueryStoreWriter();
+
+    QueryStoreWriter(const QueryStoreWriter&) = delete;
+    QueryStoreWriter& operator=(const QueryStoreWriter&) = delete;
+
+    void append(uint32_t queryID, uint64_t hash, const SmallPC* pcs, uint64_t count);
+
+    // Writes the index, the store is complete only once closed
+    void close();
+
+private:
+    std::string filename;
+    std::ofstream outFile;
+    std::mutex writeMutex;
+    uint64_t numRecords;
+    std::vector<QueryStoreEntry> entries;
+    bool closed;
+};
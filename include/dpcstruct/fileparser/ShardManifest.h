@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A primary cluster file holding a contiguous range of sIDs
+struct PCShard {
+    uint32_t firstSID;
+    uint32_t lastSID;
+    uint64_t records;
+    std::string filename;  // relative to the manifest directory when written
+};
+
+// Manifest of a sharded primary cluster output: one tab-separated line per shard,
+// in increasing sID order, after a header line.
+bool is_shard_manifest(const std::string& filename);
+
+// Reads the shards of a manifest. Their filenames are resolved wrt the manifest directory.
+std::vector<PCShard> read_shard_manifest(const std::string& manifestPath);
+
+void write_shard_manifest(const std::string& manifestPath, const std::vector<PCShard>& shards);
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// Tab-separated manifest of output files: "#key<TAB>value" metadata lines, a header line
+// naming the columns, then one line per entry. Entry files are relative to the manifest.
+struct TsvManifest {
+    std::vector<std::pair<std::string, std::string>> metadata;
+    std::vector<std::string> entries;
+};
+
+// Reads a manifest, which must have `header`
+TsvManifest read_tsv_manifest(const std::string& manifestPath, const std::string& header);
+
+// The manifest is replaced atomically, so it only lists entries whose file is complete
+void write_tsv_manifest(const std::string& manifestPath, const std::string& header, const TsvManifest& manifest);
+
+// Value of a metadata key, empty if it is missing
+std::string manifest_value(const TsvManifest& manifest, const std::string& key);
@@ -1,9 +1,59 @@
 #pragma once
 
 #include <dpcstruct/types/Alignment.h>
+#include <cstdint>
 #include <vector>
 #include <span>
 
+#define CLUSTERING_VERSION 3 // Bumped whenever the labels of a query change, see query_store_fingerprint
+#define MAX_PEAKS_PER_QUERY 100 // Labels of a query, as primary cluster IDs are qID*100 + label
+#define SAMPLES_PER_STRATUM 4 // Samples of a stratum of a capped query, see sample_intervals
+#define SWEEP_MAX_NEIGHBORS (1 << 22) // Neighbor entries stored per query in sweep mode, about 80 MB per thread
+
+// Clustering parameters of one configuration of a parameter sweep
+struct ClusterParams {
+    double dpar = 0.2;
+    double rho_threshold = 10.0;
+    double delta_threshold = 0.4;
+    size_t max_peaks = 10;
+};
+
+// Reusable buffers for the per-query clustering. Each worker thread owns one, so
+// the temporaries of cluster_alignments are allocated once and only grow.
+struct ClusterWorkspace {
+    std::vector<size_t> sortedIndices;
+    std::vector<uint8_t> valid;
+    std::vector<size_t> validIndices;
+    std::vector<size_t> groupOf;     // interval group of each valid alignment
+    std::vector<size_t> groupRep;
+    std::vector<size_t> groupRank;
+    std::vector<size_t> repIndices;  // one alignment per distinct query interval
+    std::vector<uint32_t> weights;   // number of valid alignments sharing the interval
+    std::vector<uint32_t> stratumWeight;
+    std::vector<uint8_t> covered;    // representatives standing for a sample
+    std::vector<size_t> samplePos;   // sampled representatives (see sample_intervals)
+    std::vector<size_t> sampleIndices;
+    std::vector<uint32_t> sampleWeights;
+    std::vector<double> rho;
+    std::vector<double> delta;
+    std::vector<size_t> peaks;
+    std::vector<int> labels;
+    std::vector<int> labelsAll;
+
+    // Neighbor lists shared by the configurations of a sweep (see build_neighbors)
+    struct NeighborPair {
+        uint32_t i, j;
+        double d;
+    };
+    std::vector<NeighborPair> nbrPairs;
+    std::vector<size_t> nbrOffsets;
+    std::vector<uint32_t> nbrIndex;
+    std::vector<double> nbrDist;
+    std::vector<double> rhoNoise;
+    std::vector<size_t> rank;
+    std::vector<std::vector<int>> sweepLabels;
+};
+
 std::vector<size_t> get_nonredundant_indices(std::span<const Alignment> alignments, 
                                             double distanceThreshold);
 
@@ -27,4 +77,79 @@ std::vector<int> assign_labels(std::span<const Alignment> alignments,
                                 const std::vector<size_t>& peaks,
                                 double dpar=0.2);
 
-std::vector<int> cluster_alignments(std::span<const Alignment> alignments, double dpar=0.2);
+// maxAlignments > 0 caps the distinct intervals used to find the peaks of a query (see sample_intervals)
+std::vector<int> cluster_alignments(std::span<const Alignment> alignments, double dpar=0.2, size_t maxAlignments=0);
+
+// Span-based variants writing into caller-provided storage (see ClusterWorkspace)
+
+std::span<const size_t> get_nonredundant_indices(std::span<const Alignment> alignments, 
+                                                double distanceThreshold,
+                                                ClusterWorkspace& ws);
+
+void calculate_density(std::span<const Alignment> alignments, 
+                        std::span<const size_t> validIndices,
+                        std::span<double> rho,
+                        double dpar);
+
+// Collapses the valid alignments sharing the same query interval into one representative,
+// filling ws.repIndices, ws.weights (group sizes) and ws.groupOf (group of each valid alignment).
+// The densities are those of the alignments, but the delta of the representatives draws fewer
+// tie-breaking noise terms, from another seed: a query whose delta is within 1e-5 of the
+// threshold, or with peaks of equal density, can get other peaks than when clustering every alignment.
+std::span<const size_t> collapse_intervals(std::span<const Alignment> alignments,
+                                          std::span<const size_t> validIndices,
+                                          ClusterWorkspace& ws);
+
+// Density of weighted representatives: each one stands for weights[i] identical intervals
+void calculate_density(std::span<const Alignment> alignments, 
+                        std::span<const size_t> repIndices,
+                        std::span<const uint32_t> weights,
+                        std::span<double> rho,
+                        double dpar);
+
+void calculate_delta(std::span<const Alignment> alignments, 
+                    std::span<const size_t> validIndices, 
+                    std::span<const double> rho,
+                    std::span<double> delta,
+                    std::vector<size_t>& sortedIndices);
+
+void pick_peaks(std::span<const double> rho, 
+                std::span<const double> delta, 
+                std::vector<size_t>& peaks,
+                double rho_threshold, 
+                double delta_threshold, 
+                size_t max_peaks);
+
+void assign_labels(std::span<const Alignment> alignments,
+                    std::span<const size_t> validIndices, 
+                    std::span<const size_t> peaks,
+                    std::span<int> labels,
+                    double dpar);
+
+// Deterministic stratified subsample of at most maxSamples of ws.repIndices: the representatives are
+// split in coordinate order into strata of SAMPLES_PER_STRATUM samples each. In each stratum, the most
+// populated interval is sampled, weighted by the intervals closer than dpar to it, and the remaining
+// ones are sampled the same way until the stratum has its samples. The intervals no sample stands for
+// are left out of the densities. Fills ws.samplePos (positions in ws.repIndices), ws.sampleIndices
+// and ws.sampleWeights.
+std::span<const size_t> sample_intervals(std::span<const Alignment> alignments,
+                                        ClusterWorkspace& ws,
+                                        size_t maxSamples,
+                                        double dpar);
+
+std::span<const int> cluster_alignments(std::span<const Alignment> alignments, ClusterWorkspace& ws, double dpar=0.2,
+                                        size_t maxAlignments=0);
+
+// Neighbor lists (CSR in ws.nbrOffsets, ws.nbrIndex, ws.nbrDist) of the pairs of `indices` closer
+// than `radius`. Returns false if the query has more than SWEEP_MAX_NEIGHBORS entries.
+bool build_neighbors(std::span<const Alignment> alignments,
+                     std::span<const size_t> indices,
+                     double radius,
+                     ClusterWorkspace& ws);
+
+// Clusters a query once per configuration of `grid`. Distances are computed once and shared by
+// all the configurations. Returns the labels of all the alignments for each configuration.
+const std::vector<std::vector<int>>& cluster_alignments_sweep(std::span<const Alignment> alignments,
+                                                              ClusterWorkspace& ws,
+                                                              std::span<const ClusterParams> grid,
+                                                              size_t maxAlignments=0);
@@ -1,5 +1,108 @@
 #pragma once
+#include <dpcstruct/primarycluster_core.h>
 #include <dpcstruct/types/Alignment.h>
+#include <dpcstruct/types/PrimaryCluster.h>
+#include <dpcstruct/fileparser/AlnsFileParser.h>
+#include <dpcstruct/fileparser/ShardManifest.h>
+#include <dpcstruct/fileparser/QueryStore.h>
+#include <atomic>
+#include <fstream>
+#include <span>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
-std::vector<int> process_by_query(const std::vector<Alignment>& alignments, int numThreads);
+// Memoization of the per-query results across runs: queries found unchanged in `previous`
+// are copied instead of clustered, and every query is recorded in `current`
+struct QueryMemo {
+    const QueryStore* previous = nullptr;
+    QueryStoreWriter* current = nullptr;
+    std::atomic<uint64_t> reused{0};
+};
+
+// Identifies the clustering parameters a query store was written with
+uint64_t query_store_fingerprint(size_t maxAlignments);
+
+// Clusters each query and returns its primary clusters, with qSize set, in query order.
+// maxAlignments > 0 bounds the cost of the largest queries (see cluster_alignments)
+std::vector<SmallPC> process_by_query(const std::vector<Alignment>& alignments, int numThreads, size_t maxAlignments = 0,
+                                      QueryMemo* memo = nullptr);
+
+// Parameter sweep: clusters each query once per configuration of `grid`, sharing the pairwise
+// distances. Returns the primary clusters of each configuration, as process_by_query would.
+std::vector<std::vector<SmallPC>> process_by_query_sweep(const std::vector<Alignment>& alignments, int numThreads,
+                                                         std::span<const ClusterParams> grid, size_t maxAlignments = 0);
+
+// Parses a grid like "dpar=0.1,0.2:rho=5,10:delta=0.4:peaks=10" into the cartesian product of the values.
+// Missing parameters keep their default value.
+std::vector<ClusterParams> parse_param_grid(const std::string& spec);
+
+// Appends the primary clusters of a single query to `pcs`, grouped by label and with qSize already set
+void emit_primary_clusters(std::span<const Alignment> alignments, std::span<const int> labels, std::vector<SmallPC>& pcs);
+
+// Sharded output: `<stem>_<k><ext>` files of contiguous sID ranges with similar record counts,
+// listed in the manifest `<stem>_shards.tsv`
+std::string shard_path(const std::string& outPath, int shard);
+std::string shard_manifest_path(const std::string& outPath);
+
+// Buckets the primary clusters (in query order) into `numShards` sID ranges and sorts and writes
+// each shard independently. Concatenating the shards gives the sID-sorted output. Releases `pcs`.
+std::vector<PCShard> write_shards(std::vector<SmallPC>& pcs, const std::string& outPath, int numShards, int numThreads);
+
+// Splits an sID-sorted stream of `totalRecords` primary clusters into about `numShards` shards
+class ShardWriter {
+public:
+    ShardWriter(const std::string& outPath, int numShards, uint64_t totalRecords);
+
+    void write(const SmallPC* pcs, uint64_t count);
+
+    // Closes the last shard and writes the manifest
+    std::vector<PCShard> finish();
+
+private:
+    void open_shard(uint32_t sID);
+
+    std::string outPath;
+    int numShards;
+    uint64_t totalRecords;
+    uint64_t written;
+    std::vector<PCShard> shards;
+    std::ofstream outFile;
+};
+
+// Streaming primary clustering: query blocks are parsed straight from the mapped file and clustered
+// by a pool of workers. Records are spilled to sorted runs inside `tmpDir`, within `memoryBytes`,
+// and finally merged into the sID-sorted output, in several passes when the runs outnumber what
+// the budget can buffer (see ExternalSorter::merge). Returns the number of records written.
+// With numShards > 0 the output is sharded (see write_shards).
+uint64_t process_stream(AlnsFileParser& parser, const std::string& outPath, const std::string& tmpDir,
+                        uint64_t memoryBytes, int numThreads, size_t maxAlignments = 0, int numShards = 0,
+                        QueryMemo* memo = nullptr);
+
+// Drains a sorter of primary clusters into a binary file. Returns the number of records written.
+template <typename Sorter>
+uint64_t write_sorted(Sorter& sorter, const std::string& outPath) {
+    std::ofstream outFile(outPath, std::ios::binary);
+    if (!outFile) {
+        throw std::runtime_error("Failed to open output file: " + outPath);
+    }
+
+    uint64_t written = 0;
+    sorter.merge([&](const SmallPC* pcs, uint64_t count) {
+        outFile.write(reinterpret_cast<const char*>(pcs), count * sizeof(SmallPC));
+        written += count;
+    });
+
+    if (!outFile) {
+        throw std::runtime_error("Failed to write output file: " + outPath);
+    }
+    return written;
+}
+
+// Drains a sorter of primary clusters into shards. Returns the shards written.
+template <typename Sorter>
+std::vector<PCShard> write_sorted_shards(Sorter& sorter, const std::string& outPath, int numShards) {
+    ShardWriter writer(outPath, numShards, sorter.size());
+    sorter.merge([&](const SmallPC* pcs, uint64_t count) { writer.write(pcs, count); });
+    return writer.finish();
+}
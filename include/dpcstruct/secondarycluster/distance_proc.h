@@ -1,20 +1,113 @@
 #pragma once
 
+#include <array>
 #include <string>
 #include <cstdint>
 #include <vector>
 #include <atomic>
 #include <mutex>
-#include <map>
 
 #include <dpcstruct/types/ProducerConsumer.h>
 #include <dpcstruct/types/PrimaryCluster.h>
+#include <dpcstruct/secondarycluster/pair_accumulator.h>
+#include <dpcstruct/secondarycluster/pair_matching.h>
+#include <dpcstruct/fileparser/DistanceFile.h>
 #include <moodycamel/concurrentqueue.h>
 
 using namespace moodycamel;
 
+#define PAIR_TILE_MIN_COST (1 << 20)  // Minimum pA x pB comparisons worth a task
+#define PAIR_TILES_PER_PRODUCER 8     // Tasks per producer when the work is split evenly
+// Occupancy of a consumer queue. It bounds the queue, and lets idle threads block on
+// `version` (a futex-backed atomic wait) until the queue or the producers change.
+struct QueueGate {
+    std::atomic<uint64_t> queued{0};   // pairs reserved by the producers and not dequeued yet
+    std::atomic<uint32_t> version{0};  // bumped on every change a thread may wait for
+    std::atomic<int> finished{0};      // producers that ended their stream to this queue
 
-typedef std::map<uint32_t, std::map<uint32_t, Ratio> >  map2_t;
+    // Waits for room for `n` pairs, then reserves it. An empty queue always has room,
+    // and a capacity of 0 is unbounded.
+    void reserve(uint64_t n, uint64_t capacity) {
+        uint64_t current = queued.load(std::memory_order_acquire);
+        while (true) {
+            if (capacity == 0 || current == 0 || current + n <= capacity) {
+                if (queued.compare_exchange_weak(current, current + n, std::memory_order_acq_rel)) return;
+                continue;
+            }
+            uint32_t seen = version.load(std::memory_order_acquire);
+            current = queued.load(std::memory_order_acquire);
+            if (current == 0 || current + n <= capacity) continue;
+            version.wait(seen, std::memory_order_acquire);
+            current = queued.load(std::memory_order_acquire);
+        }
+    }
+
+    void release(uint64_t n) {
+        queued.fetch_sub(n, std::memory_order_acq_rel);
+        notify();
+    }
+
+    // End of the stream of a producer: its pairs are all enqueued
+    void finish() {
+        finished.fetch_add(1, std::memory_order_release);
+        notify();
+    }
+
+    void notify() {
+        version.fetch_add(1, std::memory_order_release);
+        version.notify_all();
+    }
+};
+
+// Writes the partitions of a distance file, which own increasing qID ranges and are each sorted
+// by (ID1, ID2), in any order. The thread submitting a partition serializes it right away; the
+// partition is written at its offset once the sizes of all the partitions before it are known,
+// by the thread that completes them. close() writes the compact header and the row index in
+// distance_index_path(outputFile).
+class DistanceWriter {
+public:
+    DistanceWriter(const std::string& outputFile, size_t numPartitions, DistanceFormat format = DistanceFormat::Pairs);
+    ~DistanceWriter();
+    DistanceWriter(const DistanceWriter&) = delete;
+    DistanceWriter& operator=(const DistanceWriter&) = delete;
+
+    // Serializes and writes partition `p`, releasing its counts. Thread-safe.
+    void submit(size_t p, std::vector<PairCount>& counts);
+    // Once every partition is submitted. Returns the number of pairs written.
+    uint64_t close();
+
+private:
+    struct Partition {
+        bool submitted = false;
+        uint64_t pairs = 0;
+        std::vector<NormalizedPair> distances;  // pairs format
+        std::vector<PairCount> firstRow;        // compact: encoded once the previous ID1 is known
+        std::vector<uint8_t> head;              // the encoded first row
+        std::vector<uint8_t> encoded;           // the encoded rows after the first one
+        std::vector<uint32_t> rowIDs;
+        std::vector<uint64_t> rowStarts;        // pairs, or bytes of `encoded`, in the partition
+        uint64_t fileOffset = 0;
+    };
+
+    // Gives the submitted partitions following the placed ones their offset and index rows
+    std::vector<size_t> place_submitted();
+    void write_partition(Partition& partition);
+
+    std::string outputFile;
+    DistanceFormat format;
+    int fd;
+    std::vector<Partition> partitions;
+    std::mutex placeMutex;
+    size_t nextPlaced;                  // the partitions before it have their offset
+    uint64_t offset;                    // file offset of the next partition placed
+    uint64_t pairs;
+    uint64_t rows;
+    uint32_t previousID1;               // last ID1 of the partitions placed
+    std::vector<uint32_t> indexIDs;
+    std::vector<uint64_t> rowPtr;
+    std::atomic<bool> failed;
+    bool closed;
+};
 
 struct ThreadData {
     int numConsumers;
@@ -25,28 +118,137 @@ struct ThreadData {
     uint64_t totalLinesA;
     uint64_t totalLinesB;
 
-    std::atomic<int> doneProducers;
     uint32_t producerRankCount;
     uint32_t consumerRankCount;
 
-    std::vector<map2_t> vec_maps;    // Vector of maps for storing results, one per consumer
+    std::vector<PairAccumulator> accumulators;    // Pair counts, one accumulator per consumer
     std::vector<ConcurrentQueue<MatchedPair>> queues;  // Queues for communication between producers and consumers
+    std::vector<QueueGate> gates;                      // Occupancy and wake-ups of each queue
+    uint64_t queueCapacity;                            // Pairs per queue before producers block, 0: unbounded
 
     std::vector<uint64_t> qIDs_partition;  // Balanced partition of qIDs for `numConsumers-1`
+    ConsumerRouter router;                 // Consumer of a qID1 in `qIDs_partition`, in constant time
     std::vector<std::array<uint64_t, 2>> partIndices;  // Partition indices for the files
+    std::vector<PairTile> tiles;                       // Shared task pool of the producers
+    std::atomic<uint64_t> nextTile;                    // Next task of the pool
 
     double countFactor; 
 
     std::mutex rankMutex;  // mutex to control rank counters
 
+    DistanceWriter* writer = nullptr;  // Given, each partition is submitted when counted instead of returned
+
     
     // Constructor
     ThreadData(int numProducers, int numConsumers)
         : numProducers(numProducers), numConsumers(numConsumers), bufferA(nullptr), bufferB(nullptr), 
-          totalLinesA(0), totalLinesB(0), doneProducers(0), producerRankCount(0), consumerRankCount(0),
-          vec_maps(numConsumers), queues(numConsumers), qIDs_partition(numConsumers - 1, 0), partIndices(numProducers + 1), 
-          countFactor(1.0) {}
+          totalLinesA(0), totalLinesB(0), producerRankCount(0), consumerRankCount(0),
+          accumulators(numConsumers), queues(numConsumers), gates(numConsumers), queueCapacity(0), qIDs_partition(numConsumers - 1, 0), partIndices(numProducers + 1), 
+          nextTile(0), countFactor(1.0) {}
+};
+// Strategy used to count the matched pairs
+enum class DistanceEngine {
+    Queue,      // producers stream pairs to consumers owning qID ranges
+    MapReduce,  // workers buffer pairs by qID range, then each range is sorted and reduced
+    SpGEMM      // sparse product of the PC -> interval incidence matrices
 };
-void balanced_partition(std::vector<uint64_t>& partitionArray, SmallPC* buffer, uint64_t totalLines, int numConsumers);
-void calculate_distance_matrix(const std::string& inputFileA, const std::string& inputFileB, const std::string& outputFile, int numProducers, int numConsumers);
-void calculate_block_distance(const std::string& inputFile, const std::string& inputFileB, const std::string& outputFile, int numProducers, int numConsumers);
+
+DistanceEngine parse_distance_engine(const std::string& name);
+const char* distance_engine_name(DistanceEngine engine);
+
+// Engines: pair counts of each qID range of `qIDs_partition`, sorted by (ID1, ID2)
+std::vector<std::vector<PairCount>> queue_pair_counts(ThreadData& threadData);
+std::vector<std::vector<PairCount>> mapreduce_pair_counts(ThreadData& threadData);
+std::vector<std::vector<PairCount>> spgemm_pair_counts(ThreadData& threadData);
+
+void balanced_partition(std::vector<uint64_t>& partitionArray, const SmallPC* bufferA, uint64_t totalLinesA,
+                        const SmallPC* bufferB, uint64_t totalLinesB, int numConsumers);
+void files_partition(std::vector<std::array<uint64_t, 2>>& partIndices, SmallPC* bufferA, SmallPC* bufferB,
+                     uint64_t totalLinesA, uint64_t totalLinesB, int numProducers, const std::vector<uint64_t>& shardOffsetsA);
+std::vector<PairTile> pair_tiles(const SmallPC* bufferA, const SmallPC* bufferB, uint64_t totalLinesA, uint64_t totalLinesB,
+                                 int numProducers);
+// Pair counts between two loaded buffers of primary clusters, one vector per qID range.
+// The same buffer as A and B is a self join. With a `writer`, the engine submits each range to
+// it as soon as it is counted, and the returned vectors are empty.
+std::vector<std::vector<PairCount>> count_block_pairs(SmallPC* pcsBufferA, uint64_t totalLinesA, SmallPC* pcsBufferB, uint64_t totalLinesB,
+                                                      const std::vector<uint64_t>& shardOffsetsA,
+                                                      int numProducers, int numConsumers, DistanceEngine engine,
+                                                      uint64_t queueCapacity = 0, DistanceWriter* writer = nullptr);
+// Writes the distances of the pair counts, releasing them. Returns the number of pairs written.
+// Up to `numThreads` threads submit the partitions to a DistanceWriter.
+uint64_t write_distances(std::vector<std::vector<PairCount>>& pairCounts, const std::string& outputFile,
+                         int numThreads = 1, DistanceFormat format = DistanceFormat::Pairs);
+// Distances between two loaded buffers of primary clusters, written to `outputFile` as the
+// engine finishes each qID range
+uint64_t compute_block_distance(SmallPC* pcsBufferA, uint64_t totalLinesA, SmallPC* pcsBufferB, uint64_t totalLinesB,
+                                const std::vector<uint64_t>& shardOffsetsA, const std::string& outputFile,
+                                int numProducers, int numConsumers, DistanceEngine engine, uint64_t queueCapacity = 0,
+                                DistanceFormat format = DistanceFormat::Pairs);
+// With `numCheckpoints` > 0, the sID range is computed in that many chunks, whose partial counts are
+// kept in checkpoint_dir(outputFile). `resume` reuses the chunks completed by an interrupted run.
+void calculate_block_distance(const std::string& inputFile, const std::string& inputFileB, const std::string& outputFile, int numProducers, int numConsumers,
+                              DistanceEngine engine = DistanceEngine::Queue, int numCheckpoints = 0, bool resume = false,
+                              uint64_t queueCapacity = 0, DistanceFormat format = DistanceFormat::Pairs);
+
+// Checkpoints of a block: the partial counts of each chunk of sIDs and a progress manifest
+struct CheckpointChunk {
+    int chunk;                // 1-based chunk index
+    uint32_t firstSID;
+    uint32_t lastSID;
+    uint64_t pairs;           // partial pair counts in the chunk file
+    std::string filename;     // relative to the checkpoint directory when written
+};
+
+// Inputs of the block whose chunks are checkpointed: a resume with other inputs is refused
+struct CheckpointInputs {
+    std::string inputFileA;   // absolute paths
+    std::string inputFileB;
+    uint64_t totalLinesA;
+    uint64_t totalLinesB;
+    int numCheckpoints;
+
+    bool operator==(const CheckpointInputs&) const = default;
+};
+
+struct CheckpointProgress {
+    CheckpointInputs inputs;
+    std::vector<CheckpointChunk> chunks;
+};
+
+std::string checkpoint_dir(const std::string& outputFile);                 // <output>.ckpt
+// The progress of a checkpoint directory, without chunks if it has no manifest
+CheckpointProgress read_checkpoint_progress(const std::string& checkpointDir);
+void write_checkpoint_progress(const std::string& checkpointDir, const CheckpointProgress& progress);
+void remove_checkpoints(const std::string& outputFile);
+
+// Pair counts of the block computed chunk by chunk, each flushed to its checkpoint when done.
+// The counts of the chunks are routed to the qID ranges of the whole block, each range being
+// reduced by its own thread, so there is one vector per consumer sorted by (ID1, ID2).
+// The input files only identify the block in the progress manifest.
+std::vector<std::vector<PairCount>> checkpointed_pair_counts(SmallPC* pcsBufferA, uint64_t totalLinesA, SmallPC* pcsBufferB,
+                                                             uint64_t totalLinesB, const std::string& inputFileA,
+                                                             const std::string& inputFileB, const std::string& outputFile,
+                                                             int numProducers, int numConsumers, DistanceEngine engine,
+                                                             int numCheckpoints, bool resume, uint64_t queueCapacity = 0);
+
+// Tile (i, j) of the full distance matrix: the distances between the shards i <= j of a shard list
+struct DistanceTile {
+    int i, j;                 // 1-based shard indices
+    uint64_t pairs;           // distances in the tile file
+    std::string filename;     // relative to the manifest directory when written
+};
+
+std::string tile_path(const std::string& outputFile, int i, int j);        // <stem>_<i>_<j><ext>
+std::string tile_manifest_path(const std::string& outputFile);             // <stem>_tiles.tsv
+
+// Manifest of the tiles of a distance matrix, one tab-separated line per tile after a header line
+std::vector<DistanceTile> read_tile_manifest(const std::string& manifestPath);
+void write_tile_manifest(const std::string& manifestPath, const std::vector<DistanceTile>& tiles);
+
+// Full distance matrix between the primary cluster files of `shardList` (one path per line,
+// each file sorted by sID, with disjoint sets of queries). The upper triangle of tiles is computed,
+// the diagonal as self joins, with the loaded shards cached within `memoryBytes`.
+// `resume` skips the tiles of the manifest left by an interrupted run.
+void calculate_distance_matrix(const std::string& shardList, const std::string& outputFile, int numProducers, int numConsumers,
+                               DistanceEngine engine, uint64_t memoryBytes, bool resume = false, uint64_t queueCapacity = 0,
+                               DistanceFormat format = DistanceFormat::Pairs);
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <dpcstruct/types/ProducerConsumer.h>
+#include <dpcstruct/sort.h>
+
+#define ACCUMULATOR_MIN_CAPACITY 1024 // Initial slots of a pair accumulator
+
+// Counts of matched pairs in a flat open-addressing table keyed on the packed (ID1, ID2).
+// A new pair takes the normFactor of its first match as denominator, later matches only
+// increase the numerator. The sorted output is produced once, by sorted().
+class PairAccumulator {
+public:
+    explicit PairAccumulator(size_t capacity = ACCUMULATOR_MIN_CAPACITY) : numPairs(0) {
+        size_t slots = ACCUMULATOR_MIN_CAPACITY;
+        while (slots < 2 * capacity) slots <<= 1;
+        table.assign(slots, empty_slot());
+        mask = slots - 1;
+    }
+
+    inline void add(uint32_t id1, uint32_t id2, uint32_t normFactor) {
+        uint64_t key = (static_cast<uint64_t>(id1) << 32) | id2;
+        size_t pos = hash(key) & mask;
+
+        // Linear probing
+        while (true) {
+            PairCount& slot = table[pos];
+            if (slot.key() == key) {
+                slot.ratio.num += 1;
+                return;
+            }
+            if (slot.key() == EMPTY_KEY) break;
+            pos = (pos + 1) & mask;
+        }
+
+        table[pos] = PairCount(id1, id2, Ratio(1, normFactor));
+        if (++numPairs * 2 > table.size()) grow();
+    }
+
+    size_t size() const { return numPairs; }
+
+    // Pairs sorted by (ID1, ID2). The accumulator is left empty.
+    std::vector<PairCount> sorted() {
+        std::vector<PairCount> pairs;
+        pairs.reserve(numPairs);
+        for (const auto& slot : table) {
+            if (slot.key() != EMPTY_KEY) pairs.push_back(slot);
+        }
+        std::vector<PairCount>().swap(table);
+        *this = PairAccumulator();
+
+        radix_sort(pairs.data(), pairs.size(), [](const PairCount& p) { return p.key(); }, 1);
+        return pairs;
+    }
+
+private:
+    // (UINT32_MAX, UINT32_MAX) is never a pair, as ID1 < ID2
+    static constexpr uint64_t EMPTY_KEY = ~0ULL;
+
+    static PairCount empty_slot() { return PairCount(UINT32_MAX, UINT32_MAX, Ratio(0, 0)); }
+
+    // Finalizer of MurmurHash3: consecutive IDs spread over the whole table
+    static inline uint64_t hash(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    void grow() {
+        std::vector<PairCount> old(table.size() * 2, empty_slot());
+        old.swap(table);
+        mask = table.size() - 1;
+
+        for (const auto& slot : old) {
+            if (slot.key() == EMPTY_KEY) continue;
+            size_t pos = hash(slot.key()) & mask;
+            while (table[pos].key() != EMPTY_KEY) pos = (pos + 1) & mask;
+            table[pos] = slot;
+        }
+    }
+
+    std::vector<PairCount> table;
+    size_t mask;
+    size_t numPairs;
+};
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <dpcstruct/distance.h>
+#include <dpcstruct/types/PrimaryCluster.h>
+#include <dpcstruct/types/ProducerConsumer.h>
+
+// Integer form of distance(a, b) <= 0.2, i.e. 5 * intersection >= 4 * union
+inline bool domains_match(const SmallPC& a, const SmallPC& b) {
+    int intersection = std::max(0, std::min<int>(a.send, b.send) - std::max<int>(a.sstart, b.sstart) + 1);
+    int unionLength = std::max<int>(a.send, b.send) - std::min<int>(a.sstart, b.sstart) + 1;
+    return 5 * intersection >= 4 * unionLength;
+}
+
+// Bounds on the start of the domains matching `a`. A match has union - intersection <= union / 5
+// and union <= 5/4 of the length of `a`, so the starts differ by at most a quarter of that length.
+inline std::pair<int, int> match_start_window(const SmallPC& a) {
+    int reach = (a.send - a.sstart + 1) / 4;
+    return {a.sstart - reach, a.sstart + reach};
+}
+
+// Calls emit(const MatchedPair&) for every pair of primary clusters, one from A and one from B,
+// with a domain on the same sID and overlapping intervals (distance <= 0.2). Both ranges are
+// sorted by sID. `countFactor` scales the normalization factor of the pairs.
+// Each sID group of B is sorted by sstart, and a domain of A is only tested against the domains
+// of B starting in its match_start_window.
+template <typename Emit>
+void for_each_matched_pair(const SmallPC* alA, uint64_t linesA, const SmallPC* alB, uint64_t linesB,
+                           double countFactor, Emit&& emit) {
+    uint64_t posA{0}, posB{0};
+    std::vector<SmallPC> groupB;
+
+    while (posA < linesA && posB < linesB) {
+        while (posB < linesB && alB->sID < alA->sID) {
+            ++alB;
+            ++posB;
+        }
+        while (posA < linesA && posB < linesB && alB->sID > alA->sID) {
+            ++alA;
+            ++posA;
+        }
+        if (posA >= linesA || posB >= linesB || alB->sID != alA->sID) continue;
+
+        uint32_t s0 = alA->sID;
+        const SmallPC* init_subA = alA;
+        const SmallPC* init_subB = alB;
+
+        while (posA < linesA && alA->sID == s0) {
+            ++alA;
+            ++posA;
+        }
+        while (posB < linesB && alB->sID == s0) {
+            ++alB;
+            ++posB;
+        }
+
+        groupB.assign(init_subB, alB);
+        std::sort(groupB.begin(), groupB.end(), [](const SmallPC& x, const SmallPC& y) { return x.sstart < y.sstart; });
+
+        // sweep the domains of B with a start close enough to each domain of A
+        for (auto pA = init_subA; pA < alA; ++pA) {
+            auto [lo, hi] = match_start_window(*pA);
+            auto pB = std::lower_bound(groupB.begin(), groupB.end(), lo,
+                                       [](const SmallPC& pc, int start) { return pc.sstart < start; });
+
+            for (; pB != groupB.end() && pB->sstart <= hi; ++pB) {
+                if (domains_match(*pA, *pB)) {
+                    auto qID1 = std::min(pA->qID, pB->qID);
+                    auto qID2 = std::max(pA->qID, pB->qID);
+                    auto norm = std::min(pA->qSize, pB->qSize);
+
+                    if (qID1 == qID2) continue;
+
+                    emit(MatchedPair(qID1, qID2, countFactor * norm));
+                }
+            }
+        }
+    }
+}
+
+// Same as for_each_matched_pair for a range matched with itself: each unordered pair of records
+// is visited once, instead of once per order as with the range passed as both A and B.
+template <typename Emit>
+void for_each_self_matched_pair(const SmallPC* al, uint64_t lines, double countFactor, Emit&& emit) {
+    std::vector<SmallPC> group;
+
+    for (uint64_t begin = 0, end; begin < lines; begin = end) {
+        for (end = begin + 1; end < lines && al[end].sID == al[begin].sID; ++end) {}
+
+        group.assign(al + begin, al + end);
+        std::sort(group.begin(), group.end(), [](const SmallPC& x, const SmallPC& y) { return x.sstart < y.sstart; });
+
+        // only the domains after pA in start order, whose start is within the window of pA
+        for (auto pA = group.begin(); pA != group.end(); ++pA) {
+            int hi = match_start_window(*pA).second;
+            for (auto pB = pA + 1; pB != group.end() && pB->sstart <= hi; ++pB) {
+                if (pA->qID != pB->qID && domains_match(*pA, *pB)) {
+                    emit(MatchedPair(std::min(pA->qID, pB->qID), std::max(pA->qID, pB->qID),
+                                     countFactor * std::min(pA->qSize, pB->qSize)));
+                }
+            }
+        }
+    }
+}
+
+// Task of the pA x pB product: the records [beginA, endA) of A against [beginB, endB) of B.
+// A tile holds whole sID groups, or a sub-tile of a single oversized group. A self-join tile
+// matches a range of a file with itself, once per unordered pair.
+struct PairTile {
+    uint64_t beginA, endA;
+    uint64_t beginB, endB;
+    uint64_t cost;  // comparisons of the tile, |A_s| x |B_s| summed over its groups
+    bool selfJoin;
+};
+
+// Calls emit(const MatchedPair&) for the matched pairs of a tile
+template <typename Emit>
+void for_each_tile_pair(const SmallPC* bufferA, const SmallPC* bufferB, const PairTile& tile, double countFactor, Emit&& emit) {
+    if (tile.selfJoin) {
+        for_each_self_matched_pair(bufferA + tile.beginA, tile.endA - tile.beginA, countFactor, emit);
+    } else {
+        for_each_matched_pair(bufferA + tile.beginA, tile.endA - tile.beginA, bufferB + tile.beginB, tile.endB - tile.beginB,
+                              countFactor, emit);
+    }
+}
+
+// Index of the qID range (consumer or partition) that owns the pairs with this qID1
+inline int consumer_of(uint32_t qID1, const std::vector<uint64_t>& qIDs_partition) {
+    int numConsumers = qIDs_partition.size() + 1;
+    for (int i = 0; i < numConsumers - 1; ++i) {
+        if (qID1 < qIDs_partition[i]) return i;
+    }
+    return numConsumers - 1;
+}
+
+#define ROUTER_TABLE_BITS 12 // Buckets of the routing table: 2^ROUTER_TABLE_BITS at most
+
+// Constant-time consumer_of. A table on the high bits of qID gives the qID range at the start
+// of each bucket, and only the few range bounds inside the bucket are checked after it.
+class ConsumerRouter {
+public:
+    ConsumerRouter() = default;
+
+    explicit ConsumerRouter(const std::vector<uint64_t>& qIDs_partition) : bounds(qIDs_partition), shift(0) {
+        uint64_t last = bounds.empty() ? 0 : bounds.back();
+        while ((last >> shift) >= (1ULL << ROUTER_TABLE_BITS)) ++shift;
+
+        table.resize((last >> shift) + 1);
+        uint16_t range = 0;
+        for (uint64_t b = 0; b < table.size(); ++b) {
+            while (range < bounds.size() && (b << shift) >= bounds[range]) ++range;
+            table[b] = range;
+        }
+    }
+
+    int operator()(uint32_t qID1) const {
+        if (bounds.empty() || qID1 >= bounds.back()) return bounds.size();
+        int range = table[qID1 >> shift];
+        while (qID1 >= bounds[range]) ++range;
+        return range;
+    }
+
+private:
+    std::vector<uint64_t> bounds;
+    std::vector<uint16_t> table;
+    int shift = 0;
+};
@@ -1,5 +1,123 @@
 #pragma once
 
-// LSB radix sort of record with respect to specified key
-void radix_sort(unsigned char * pData, uint64_t count, uint32_t record_size, 
-                uint32_t key_size, uint32_t key_offset = 0);
\ No newline at end of file
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <omp.h>
+
+#define RADIX_MIN_CHUNK 65536 // Minimum records per thread worth a parallel pass
+
+// Parallel LSD radix sort of records with respect to an unsigned key.
+// `key` maps a record to its key (e.g. [](const SmallPC& pc) { return pc.sID; }),
+// so record and key types are known at compile time. The sort is stable and
+// skips the byte passes in which all keys share the same value.
+template <typename Record, typename KeyFn>
+void radix_sort(Record* pData, uint64_t count, KeyFn key, int numThreads = omp_get_max_threads()) {
+    using Key = std::invoke_result_t<KeyFn, const Record&>;
+    static_assert(std::is_unsigned_v<Key>, "radix_sort needs an unsigned integer key");
+    static_assert(std::is_trivially_copyable_v<Record>, "radix_sort moves records as raw bytes");
+
+    constexpr int numPasses = sizeof(Key);
+    typedef std::array<uint64_t, 256> histogram_t;
+
+    if (count < 2) return;
+
+    numThreads = std::max<int>(1, std::min<uint64_t>(numThreads, count / RADIX_MIN_CHUNK));
+
+    // Contiguous chunk of records handled by a thread
+    auto chunk = [count, numThreads](int tid) {
+        return std::make_pair(count * tid / numThreads, count * (tid + 1) / numThreads);
+    };
+
+    // Per-chunk histograms of all the key bytes, in a single read
+    std::vector<std::array<histogram_t, numPasses>> localHist(numThreads);
+
+    #pragma omp parallel for num_threads(numThreads) schedule(static, 1)
+    for (int tid = 0; tid < numThreads; ++tid) {
+        auto [begin, end] = chunk(tid);
+        auto& hist = localHist[tid];
+        for (auto& h : hist) h.fill(0);
+
+        for (uint64_t i = begin; i < end; ++i) {
+            Key k = key(pData[i]);
+            for (int p = 0; p < numPasses; ++p) {
+                ++hist[p][(k >> (8 * p)) & 0xff];
+            }
+        }
+    }
+
+    // A pass is only needed if its byte is not the same for every key
+    std::vector<int> passes;
+    Key firstKey = key(pData[0]);
+    for (int p = 0; p < numPasses; ++p) {
+        uint64_t sameByte = 0;
+        for (int t = 0; t < numThreads; ++t) {
+            sameByte += localHist[t][p][(firstKey >> (8 * p)) & 0xff];
+        }
+        if (sameByte != count) passes.push_back(p);
+    }
+
+    if (passes.empty()) return;
+
+    // Scratch buffer, left uninitialized
+    auto deleter = [](Record* p) { ::operator delete(p, std::align_val_t(alignof(Record))); };
+    std::unique_ptr<Record, decltype(deleter)> pTemp(
+        static_cast<Record*>(::operator new(count * sizeof(Record), std::align_val_t(alignof(Record)))), deleter);
+
+    Record* pSrc = pData;
+    Record* pDst = pTemp.get();
+    std::vector<histogram_t> offsets(numThreads);
+
+    for (size_t n = 0; n < passes.size(); ++n) {
+        int p = passes[n];
+        int shift = 8 * p;
+
+        // The first pass reads the original data, whose histograms are already known
+        if (n > 0) {
+            #pragma omp parallel for num_threads(numThreads) schedule(static, 1)
+            for (int tid = 0; tid < numThreads; ++tid) {
+                auto [begin, end] = chunk(tid);
+                histogram_t& hist = localHist[tid][p];
+                hist.fill(0);
+                for (uint64_t i = begin; i < end; ++i) {
+                    ++hist[(key(pSrc[i]) >> shift) & 0xff];
+                }
+            }
+        }
+
+        // Bucket-major, chunk-minor offsets keep the sort stable
+        uint64_t offset = 0;
+        for (int b = 0; b < 256; ++b) {
+            for (int t = 0; t < numThreads; ++t) {
+                offsets[t][b] = offset;
+                offset += localHist[t][p][b];
+            }
+        }
+
+        #pragma omp parallel for num_threads(numThreads) schedule(static, 1)
+        for (int tid = 0; tid < numThreads; ++tid) {
+            auto [begin, end] = chunk(tid);
+            histogram_t& pos = offsets[tid];
+            for (uint64_t i = begin; i < end; ++i) {
+                pDst[pos[(key(pSrc[i]) >> shift) & 0xff]++] = pSrc[i];
+            }
+        }
+
+        std::swap(pSrc, pDst);
+    }
+
+    // An odd number of passes leaves the result in the scratch buffer
+    if (pSrc != pData) {
+        #pragma omp parallel for num_threads(numThreads) schedule(static, 1)
+        for (int tid = 0; tid < numThreads; ++tid) {
+            auto [begin, end] = chunk(tid);
+            std::memcpy(pData + begin, pSrc + begin, (end - begin) * sizeof(Record));
+        }
+    }
+}
@@ -32,3 +32,16 @@ struct Ratio
 
     inline double as_double() const {return (double)num/denom;}
 };
+
+// Accumulated count of a pair of primary clusters
+struct PairCount
+{
+    uint32_t ID1;
+    uint32_t ID2;
+    Ratio ratio;
+
+    PairCount()=default;
+    PairCount(uint32_t id1, uint32_t id2, Ratio r):  ID1(id1), ID2(id2), ratio(r) {}
+
+    inline uint64_t key() const {return (static_cast<uint64_t>(ID1) << 32) | ID2;}
+};
@@ -1,9 +1,11 @@
+#include <algorithm>
+#include <cstring>
 #include <sstream>
 #include <dpcstruct/types/Alignment.h>
 #include <dpcstruct/fileparser/AlnsFileParser.h>
 
 AlnsFileParser::AlnsFileParser(const std::string& filename)
-    : filename(filename), data(filename, MemoryMapped::WholeFile, MemoryMapped::SequentialScan) {
+    : filename(filename), data(filename, MemoryMapped::WholeFile, MemoryMapped::SequentialScan), cursor(0) {
     if (!data.isValid()) {
         throw std::runtime_error("Failed to map file: " + filename);
     }
@@ -72,6 +74,61 @@ void AlnsFileParser::loadAlignments(std::vector<Alignment>& aligns, uint64_t ski
 }
 
 
+// Reads the leading queryID of a line without parsing the rest of it
+static uint64_t peek_queryID(const char* lineStart, const char* lineEnd) {
+    uint64_t queryID = 0;
+    for (const char* p = lineStart; p < lineEnd && *p >= '0' && *p <= '9'; ++p) {
+        queryID = queryID * 10 + (*p - '0');
+    }
+    return queryID;
+}
+
+bool AlnsFileParser::nextQueryBlock(const char*& blockStart, const char*& blockEnd) {
+    const char* buffer = reinterpret_cast<const char*>(data.getData());
+    uint64_t dataSize = data.size();
+
+    // Skip empty lines
+    while (cursor < dataSize && buffer[cursor] == '\n') {
+        ++cursor;
+    }
+    if (cursor >= dataSize) {
+        return false;
+    }
+
+    blockStart = buffer + cursor;
+    const char* firstEnd = static_cast<const char*>(std::memchr(blockStart, '\n', dataSize - cursor));
+    if (firstEnd == nullptr) firstEnd = buffer + dataSize;
+    uint64_t queryID = peek_queryID(blockStart, firstEnd);
+
+    // Extend the block while the following lines belong to the same query
+    const char* lineStart = blockStart;
+    while (lineStart < buffer + dataSize) {
+        const char* lineEnd = static_cast<const char*>(std::memchr(lineStart, '\n', buffer + dataSize - lineStart));
+        if (lineEnd == nullptr) lineEnd = buffer + dataSize;
+
+        if (lineEnd != lineStart && peek_queryID(lineStart, lineEnd) != queryID) break;
+
+        lineStart = lineEnd + 1;
+    }
+
+    blockEnd = std::min(lineStart, buffer + dataSize);
+    cursor = blockEnd - buffer;
+    return true;
+}
+
+void AlnsFileParser::parseBlock(const char* blockStart, const char* blockEnd, std::vector<Alignment>& aligns) {
+    const char* lineStart = blockStart;
+    while (lineStart < blockEnd) {
+        const char* lineEnd = static_cast<const char*>(std::memchr(lineStart, '\n', blockEnd - lineStart));
+        if (lineEnd == nullptr) lineEnd = blockEnd;
+
+        parseLine(lineStart, lineEnd, aligns);
+
+        lineStart = lineEnd + 1;
+    }
+}
+
+
 void AlnsFileParser::parseLine(const char* lineStart, const char* lineEnd, std::vector<Alignment>& localAligns) {
     uint32_t queryID, queryStart, queryEnd, queryLength;
     uint32_t searchID, searchStart, searchEnd, searchLength;
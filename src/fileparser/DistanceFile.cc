@@ -0,0 +1,302 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#include <dpcstruct/fileparser/DistanceFile.h>
+
+static const char COMPACT_MAGIC[8] = {'D', 'P', 'C', 'D', 'I', 'S', 'T', '1'};
+static const char INDEX_MAGIC[8] = {'D', 'P', 'C', 'D', 'I', 'D', 'X', '2'};
+
+DistanceFormat parse_distance_format(const std::string& name) {
+    if (name == "pairs") return DistanceFormat::Pairs;
+    if (name == "compact") return DistanceFormat::Compact;
+    throw std::invalid_argument("Unknown distance format: " + name + " (use pairs or compact)");
+}
+
+const char* distance_format_name(DistanceFormat format) {
+    switch (format) {
+        case DistanceFormat::Pairs: return "pairs";
+        case DistanceFormat::Compact: return "compact";
+    }
+    return "unknown";
+}
+
+CompactDistanceHeader compact_distance_header(uint64_t pairs, uint64_t rows, uint64_t bytes) {
+    CompactDistanceHeader header;
+    std::memcpy(header.magic, COMPACT_MAGIC, sizeof(COMPACT_MAGIC));
+    header.pairs = pairs;
+    header.rows = rows;
+    header.bytes = bytes;
+    return header;
+}
+
+
+static inline void put_varint(uint32_t value, std::vector<uint8_t>& out) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+static inline uint32_t get_varint(const uint8_t*& p, const uint8_t* end) {
+    uint32_t value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (p == end) break;
+        uint8_t byte = *p++;
+        value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    throw std::runtime_error("Error: truncated or malformed compact distance rows");
+}
+
+uint64_t encode_distance_rows(const PairCount* counts, uint64_t count, uint32_t previousID1, std::vector<uint8_t>& out,
+                              std::vector<uint64_t>* rowOffsets) {
+    uint64_t rows = 0;
+    for (uint64_t begin = 0; begin < count;) {
+        uint32_t ID1 = counts[begin].ID1;
+        if (rowOffsets) rowOffsets->push_back(out.size());
+        uint64_t end = begin;
+        while (end < count && counts[end].ID1 == ID1) ++end;
+
+        put_varint(ID1 - previousID1, out);
+        put_varint(static_cast<uint32_t>(end - begin), out);
+        uint32_t previousID2 = 0;
+        for (uint64_t i = begin; i < end; ++i) {
+            put_varint(counts[i].ID2 - previousID2, out);
+            put_varint(counts[i].ratio.num, out);
+            put_varint(counts[i].ratio.denom, out);
+            previousID2 = counts[i].ID2;
+        }
+
+        previousID1 = ID1;
+        begin = end;
+        ++rows;
+    }
+    return rows;
+}
+
+void decode_distance_rows(const uint8_t* data, uint64_t bytes, std::vector<NormalizedPair>& out) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + bytes;
+    uint32_t ID1 = 0;
+    while (p < end) {
+        ID1 += get_varint(p, end);
+        uint32_t rowPairs = get_varint(p, end);
+        uint32_t ID2 = 0;
+        for (uint32_t k = 0; k < rowPairs; ++k) {
+            ID2 += get_varint(p, end);
+            Ratio ratio;
+            ratio.num = get_varint(p, end);
+            ratio.denom = get_varint(p, end);
+            out.emplace_back(ID1, ID2, 1.0 - ratio.as_double());
+        }
+    }
+}
+
+
+static bool read_compact_header(std::ifstream& infile, CompactDistanceHeader& header) {
+    infile.read(reinterpret_cast<char*>(&header), sizeof(CompactDistanceHeader));
+    return infile && std::memcmp(header.magic, COMPACT_MAGIC, sizeof(COMPACT_MAGIC)) == 0;
+}
+
+DistanceFormat distance_file_format(const std::string& filename) {
+    std::ifstream infile(filename, std::ios::binary);
+    if (!infile) {
+        throw std::runtime_error("Error: Unable to open file " + filename);
+    }
+    CompactDistanceHeader header;
+    return read_compact_header(infile, header) ? DistanceFormat::Compact : DistanceFormat::Pairs;
+}
+
+bool distance_file_complete(const std::string& filename, uint64_t pairs) {
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(filename, ec);
+    if (ec) return false;
+
+    std::ifstream infile(filename, std::ios::binary);
+    CompactDistanceHeader header;
+    if (read_compact_header(infile, header)) {
+        return header.pairs == pairs && size == sizeof(CompactDistanceHeader) + header.bytes;
+    }
+    return size == pairs * sizeof(NormalizedPair);
+}
+
+void read_distance_file(const std::string& filename, std::vector<NormalizedPair>& pairs) {
+    std::ifstream infile(filename, std::ios::binary | std::ios::ate);
+    if (!infile) {
+        throw std::runtime_error("Error: Unable to open file " + filename);
+    }
+    uint64_t size = infile.tellg();
+    infile.seekg(0);
+
+    pairs.clear();
+    CompactDistanceHeader header;
+    if (size >= sizeof(CompactDistanceHeader) && read_compact_header(infile, header)) {
+        if (size != sizeof(CompactDistanceHeader) + header.bytes) {
+            throw std::runtime_error("Error: " + filename + " is an incomplete compact distance file");
+        }
+        std::vector<uint8_t> rows(header.bytes);
+        infile.read(reinterpret_cast<char*>(rows.data()), header.bytes);
+        pairs.reserve(header.pairs);
+        decode_distance_rows(rows.data(), rows.size(), pairs);
+        if (!infile || pairs.size() != header.pairs) {
+            throw std::runtime_error("Error: malformed compact distance file " + filename);
+        }
+        return;
+    }
+
+    infile.clear();
+    infile.seekg(0);
+    pairs.resize(size / sizeof(NormalizedPair));
+    infile.read(reinterpret_cast<char*>(pairs.data()), pairs.size() * sizeof(NormalizedPair));
+    if (!infile) {
+        throw std::runtime_error("Error: Unable to read file " + filename);
+    }
+}
+
+
+std::string distance_index_path(const std::string& filename) {
+    return filename + ".idx";
+}
+
+// The index is replaced atomically, so it always matches a complete distance file
+void write_distance_index(const std::string& indexPath, DistanceFormat format, const std::vector<uint32_t>& rowIDs,
+                          const std::vector<uint64_t>& rowPtr) {
+    DistanceIndexHeader header;
+    std::memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.format = static_cast<uint32_t>(format);
+    header.shift = 0;
+    header.firstID1 = rowIDs.empty() ? 0 : rowIDs.front();
+    header.reserved = 0;
+    header.numRows = rowIDs.size();
+    header.total = rowPtr.back();
+
+    // About INDEX_ROWS_PER_BUCKET rows per bucket, when the ID1s are evenly spread
+    uint64_t span = rowIDs.empty() ? 0 : rowIDs.back() - header.firstID1;
+    uint64_t maxBuckets = std::max<uint64_t>(1, rowIDs.size() / INDEX_ROWS_PER_BUCKET);
+    while ((span >> header.shift) + 1 > maxBuckets) ++header.shift;
+    header.numBuckets = rowIDs.empty() ? 0 : (span >> header.shift) + 1;
+
+    std::vector<uint64_t> bucketRows(header.numBuckets);
+    uint64_t row = 0;
+    for (uint64_t b = 0; b < header.numBuckets; ++b) {
+        while (row < rowIDs.size() && ((rowIDs[row] - header.firstID1) >> header.shift) < b) ++row;
+        bucketRows[b] = row;
+    }
+
+    std::string tmpPath = indexPath + ".tmp";
+    {
+        std::ofstream outfile(tmpPath, std::ios::binary);
+        outfile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        outfile.write(reinterpret_cast<const char*>(rowPtr.data()), rowPtr.size() * sizeof(uint64_t));
+        outfile.write(reinterpret_cast<const char*>(bucketRows.data()), bucketRows.size() * sizeof(uint64_t));
+        outfile.write(reinterpret_cast<const char*>(rowIDs.data()), rowIDs.size() * sizeof(uint32_t));
+        if (!outfile) {
+            throw std::runtime_error("Failed to write output file: " + tmpPath);
+        }
+    }
+    std::filesystem::rename(tmpPath, indexPath);
+}
+
+
+DistanceFileView::DistanceFileView(const std::string& filename)
+    : filename(filename), fileFormat(DistanceFormat::Pairs), pairs(0), firstID1(0), shift(0), numRows(0),
+      numBuckets(0), rowPtr(nullptr), bucketRows(nullptr), rowIDs(nullptr), payload(nullptr) {
+    std::string indexPath = distance_index_path(filename);
+    if (!index.open(indexPath, MemoryMapped::WholeFile, MemoryMapped::RandomAccess) ||
+        index.size() < sizeof(DistanceIndexHeader)) {
+        throw std::runtime_error("Error: Unable to map the distance index " + indexPath);
+    }
+
+    DistanceIndexHeader header;
+    std::memcpy(&header, index.getData(), sizeof(header));
+    if (std::memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+        index.size() != sizeof(header) + (header.numRows + 1 + header.numBuckets) * sizeof(uint64_t) +
+                        header.numRows * sizeof(uint32_t)) {
+        throw std::runtime_error("Error: " + indexPath + " is not a distance index (or it is incomplete)");
+    }
+    fileFormat = static_cast<DistanceFormat>(header.format);
+    firstID1 = header.firstID1;
+    shift = header.shift;
+    numRows = header.numRows;
+    numBuckets = header.numBuckets;
+    rowPtr = reinterpret_cast<const uint64_t*>(index.getData() + sizeof(header));
+    bucketRows = rowPtr + numRows + 1;
+    rowIDs = reinterpret_cast<const uint32_t*>(bucketRows + numBuckets);
+
+    // An empty pairs file cannot be mapped, and has no row to look up
+    uint64_t headerBytes = fileFormat == DistanceFormat::Compact ? sizeof(CompactDistanceHeader) : 0;
+    uint64_t unitBytes = fileFormat == DistanceFormat::Compact ? 1 : sizeof(NormalizedPair);
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(filename, ec);
+    if (ec || size != headerBytes + header.total * unitBytes) {
+        throw std::runtime_error("Error: " + filename + " does not match its index " + indexPath);
+    }
+    if (size == 0) return;
+
+    if (!data.open(filename, MemoryMapped::WholeFile, MemoryMapped::RandomAccess)) {
+        throw std::runtime_error("Failed to map file: " + filename);
+    }
+    if (fileFormat == DistanceFormat::Compact) {
+        CompactDistanceHeader compactHeader;
+        std::memcpy(&compactHeader, data.getData(), sizeof(compactHeader));
+        if (std::memcmp(compactHeader.magic, COMPACT_MAGIC, sizeof(COMPACT_MAGIC)) != 0) {
+            throw std::runtime_error("Error: " + filename + " is not a complete compact distance file");
+        }
+        pairs = compactHeader.pairs;
+    } else {
+        pairs = header.total;
+    }
+    payload = data.getData() + headerBytes;
+}
+
+std::pair<uint64_t, uint64_t> DistanceFileView::row_bounds(uint32_t ID1) const {
+    if (numRows == 0 || ID1 < firstID1 || ID1 > rowIDs[numRows - 1]) return {0, 0};
+
+    // Binary search inside the bucket, which skewed ID1s can fill with many rows
+    uint64_t bucket = (ID1 - firstID1) >> shift;
+    const uint32_t* first = rowIDs + bucketRows[bucket];
+    const uint32_t* last = rowIDs + (bucket + 1 < numBuckets ? bucketRows[bucket + 1] : numRows);
+    const uint32_t* found = std::lower_bound(first, last, ID1);
+    if (found == last || *found != ID1) return {0, 0};
+
+    uint64_t row = found - rowIDs;
+    return {rowPtr[row], rowPtr[row + 1]};
+}
+
+std::span<const NormalizedPair> DistanceFileView::row(uint32_t ID1) const {
+    if (fileFormat != DistanceFormat::Pairs) {
+        throw std::logic_error("Error: " + filename + " is not in the pairs format, use read_row()");
+    }
+    auto [begin, end] = row_bounds(ID1);
+    if (begin == end) return {};
+    return {reinterpret_cast<const NormalizedPair*>(payload) + begin, end - begin};
+}
+
+std::span<const uint8_t> DistanceFileView::encoded_row(uint32_t ID1) const {
+    if (fileFormat != DistanceFormat::Compact) {
+        throw std::logic_error("Error: " + filename + " is not in the compact format, use row()");
+    }
+    auto [begin, end] = row_bounds(ID1);
+    if (begin == end) return {};
+    return {payload + begin, end - begin};
+}
+
+void DistanceFileView::read_row(uint32_t ID1, std::vector<NormalizedPair>& out) const {
+    if (fileFormat == DistanceFormat::Pairs) {
+        auto pairsRow = row(ID1);
+        out.insert(out.end(), pairsRow.begin(), pairsRow.end());
+        return;
+    }
+
+    // The row starts with its ID1 delta to the previous row, replaced by the known ID1
+    auto encoded = encoded_row(ID1);
+    size_t first = out.size();
+    decode_distance_rows(encoded.data(), encoded.size(), out);
+    for (size_t i = first; i < out.size(); ++i) {
+        out[i].ID1 = ID1;
+    }
+}
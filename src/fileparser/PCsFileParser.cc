@@ -13,7 +13,41 @@ PCsFileParser::~PCsFileParser() {
 
 // wrapper function to load primary clusters. In the future it will load different sources
 void PCsFileParser::loadPCs() {    
-    readBinaryData(sizeof(SmallPC));
+    if (is_shard_manifest(filename)) {
+        readShards(sizeof(SmallPC));
+    } else {
+        readBinaryData(sizeof(SmallPC));
+        shardOffsets = {0, totalLines};
+    }
+}
+
+void PCsFileParser::readShards(size_t elementSize) {
+    std::vector<PCShard> shards = read_shard_manifest(filename);
+
+    dataSize = 0;
+    for (const auto& shard : shards) {
+        dataSize += shard.records * elementSize;
+    }
+    totalLines = dataSize / elementSize;
+
+    if (totalLines == 0) {
+        throw std::runtime_error("Error: Manifest " + filename + " contains no valid entries.");
+    }
+
+    data = new char[dataSize];
+    shardOffsets = {0};
+
+    for (const auto& shard : shards) {
+        std::ifstream infile(shard.filename, std::ifstream::binary);
+        infile.read(data + shardOffsets.back() * elementSize, shard.records * elementSize);
+
+        if (!infile) {
+            delete[] data;
+            data = nullptr;
+            throw std::runtime_error("Error reading shard " + shard.filename + " of " + filename);
+        }
+        shardOffsets.push_back(shardOffsets.back() + shard.records);
+    }
 }
 
 void PCsFileParser::readBinaryData(size_t elementSize) {
@@ -0,0 +1,145 @@
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <dpcstruct/fileparser/QueryStore.h>
+
+namespace {
+constexpr char STORE_MAGIC[8] = {'D', 'P', 'C', 'Q', 'M', 'E', 'M', 'O'};
+constexpr uint32_t STORE_VERSION = 1;
+
+struct StoreHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t fingerprint;
+};
+
+struct StoreTrailer {
+    uint64_t indexOffset;  // in bytes
+    uint64_t numEntries;
+    char magic[8];
+};
+
+constexpr uint64_t FNV_OFFSET = 14695981039346656037ULL;
+constexpr uint64_t FNV_PRIME = 1099511628211ULL;
+
+inline void fnv_add(uint64_t& h, uint32_t value) {
+    for (int b = 0; b < 4; ++b) {
+        h ^= (value >> (8 * b)) & 0xff;
+        h *= FNV_PRIME;
+    }
+}
+}
+
+
+uint64_t hash_query_block(std::span<const Alignment> alignments) {
+    uint64_t h = FNV_OFFSET;
+    for (const auto& aln : alignments) {
+        fnv_add(h, aln.queryID);
+        fnv_add(h, aln.searchID);
+        fnv_add(h, aln.queryStart);
+        fnv_add(h, aln.queryEnd);
+        fnv_add(h, aln.searchStart);
+        fnv_add(h, aln.searchEnd);
+    }
+    return h;
+}
+
+
+QueryStore::QueryStore(const std::string& filename, uint64_t fingerprint)
+    : filename(filename), data(filename, MemoryMapped::WholeFile, MemoryMapped::RandomAccess),
+      compatible(false), records(nullptr) {
+    if (!data.isValid()) {
+        throw std::runtime_error("Failed to map file: " + filename);
+    }
+
+    const unsigned char* base = data.getData();
+    uint64_t size = data.size();
+    if (size < sizeof(StoreHeader) + sizeof(StoreTrailer)) {
+        throw std::runtime_error("Error: " + filename + " is not a query store");
+    }
+
+    StoreHeader header;
+    StoreTrailer trailer;
+    std::memcpy(&header, base, sizeof(header));
+    std::memcpy(&trailer, base + size - sizeof(trailer), sizeof(trailer));
+
+    if (std::memcmp(header.magic, STORE_MAGIC, 8) != 0 || std::memcmp(trailer.magic, STORE_MAGIC, 8) != 0 ||
+        trailer.indexOffset < sizeof(StoreHeader) || trailer.indexOffset > size - sizeof(trailer) ||
+        trailer.numEntries > (size - sizeof(trailer) - trailer.indexOffset) / sizeof(QueryStoreEntry) ||
+        trailer.indexOffset + trailer.numEntries * sizeof(QueryStoreEntry) + sizeof(trailer) != size) {
+        throw std::runtime_error("Error: " + filename + " is not a query store (or it is incomplete)");
+    }
+
+    compatible = header.version == STORE_VERSION && header.recordSize == sizeof(SmallPC) &&
+                 header.fingerprint == fingerprint;
+    if (!compatible) return;
+
+    records = reinterpret_cast<const SmallPC*>(base + sizeof(StoreHeader));
+    uint64_t numRecords = (trailer.indexOffset - sizeof(StoreHeader)) / sizeof(SmallPC);
+
+    // A corrupted entry must not point lookups outside the records
+    index.reserve(trailer.numEntries);
+    for (uint64_t e = 0; e < trailer.numEntries; ++e) {
+        QueryStoreEntry entry;
+        std::memcpy(&entry, base + trailer.indexOffset + e * sizeof(entry), sizeof(entry));
+        if (entry.offset > numRecords || entry.count > numRecords - entry.offset) {
+            throw std::runtime_error("Error: query store " + filename + " has an entry out of its records (query " +
+                                     std::to_string(entry.queryID) + ")");
+        }
+        index[entry.queryID] = {entry.hash, entry.offset, entry.count};
+    }
+}
+
+bool QueryStore::lookup(uint32_t queryID, uint64_t hash, std::span<const SmallPC>& pcs) const {
+    auto it = index.find(queryID);
+    if (it == index.end() || it->second.hash != hash) return false;
+
+    pcs = std::span<const SmallPC>(records + it->second.offset, it->second.count);
+    return true;
+}
+
+
+QueryStoreWriter::QueryStoreWriter(const std::string& filename, uint64_t fingerprint)
+    : filename(filename), outFile(filename, std::ios::binary), numRecords(0), closed(false) {
+    if (!outFile) {
+        throw std::runtime_error("Failed to open output file: " + filename);
+    }
+
+    StoreHeader header;
+    std::memcpy(header.magic, STORE_MAGIC, 8);
+    header.version = STORE_VERSION;
+    header.recordSize = sizeof(SmallPC);
+    header.fingerprint = fingerprint;
+    outFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+QueryStoreWriter::~QueryStoreWriter() {
+    // An unclosed store has no trailer, so it is never mistaken for a complete one
+    outFile.close();
+}
+
+void QueryStoreWriter::append(uint32_t queryID, uint64_t hash, const SmallPC* pcs, uint64_t count) {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    outFile.write(reinterpret_cast<const char*>(pcs), count * sizeof(SmallPC));
+    entries.push_back({queryID, 0, hash, numRecords, count});
+    numRecords += count;
+}
+
+void QueryStoreWriter::close() {
+    if (closed) return;
+    closed = true;
+
+    StoreTrailer trailer;
+    trailer.indexOffset = sizeof(StoreHeader) + numRecords * sizeof(SmallPC);
+    trailer.numEntries = entries.size();
+    std::memcpy(trailer.magic, STORE_MAGIC, 8);
+
+    outFile.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(QueryStoreEntry));
+    outFile.write(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+    outFile.close();
+
+    if (outFile.fail()) {
+        throw std::runtime_error("Failed to write query store: " + filename);
+    }
+}
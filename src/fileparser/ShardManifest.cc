@@ -0,0 +1,59 @@
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <dpcstruct/fileparser/ShardManifest.h>
+
+static const std::string MANIFEST_HEADER = "shard\tfirst_sID\tlast_sID\trecords\tfile";
+
+bool is_shard_manifest(const std::string& filename) {
+    std::ifstream infile(filename);
+    std::string line;
+    return infile && std::getline(infile, line) && line == MANIFEST_HEADER;
+}
+
+std::vector<PCShard> read_shard_manifest(const std::string& manifestPath) {
+    std::ifstream infile(manifestPath);
+    if (!infile) {
+        throw std::runtime_error("Error: Unable to open file " + manifestPath);
+    }
+
+    std::string line;
+    if (!std::getline(infile, line) || line != MANIFEST_HEADER) {
+        throw std::runtime_error("Error: " + manifestPath + " is not a shard manifest");
+    }
+
+    std::filesystem::path baseDir = std::filesystem::path(manifestPath).parent_path();
+    std::vector<PCShard> shards;
+    while (std::getline(infile, line)) {
+        if (line.empty()) continue;
+
+        std::stringstream ss(line);
+        int index;
+        PCShard shard;
+        if (!(ss >> index >> shard.firstSID >> shard.lastSID >> shard.records >> shard.filename)) {
+            throw std::runtime_error("Error: malformed line in " + manifestPath + ": " + line);
+        }
+        shard.filename = (baseDir / shard.filename).string();
+
+        if (!shards.empty() && shard.firstSID <= shards.back().lastSID) {
+            throw std::runtime_error("Error: shards of " + manifestPath + " are not in increasing sID order");
+        }
+        shards.push_back(shard);
+    }
+
+    return shards;
+}
+
+void write_shard_manifest(const std::string& manifestPath, const std::vector<PCShard>& shards) {
+    std::ofstream outfile(manifestPath);
+    if (!outfile) {
+        throw std::runtime_error("Failed to open output file: " + manifestPath);
+    }
+
+    outfile << MANIFEST_HEADER << "\n";
+    for (size_t k = 0; k < shards.size(); ++k) {
+        outfile << k + 1 << "\t" << shards[k].firstSID << "\t" << shards[k].lastSID << "\t" << shards[k].records
+                << "\t" << std::filesystem::path(shards[k].filename).filename().string() << "\n";
+    }
+}
@@ -0,0 +1,56 @@
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#include <dpcstruct/fileparser/TsvManifest.h>
+
+TsvManifest read_tsv_manifest(const std::string& manifestPath, const std::string& header) {
+    std::ifstream infile(manifestPath);
+    if (!infile) {
+        throw std::runtime_error("Error: Unable to open file " + manifestPath);
+    }
+
+    TsvManifest manifest;
+    std::string line;
+    while (std::getline(infile, line) && !line.empty() && line[0] == '#') {
+        size_t tab = line.find('\t');
+        manifest.metadata.emplace_back(line.substr(1, tab - 1), tab == std::string::npos ? "" : line.substr(tab + 1));
+    }
+    if (line != header) {
+        throw std::runtime_error("Error: " + manifestPath + " is not a manifest with columns " + header);
+    }
+
+    while (std::getline(infile, line)) {
+        if (!line.empty()) manifest.entries.push_back(line);
+    }
+    return manifest;
+}
+
+void write_tsv_manifest(const std::string& manifestPath, const std::string& header, const TsvManifest& manifest) {
+    std::string tmpPath = manifestPath + ".tmp";
+    {
+        std::ofstream outfile(tmpPath);
+        if (!outfile) {
+            throw std::runtime_error("Failed to open output file: " + tmpPath);
+        }
+
+        for (const auto& [key, value] : manifest.metadata) {
+            outfile << "#" << key << "\t" << value << "\n";
+        }
+        outfile << header << "\n";
+        for (const auto& entry : manifest.entries) {
+            outfile << entry << "\n";
+        }
+        if (!outfile) {
+            throw std::runtime_error("Failed to write output file: " + tmpPath);
+        }
+    }
+    std::filesystem::rename(tmpPath, manifestPath);
+}
+
+std::string manifest_value(const TsvManifest& manifest, const std::string& key) {
+    for (const auto& [k, value] : manifest.metadata) {
+        if (k == key) return value;
+    }
+    return "";
+}
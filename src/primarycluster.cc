@@ -10,6 +10,7 @@
 #include <filesystem>
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <omp.h>
 #include <span>
 
@@ -20,43 +21,27 @@
 #include <dpcstruct/types/PrimaryCluster.h>
 #include <dpcstruct/distance.h>
 #include <dpcstruct/sort.h>
+#include <dpcstruct/external_sort.h>
 
 #include <commandparser/CommandParser.h>
 
-void compute_cluster_size(SmallPC* clusterAlign, const uint64_t length) {
-    auto end = clusterAlign + length;
-
-    for (auto low = clusterAlign; low != end; ) {
-        uint32_t val = low->qID;
-
-        // Find range of equal qID using std::equal_range
-        auto range = std::equal_range(low, end, val, compare_qID());
-
-        // Compute size (difference between range.first and range.second)
-        auto count = range.second - range.first;
-
-        // Update the qSize for all elements in the range
-        for (auto p = range.first; p != range.second; ++p) {
-            p->qSize = count;
-        }
-
-        // Move the pointer to the end of the current cluster
-        low = range.second;
-    }
-}
-
-
-
 int main(int argc, char** argv) {
 
 	// parse command line
     std::vector<Option> options = {
         {'i', "INPUT", "input filename"},
         {'o', "OUTPUT", "output filename"},
-        {'t', "THREADS", "number of threads", false}
+        {'t', "THREADS", "number of threads", false},
+        {'s', "", "streaming mode: cluster query by query with bounded memory", false},
+        {'m', "MEMORY", "memory budget for sorting in MB, larger outputs are sorted out of core (default: in memory, 1024 in streaming mode)", false},
+        {'d', "TMPDIR", "directory for the sorted runs (default output directory)", false},
+        {'c', "MAX_ALNS", "max distinct intervals whose density is computed per query, larger queries find their peaks on a subsample of that size (default: no cap)", false},
+        {'g', "GRID", "parameter sweep, e.g. \"dpar=0.1,0.2:rho=5,10:delta=0.4:peaks=10\": one output per configuration. Distances are shared by the configurations of a query up to 4M neighbor entries (about 80 MB per thread), and recomputed beyond", false},
+        {'n', "SHARDS", "split the output into sID-range shards listed in OUTPUT_shards.tsv (default: single file)", false},
+        {'k', "STORE", "query store: unchanged queries are copied from it, then it is updated with this run", false}
     };
 
-    std::string optstring = "i:o:t:";
+    std::string optstring = "i:o:t:sm:d:c:g:n:k:";
     std::string program_desc = "Identifies primary clusters given a set of query proteins.";
 
     OptionParser parser(options, optstring, program_desc);
@@ -68,6 +53,8 @@ int main(int argc, char** argv) {
 
     // if parsed_options["t"] is not provided, default to system threads
     int numThreads = parsed_options.count("t") ? std::stoi(parsed_options["t"]) : omp_get_max_threads();
+    size_t maxAlignments = parsed_options.count("c") ? std::stoull(parsed_options["c"]) : 0;
+    int numShards = parsed_options.count("n") ? std::stoi(parsed_options["n"]) : 0;
     
 	// error check
 	if (!std::filesystem::exists(inPath)) {
@@ -82,42 +69,172 @@ int main(int argc, char** argv) {
 	std::cout << "Input filename: " << inPath << std::endl;
 	std::cout << "Output filename: " << outPath << std::endl;
     std::cout << "Number of threads: " << numThreads << std::endl;
+    if (maxAlignments > 0) {
+        std::cout << "Max alignments per query: " << maxAlignments << std::endl;
+    }
+    if (numShards > 0) {
+        std::cout << "Output shards: " << numShards << ", manifest: " << shard_manifest_path(outPath) << std::endl;
+    }
+
+    if (numShards > 0 && std::filesystem::exists(shard_manifest_path(outPath))) {
+        std::cerr << "Output manifest already exists: " << shard_manifest_path(outPath) << std::endl;
+        return 1;
+    }
+
+    std::string tmpDir = parsed_options.count("d") ? parsed_options["d"] 
+                                                  : std::filesystem::absolute(outPath).parent_path().string();
+    if (!std::filesystem::is_directory(tmpDir)) {
+        std::cerr << "Temporary directory does not exist: " << tmpDir << std::endl;
+        return 1;
+    }
+
+    if (parsed_options.count("g") && parsed_options.count("s")) {
+        std::cerr << "The parameter sweep is not available in streaming mode" << std::endl;
+        return 1;
+    }
+    if (parsed_options.count("g") && parsed_options.count("k")) {
+        std::cerr << "The parameter sweep can't use a query store" << std::endl;
+        return 1;
+    }
+
+    // Query store of the previous run, replaced by the one of this run when clustering is done
+    std::unique_ptr<QueryStore> previousStore;
+    std::unique_ptr<QueryStoreWriter> storeWriter;
+    QueryMemo memo;
+    QueryMemo* pMemo = nullptr;
+    std::string storePath = parsed_options.count("k") ? parsed_options["k"] : "";
+
+    if (!storePath.empty()) {
+        uint64_t fingerprint = query_store_fingerprint(maxAlignments);
+        if (std::filesystem::exists(storePath)) {
+            previousStore = std::make_unique<QueryStore>(storePath, fingerprint);
+            if (previousStore->valid()) {
+                std::cout << "Query store: " << storePath << ", " << previousStore->size() << " queries" << std::endl;
+                memo.previous = previousStore.get();
+            } else {
+                std::cout << "Query store " << storePath << " was written with other parameters, ignored" << std::endl;
+            }
+        }
+        storeWriter = std::make_unique<QueryStoreWriter>(storePath + ".tmp", fingerprint);
+        memo.current = storeWriter.get();
+        pMemo = &memo;
+    }
+
+    auto update_store = [&]() {
+        if (pMemo == nullptr) return;
+        storeWriter->close();
+        previousStore.reset();
+        std::filesystem::rename(storePath + ".tmp", storePath);
+        std::cout << "Queries reused from the store: " << memo.reused.load() << std::endl;
+    };
 
-	std::vector<Alignment> allAlignments;
     AlnsFileParser alnsParser(inPath);
+
+    if (parsed_options.count("s")) {
+        // Spill runs are bounded by the memory budget, shared between the threads
+        uint64_t memoryMB = parsed_options.count("m") ? std::stoull(parsed_options["m"]) : 1024;
+
+        std::cout << "Streaming mode, memory budget: " << memoryMB << " MB" << std::endl;
+        std::cout << "Temporary directory: " << tmpDir << std::endl;
+
+        uint64_t written = process_stream(alnsParser, outPath, tmpDir, memoryMB << 20, numThreads, maxAlignments, numShards, pMemo);
+        update_store();
+
+        std::cout << "Number of alignments clustered: " << written << std::endl;
+        return 0;
+    }
+
+	std::vector<Alignment> allAlignments;
     alnsParser.loadAlignments(allAlignments);
 
 	std::cout << "Number of alignments: " << allAlignments.size() << std::endl; 
 
-    std::vector<int> labels = process_by_query(allAlignments, numThreads);
+    if (parsed_options.count("g")) {
+        std::vector<ClusterParams> grid = parse_param_grid(parsed_options["g"]);
+        std::cout << "Parameter sweep over " << grid.size() << " configurations" << std::endl;
 
-    // Build primary clusters
-    std::vector<SmallPC> clusterAlns;
-    clusterAlns.reserve(allAlignments.size());
+        std::vector<std::vector<SmallPC>> perConfigPCs = process_by_query_sweep(allAlignments, numThreads, grid, maxAlignments);
+        std::vector<Alignment>().swap(allAlignments);
 
-    for (uint64_t i = 0; i < allAlignments.size(); ++i) {
-        const Alignment& aln = allAlignments[i];
-        int label = labels[i];
+        // <stem>_<k><ext> for each configuration, listed in <stem>_sweep.tsv
+        std::filesystem::path out(outPath);
+        std::string stem = (out.parent_path() / out.stem()).string();
+        std::string sweepPath = stem + "_sweep.tsv";
+        std::ofstream sweepFile(sweepPath);
+        if (!sweepFile) {
+            throw std::runtime_error("Failed to open output file: " + sweepPath);
+        }
+        sweepFile << "config\tdpar\trho_threshold\tdelta_threshold\tmax_peaks\trecords\tfile\n";
+
+        for (size_t c = 0; c < grid.size(); ++c) {
+            std::vector<SmallPC>& pcs = perConfigPCs[c];
+            uint64_t numPCs = pcs.size();
+            std::string configPath = stem + "_" + std::to_string(c + 1) + out.extension().string();
+
+            if (numShards > 0) {
+                write_shards(pcs, configPath, numShards, numThreads);
+                configPath = shard_manifest_path(configPath);
+            } else {
+                radix_sort(pcs.data(), pcs.size(), [](const SmallPC& pc) { return pc.sID; }, numThreads);
+
+                std::ofstream configFile(configPath, std::ios::binary);
+                if (!configFile) {
+                    throw std::runtime_error("Failed to open output file: " + configPath);
+                }
+                configFile.write(reinterpret_cast<const char*>(pcs.data()), pcs.size() * sizeof(SmallPC));
+                if (!configFile) {
+                    throw std::runtime_error("Failed to write output file: " + configPath);
+                }
+            }
+
+            sweepFile << c + 1 << "\t" << grid[c].dpar << "\t" << grid[c].rho_threshold << "\t" << grid[c].delta_threshold
+                      << "\t" << grid[c].max_peaks << "\t" << numPCs << "\t" << configPath << "\n";
+            std::cout << "Configuration " << c + 1 << ": " << numPCs << " alignments clustered, written to " << configPath << std::endl;
+
+            std::vector<SmallPC>().swap(pcs);
+        }
 
-        if (label < 0) { continue;}
+        sweepFile.close();
+        if (!sweepFile) {
+            throw std::runtime_error("Failed to write output file: " + sweepPath);
+        }
+        return 0;
+    }
+
+    // Primary clusters come out grouped by query, with qSize already set
+    std::vector<SmallPC> clusterAlns = process_by_query(allAlignments, numThreads, maxAlignments, pMemo);
+    std::vector<Alignment>().swap(allAlignments);
+    update_store();
+
+    std::cout << "Number of alignments clustered: " << clusterAlns.size() << std::endl;
+    std::cout << "Writing to file: " << outPath << std::endl;
 
-        clusterAlns.emplace_back(
-            aln.queryID * 100 + label,   
-            0,                           // placeholder. TODO: remove this field
-            aln.searchID,                
-            static_cast<uint16_t>(aln.searchStart),  
-            static_cast<uint16_t>(aln.searchEnd)     
-        );
-    }    
+    if (parsed_options.count("m")) {
+        // Out-of-core sort wrt sID within the memory budget (stable, so ties keep the query order of the input)
+        uint64_t memoryMB = std::stoull(parsed_options["m"]);
+        auto key = [](const SmallPC& pc) { return pc.sID; };
+        ExternalSorter<SmallPC, decltype(key)> sorter(key, memoryMB << 20, tmpDir, numThreads);
 
-    // sort wrt qID+center
-    radix_sort(reinterpret_cast<unsigned char*>(clusterAlns.data()), clusterAlns.size(), 16, 4, 0);
+        sorter.push(clusterAlns.data(), clusterAlns.size());
+        std::vector<SmallPC>().swap(clusterAlns);
 
-    // compute size of each primary cluster: qSize
-    compute_cluster_size(clusterAlns.data(), clusterAlns.size());
+        if (numShards > 0) {
+            write_sorted_shards(sorter, outPath, numShards);
+        } else {
+            write_sorted(sorter, outPath);
+        }
+        return 0;
+    }
+
+    if (numShards > 0) {
+        // Each shard is sorted on its own, no global sort
+        std::vector<PCShard> shards = write_shards(clusterAlns, outPath, numShards, numThreads);
+        std::cout << "Number of shards: " << shards.size() << std::endl;
+        return 0;
+    }
 
-    // sort back wrt sID
-    radix_sort(reinterpret_cast<unsigned char*>(clusterAlns.data()), clusterAlns.size(), 16, 4, 8);
+    // sort wrt sID (stable, so ties keep the query order of the input)
+    radix_sort(clusterAlns.data(), clusterAlns.size(), [](const SmallPC& pc) { return pc.sID; }, numThreads);
 
     // Write the clusterAlns vector as binary
     std::ofstream outFile(outPath, std::ios::binary);
@@ -125,8 +242,6 @@ int main(int argc, char** argv) {
     throw std::runtime_error("Failed to open output file: " + outPath);
     }
 
-    std::cout << "Number of alignments clustered: " << clusterAlns.size() << std::endl;
-    std::cout << "Writing to file: " << outPath << std::endl;
     outFile.write(reinterpret_cast<const char*>(clusterAlns.data()), clusterAlns.size() * sizeof(SmallPC));
     outFile.close();
 
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <cstdlib>
 #include <limits>
 #include <numeric>
 #include <vector>
@@ -7,9 +8,39 @@
 #include <dpcstruct/distance.h>
 
 
-std::vector<size_t> get_nonredundant_indices(std::span<const Alignment> alignments, double distanceThreshold) {
+// Thread-local equivalent of srand()/rand(). It runs the same glibc generator,
+// so results match a serial run, but queries clustered concurrently don't share state.
+namespace {
+struct NoiseGenerator {
+    char state[128];
+    random_data data{};
+
+    NoiseGenerator() { initstate_r(1, state, sizeof(state), &data); }
+    void seed(unsigned int s) { srandom_r(s, &data); }
+    double uniform() {
+        int32_t r;
+        random_r(&data, &r);
+        return (double)r / RAND_MAX;
+    }
+};
+
+thread_local NoiseGenerator noise;
+
+// Random term of the density of an alignment, it breaks ties between equal densities
+double density_noise(const Alignment& aln) {
+    int seed = aln.searchID + aln.queryStart + aln.queryEnd - aln.searchStart * aln.searchEnd;
+    noise.seed(seed);
+    return 0.1 * noise.uniform();
+}
+}
+
+
+std::span<const size_t> get_nonredundant_indices(std::span<const Alignment> alignments, 
+                                                double distanceThreshold,
+                                                ClusterWorkspace& ws) {
     // Get the sorted positions based on searchID
-    std::vector<size_t> sortedIndices(alignments.size());
+    std::vector<size_t>& sortedIndices = ws.sortedIndices;
+    sortedIndices.resize(alignments.size());
 
     // Initialize indices
     std::iota(sortedIndices.begin(), sortedIndices.end(), 0);
@@ -21,7 +52,8 @@ std::vector<size_t> get_nonredundant_indices(std::span<const Alignment> alignmen
               });
 
     // Remove redundant alignments based on distance
-    std::vector<bool> valid(alignments.size(), true);
+    std::vector<uint8_t>& valid = ws.valid;
+    valid.assign(alignments.size(), 1);
 
     for (size_t i = 0; i < sortedIndices.size(); ++i) {
         if (!valid[sortedIndices[i]]) continue;  
@@ -38,13 +70,14 @@ std::vector<size_t> get_nonredundant_indices(std::span<const Alignment> alignmen
 
             // TODO: sholuld remove that with bigger evalue
             if (dist < distanceThreshold) {
-                valid[sortedIndices[j]] = false;  
+                valid[sortedIndices[j]] = 0;  
             }
         }
     }
 
     // Collect and return the valid indices
-    std::vector<size_t> validIndices;
+    std::vector<size_t>& validIndices = ws.validIndices;
+    validIndices.clear();
     for (size_t i = 0; i < sortedIndices.size(); ++i) {
         if (valid[sortedIndices[i]]) {
             validIndices.push_back(sortedIndices[i]);  // Add only the valid ones
@@ -54,18 +87,21 @@ std::vector<size_t> get_nonredundant_indices(std::span<const Alignment> alignmen
     return validIndices;
 }
 
-std::vector<double> calculate_density(const std::span<const Alignment> alignments, 
-                                    const std::vector<size_t>& validIndices, 
-                                    double dpar) {
-    std::vector<double> rho(validIndices.size(), 1.0);
+std::vector<size_t> get_nonredundant_indices(std::span<const Alignment> alignments, double distanceThreshold) {
+    ClusterWorkspace ws;
+    get_nonredundant_indices(alignments, distanceThreshold, ws);
+    return std::move(ws.validIndices);
+}
+
+void calculate_density(std::span<const Alignment> alignments, 
+                        std::span<const size_t> validIndices,
+                        std::span<double> rho,
+                        double dpar) {
+    std::fill(rho.begin(), rho.end(), 1.0);
 
     // Initialize rho with random seed
     for (size_t i = 0; i < validIndices.size(); ++i) {
-        auto i_og = validIndices[i];
-        const Alignment& aln = alignments[i_og];
-        int seed = aln.searchID + aln.queryStart + aln.queryEnd - aln.searchStart * aln.searchEnd;
-        srand(seed); 
-        rho[i] += 0.1 * ((double)rand() / RAND_MAX); // Add a small random value to rho
+        rho[i] += density_noise(alignments[validIndices[i]]); // Add a small random value to rho
     }
 
     // Pairwise distance calculation to update rho
@@ -80,16 +116,178 @@ std::vector<double> calculate_density(const std::span<const Alignment> alignment
             }
         }
     }
+}
 
+std::vector<double> calculate_density(const std::span<const Alignment> alignments, 
+                                    const std::vector<size_t>& validIndices, 
+                                    double dpar) {
+    std::vector<double> rho(validIndices.size());
+    calculate_density(alignments, std::span<const size_t>(validIndices), rho, dpar);
     return rho;
 }
 
-std::vector<double> calculate_delta(std::span<const Alignment> alignments, 
-                                    const std::vector<size_t>& validIndices,
-                                    const std::vector<double>& rho) {
-    std::vector<double> delta(validIndices.size(), 1000.0);  // max delta is large initially
+std::span<const size_t> collapse_intervals(std::span<const Alignment> alignments,
+                                          std::span<const size_t> validIndices,
+                                          ClusterWorkspace& ws) {
+    const size_t n = validIndices.size();
+
+    // Group the alignments by query interval
+    std::vector<size_t>& order = ws.sortedIndices;
+    order.resize(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        const Alignment& x = alignments[validIndices[a]];
+        const Alignment& y = alignments[validIndices[b]];
+        if (x.queryStart != y.queryStart) return x.queryStart < y.queryStart;
+        if (x.queryEnd != y.queryEnd) return x.queryEnd < y.queryEnd;
+        return a < b;
+    });
+
+    // The representative of a group is the member with the highest density noise,
+    // i.e. the one that would get the highest density among its copies
+    ws.groupOf.resize(n);
+    ws.groupRep.clear();
+    for (size_t begin = 0, end; begin < n; begin = end) {
+        const Alignment& first = alignments[validIndices[order[begin]]];
+        size_t rep = order[begin];
+        double maxNoise = density_noise(first);
+
+        for (end = begin + 1; end < n; ++end) {
+            const Alignment& aln = alignments[validIndices[order[end]]];
+            if (aln.queryStart != first.queryStart || aln.queryEnd != first.queryEnd) break;
+
+            double u = density_noise(aln);
+            if (u > maxNoise) {
+                maxNoise = u;
+                rep = order[end];
+            }
+        }
+
+        for (size_t k = begin; k < end; ++k) {
+            ws.groupOf[order[k]] = ws.groupRep.size();
+        }
+        ws.groupRep.push_back(rep);
+    }
+
+    // Number the groups in the order of their representatives, as the peaks
+    // (and thus the labels) follow the order of the alignments
+    std::vector<size_t>& groupRank = ws.groupRank;
+    groupRank.resize(ws.groupRep.size());
+    ws.repIndices.clear();
+    for (size_t k = 0; k < n; ++k) {
+        size_t g = ws.groupOf[k];
+        if (ws.groupRep[g] == k) {
+            groupRank[g] = ws.repIndices.size();
+            ws.repIndices.push_back(validIndices[k]);
+        }
+    }
+
+    ws.weights.assign(ws.repIndices.size(), 0);
+    for (size_t k = 0; k < n; ++k) {
+        ws.groupOf[k] = groupRank[ws.groupOf[k]];
+        ++ws.weights[ws.groupOf[k]];
+    }
+
+    return ws.repIndices;
+}
 
-    std::vector<size_t> sortedIndices(validIndices.size());
+void calculate_density(std::span<const Alignment> alignments, 
+                        std::span<const size_t> repIndices,
+                        std::span<const uint32_t> weights,
+                        std::span<double> rho,
+                        double dpar) {
+    // Identical intervals are at distance 0 from each other
+    for (size_t i = 0; i < repIndices.size(); ++i) {
+        rho[i] = 1.0 + density_noise(alignments[repIndices[i]]);
+        if (dpar > 0) rho[i] += weights[i] - 1;
+    }
+
+    for (size_t i = 0; i < repIndices.size(); ++i) {
+        auto i_og = repIndices[i];
+        for (size_t j = i + 1; j < repIndices.size(); ++j) {
+            auto j_og = repIndices[j];
+            double d = distance(alignments[i_og], alignments[j_og]);
+            if (d < dpar) {
+                rho[i] += weights[j];
+                rho[j] += weights[i];
+            }
+        }
+    }
+}
+
+std::span<const size_t> sample_intervals(std::span<const Alignment> alignments,
+                                        ClusterWorkspace& ws,
+                                        size_t maxSamples,
+                                        double dpar) {
+    const size_t n = ws.repIndices.size();
+
+    // Representatives in coordinate order, split into maxSamples consecutive strata
+    std::vector<size_t>& order = ws.sortedIndices;
+    order.resize(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        const Alignment& x = alignments[ws.repIndices[a]];
+        const Alignment& y = alignments[ws.repIndices[b]];
+        if (x.queryStart != y.queryStart) return x.queryStart < y.queryStart;
+        return x.queryEnd < y.queryEnd;
+    });
+
+    // The most populated interval of a stratum stands for the intervals within dpar of it, which
+    // it would count in its density anyway. The farther ones are sampled the same way, so a
+    // stratum spread over several domains keeps one sample per domain, up to the share of the
+    // stratum in the maxSamples budget. The intervals left over are only labelled.
+    std::vector<uint32_t>& stratumWeight = ws.stratumWeight;
+    std::vector<uint8_t>& covered = ws.covered;
+    stratumWeight.assign(n, 0);
+    covered.assign(n, 0);
+    size_t numStrata = std::max<size_t>(1, maxSamples / SAMPLES_PER_STRATUM);
+    for (size_t s = 0; s < numStrata; ++s) {
+        size_t begin = n * s / numStrata;
+        size_t end = n * (s + 1) / numStrata;
+        size_t budget = maxSamples * (s + 1) / numStrata - maxSamples * s / numStrata;
+
+        for (size_t sample = 0; sample < budget; ++sample) {
+            size_t best = n;
+            for (size_t k = begin; k < end; ++k) {
+                if (covered[order[k]]) continue;
+                if (best == n || ws.weights[order[k]] > ws.weights[best]) best = order[k];
+            }
+            if (best == n) break;
+
+            uint32_t total = 0;
+            for (size_t k = begin; k < end; ++k) {
+                size_t r = order[k];
+                if (covered[r]) continue;
+                if (r != best && distance(alignments[ws.repIndices[r]], alignments[ws.repIndices[best]]) >= dpar) continue;
+                covered[r] = 1;
+                total += ws.weights[r];
+            }
+            stratumWeight[best] = total;
+        }
+    }
+
+    // Samples keep the order of the representatives
+    ws.samplePos.clear();
+    ws.sampleIndices.clear();
+    ws.sampleWeights.clear();
+    for (size_t k = 0; k < n; ++k) {
+        if (stratumWeight[k] == 0) continue;
+        ws.samplePos.push_back(k);
+        ws.sampleIndices.push_back(ws.repIndices[k]);
+        ws.sampleWeights.push_back(stratumWeight[k]);
+    }
+
+    return ws.sampleIndices;
+}
+
+void calculate_delta(std::span<const Alignment> alignments, 
+                    std::span<const size_t> validIndices, 
+                    std::span<const double> rho,
+                    std::span<double> delta,
+                    std::vector<size_t>& sortedIndices) {
+    std::fill(delta.begin(), delta.end(), 1000.0);  // max delta is large initially
+
+    sortedIndices.resize(validIndices.size());
     std::iota(sortedIndices.begin(), sortedIndices.end(), 0);
 
     // Sort sortedIndices by the corresponding rho values in descending order
@@ -110,7 +308,7 @@ std::vector<double> calculate_delta(std::span<const Alignment> alignments,
             // Calculate distance
             double dist = distance(alignments[i_og], alignments[j_og]);
             // Add small randomness to avoid ties
-            dist += 0.00001 * ((double)rand() / RAND_MAX);
+            dist += 0.00001 * noise.uniform();
 
             // Update delta if we found a smaller distance
             if (dist < delta[sortedIndices[i]]) {
@@ -118,17 +316,25 @@ std::vector<double> calculate_delta(std::span<const Alignment> alignments,
             }
         }
     }
+}
 
+std::vector<double> calculate_delta(std::span<const Alignment> alignments, 
+                                    const std::vector<size_t>& validIndices,
+                                    const std::vector<double>& rho) {
+    std::vector<double> delta(validIndices.size());
+    std::vector<size_t> sortedIndices;
+    calculate_delta(alignments, validIndices, rho, delta, sortedIndices);
     return delta;
 }
 
-std::vector<size_t> pick_peaks(const std::vector<double>& rho, 
-                               const std::vector<double>& delta, 
-                               double rho_threshold, 
-                               double delta_threshold, 
-                               size_t max_peaks) {
+void pick_peaks(std::span<const double> rho, 
+                std::span<const double> delta, 
+                std::vector<size_t>& peaks,
+                double rho_threshold, 
+                double delta_threshold, 
+                size_t max_peaks) {
 
-    std::vector<size_t> peaks;
+    peaks.clear();
 
     // Identify initial peak peaks based on rho and delta thresholds
     for (size_t i = 0; i < rho.size(); ++i) {
@@ -137,45 +343,36 @@ std::vector<size_t> pick_peaks(const std::vector<double>& rho,
         }
     }
 
-    // If no peaks, return an empty list
-    if (peaks.empty()) {
-        return peaks;
-    }
-
     // If peaks exceed max_peaks, prune based on rho * delta (gamma)
     if (peaks.size() > max_peaks) {
-        // Calculate gamma (rho * delta) for each center
-        std::vector<double> peaks_gamma(peaks.size());
-        for (size_t i = 0; i < peaks.size(); ++i) {
-            peaks_gamma[i] = rho[peaks[i]] * delta[peaks[i]];
-        }
-
-        // Get indices sorted by descending gamma
-        std::vector<size_t> sorted_idxs_gamma(peaks.size());
-        std::iota(sorted_idxs_gamma.begin(), sorted_idxs_gamma.end(), 0);
-
-        std::sort(sorted_idxs_gamma.begin(), sorted_idxs_gamma.end(), [&](size_t i, size_t j) {
-            return peaks_gamma[i] > peaks_gamma[j];  // Sort by gamma in descending order
+        // Sort peaks by descending gamma (rho * delta)
+        std::sort(peaks.begin(), peaks.end(), [&](size_t i, size_t j) {
+            return rho[i] * delta[i] > rho[j] * delta[j];  // Sort by gamma in descending order
         });
 
         // Remove peaks beyond the first max_peaks (prune the lowest gamma values)
-        std::vector<size_t> top_peaks;
-        for (size_t i = 0; i < max_peaks; ++i) {
-            top_peaks.push_back(peaks[sorted_idxs_gamma[i]]);
-        }
-        peaks = top_peaks;
+        peaks.resize(max_peaks);
     }
+}
 
+std::vector<size_t> pick_peaks(const std::vector<double>& rho, 
+                               const std::vector<double>& delta, 
+                               double rho_threshold, 
+                               double delta_threshold, 
+                               size_t max_peaks) {
+    std::vector<size_t> peaks;
+    pick_peaks(rho, delta, peaks, rho_threshold, delta_threshold, max_peaks);
     return peaks;
 }
 
 
-std::vector<int> assign_labels(std::span<const Alignment> alignments, 
-                               const std::vector<size_t>& validIndices, 
-                               const std::vector<size_t>& peaks,
-                               double dpar) {
+void assign_labels(std::span<const Alignment> alignments,
+                    std::span<const size_t> validIndices, 
+                    std::span<const size_t> peaks,
+                    std::span<int> labels,
+                    double dpar) {
     // Initialize labels with -1 (unassigned)
-    std::vector<int> labels(validIndices.size(), -1);
+    std::fill(labels.begin(), labels.end(), -1);
 
     // Assign each peak to its own cluster
     for (size_t i = 0; i < peaks.size(); ++i) {
@@ -201,39 +398,223 @@ std::vector<int> assign_labels(std::span<const Alignment> alignments,
 
         labels[i] = closestPeak;  // Assign closest peak's cluster label
     }
+}
 
+std::vector<int> assign_labels(std::span<const Alignment> alignments, 
+                               const std::vector<size_t>& validIndices, 
+                               const std::vector<size_t>& peaks,
+                               double dpar) {
+    std::vector<int> labels(validIndices.size());
+    assign_labels(alignments, std::span<const size_t>(validIndices), peaks, labels, dpar);
     return labels;
 }
 
 
-std::vector<int> cluster_alignments(std::span<const Alignment> alignments, double dpar) {
-    // std::cout << "Processing queryID: " << alignments[start].queryID << " from index " << start << " to " << end-1 << std::endl;
+// Labels of all the alignments of a query given the peaks found on peakIndices
+static void label_alignments(std::span<const Alignment> alignments,
+                             std::span<const size_t> validIndices,
+                             std::span<const size_t> repIndices,
+                             bool sampled,
+                             double dpar,
+                             ClusterWorkspace& ws,
+                             std::vector<int>& labelsAll) {
+    // Unsampled intervals are assigned to the nearest peak like any other non-peak
+    if (sampled) {
+        for (auto& peak : ws.peaks) {
+            peak = ws.samplePos[peak];
+        }
+    }
+
+    ws.labels.resize(repIndices.size());
+    assign_labels(alignments, repIndices, ws.peaks, ws.labels, dpar);
 
-    // Core
-    std::vector<size_t> validIndices = get_nonredundant_indices(alignments, 0.2); // TODO: use ranges to avoid validIndices
+    // labels for all alignments, not only valid ones
+    labelsAll.assign(alignments.size(), -1);
+    for (size_t i = 0; i < validIndices.size(); ++i) {
+        labelsAll[validIndices[i]] = ws.labels[ws.groupOf[i]];
+    }
+}
 
-    std::vector<double> rho = calculate_density(alignments, validIndices, dpar);
+std::span<const int> cluster_alignments(std::span<const Alignment> alignments, ClusterWorkspace& ws, double dpar,
+                                        size_t maxAlignments) {
+    // Core
+    std::span<const size_t> validIndices = get_nonredundant_indices(alignments, 0.2, ws); // TODO: use ranges to avoid validIndices
+
+    // The distance only depends on the query interval: cluster one weighted
+    // representative per distinct interval. Only the delta noise differs (see collapse_intervals).
+    std::span<const size_t> repIndices = collapse_intervals(alignments, validIndices, ws);
+
+    // Too many distinct intervals: find the peaks on a stratified sample
+    bool sampled = maxAlignments > 0 && repIndices.size() > maxAlignments;
+    std::span<const size_t> peakIndices = repIndices;
+    std::span<const uint32_t> peakWeights = ws.weights;
+    if (sampled) {
+        peakIndices = sample_intervals(alignments, ws, maxAlignments, dpar);
+        peakWeights = ws.sampleWeights;
+    }
 
-    std::vector<double> delta = calculate_delta(alignments, validIndices, rho);
+    ws.rho.resize(peakIndices.size());
+    calculate_density(alignments, peakIndices, peakWeights, ws.rho, dpar);
 
-    std::vector<size_t> peaks = pick_peaks(rho, delta);
+    ws.delta.resize(peakIndices.size());
+    calculate_delta(alignments, peakIndices, ws.rho, ws.delta, ws.sortedIndices);
 
-    std::vector<int> labels = assign_labels(alignments, validIndices, peaks, 0.2);
+    pick_peaks(ws.rho, ws.delta, ws.peaks, 10.0, 0.4, 10);
 
-    // print labels only if assigned
-    // for (size_t i = 0; i < validIndices.size(); ++i) {
-    //     auto i_all = validIndices[i];
-    //     if (labels[i] != -1) {
-    //         std::cout << "Query: " << alignments[i_all].queryID << " Search: " << alignments[i_all].searchID << " assigned to cluster " << labels[i] << std::endl;
-    //     }
-    // }
+    label_alignments(alignments, validIndices, repIndices, sampled, dpar, ws, ws.labelsAll);
     
-    // labels for all alignments, not only valid ones
-    std::vector<int> labels_all(alignments.size(), -1);
-    for (size_t i = 0; i < validIndices.size(); ++i) {
-        labels_all[validIndices[i]] = labels[i];
+    return ws.labelsAll;
+}
+
+std::vector<int> cluster_alignments(std::span<const Alignment> alignments, double dpar, size_t maxAlignments) {
+    ClusterWorkspace ws;
+    std::span<const int> labels = cluster_alignments(alignments, ws, dpar, maxAlignments);
+    return std::vector<int>(labels.begin(), labels.end());
+}
+
+
+bool build_neighbors(std::span<const Alignment> alignments,
+                     std::span<const size_t> indices,
+                     double radius,
+                     ClusterWorkspace& ws) {
+    const size_t n = indices.size();
+
+    // Pairs closer than radius, given up if the query is too dense to store them
+    ws.nbrPairs.clear();
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = i + 1; j < n; ++j) {
+            double d = distance(alignments[indices[i]], alignments[indices[j]]);
+            if (d < radius) {
+                if (ws.nbrPairs.size() == SWEEP_MAX_NEIGHBORS / 2) return false;
+                ws.nbrPairs.push_back({static_cast<uint32_t>(i), static_cast<uint32_t>(j), d});
+            }
+        }
     }
-    
-    return labels_all;
 
-}
\ No newline at end of file
+    // Symmetric CSR lists, each sorted by neighbor index
+    ws.nbrOffsets.assign(n + 1, 0);
+    for (const auto& pair : ws.nbrPairs) {
+        ++ws.nbrOffsets[pair.i + 1];
+        ++ws.nbrOffsets[pair.j + 1];
+    }
+    for (size_t i = 0; i < n; ++i) {
+        ws.nbrOffsets[i + 1] += ws.nbrOffsets[i];
+    }
+
+    ws.nbrIndex.resize(ws.nbrOffsets[n]);
+    ws.nbrDist.resize(ws.nbrOffsets[n]);
+    std::vector<size_t>& pos = ws.sortedIndices;
+    pos.assign(ws.nbrOffsets.begin(), ws.nbrOffsets.end() - 1);
+    for (const auto& pair : ws.nbrPairs) {
+        ws.nbrIndex[pos[pair.i]] = pair.j;
+        ws.nbrDist[pos[pair.i]++] = pair.d;
+        ws.nbrIndex[pos[pair.j]] = pair.i;
+        ws.nbrDist[pos[pair.j]++] = pair.d;
+    }
+    ws.nbrPairs.clear();
+
+    return true;
+}
+
+// Density and delta for one configuration, from the neighbor lists of build_neighbors
+static void neighbor_density_delta(std::span<const Alignment> alignments,
+                                   std::span<const size_t> indices,
+                                   std::span<const uint32_t> weights,
+                                   const ClusterParams& params,
+                                   ClusterWorkspace& ws) {
+    const size_t n = indices.size();
+
+    for (size_t i = 0; i < n; ++i) {
+        ws.rho[i] = 1.0 + ws.rhoNoise[i];
+        if (params.dpar > 0) ws.rho[i] += weights[i] - 1;
+        for (size_t e = ws.nbrOffsets[i]; e < ws.nbrOffsets[i + 1]; ++e) {
+            if (ws.nbrDist[e] < params.dpar) ws.rho[i] += weights[ws.nbrIndex[e]];
+        }
+    }
+
+    std::vector<size_t>& sortedIndices = ws.sortedIndices;
+    sortedIndices.resize(n);
+    std::iota(sortedIndices.begin(), sortedIndices.end(), 0);
+    std::sort(sortedIndices.begin(), sortedIndices.end(), [&](size_t a, size_t b) {
+        return ws.rho[a] > ws.rho[b];
+    });
+    ws.rank.resize(n);
+    for (size_t r = 0; r < n; ++r) {
+        ws.rank[sortedIndices[r]] = r;
+    }
+
+    for (size_t r = 0; r < n; ++r) {
+        size_t i = sortedIndices[r];
+        double delta = 1000.0;
+        bool found = false;
+
+        // The closest denser alignment is a neighbor, unless none is within the radius
+        for (size_t e = ws.nbrOffsets[i]; e < ws.nbrOffsets[i + 1]; ++e) {
+            if (ws.rank[ws.nbrIndex[e]] >= r) continue;
+            found = true;
+            delta = std::min(delta, ws.nbrDist[e] + 0.00001 * noise.uniform());
+        }
+        if (!found) {
+            for (size_t q = 0; q < r; ++q) {
+                double dist = distance(alignments[indices[i]], alignments[indices[sortedIndices[q]]]);
+                delta = std::min(delta, dist + 0.00001 * noise.uniform());
+            }
+        }
+        ws.delta[i] = delta;
+    }
+}
+
+const std::vector<std::vector<int>>& cluster_alignments_sweep(std::span<const Alignment> alignments,
+                                                              ClusterWorkspace& ws,
+                                                              std::span<const ClusterParams> grid,
+                                                              size_t maxAlignments) {
+    // Same preprocessing as cluster_alignments, shared by all the configurations
+    std::span<const size_t> validIndices = get_nonredundant_indices(alignments, 0.2, ws);
+    std::span<const size_t> repIndices = collapse_intervals(alignments, validIndices, ws);
+
+    // The sample merges intervals within the smallest radius, which all the configurations see as neighbors
+    bool sampled = maxAlignments > 0 && repIndices.size() > maxAlignments;
+    std::span<const size_t> peakIndices = repIndices;
+    std::span<const uint32_t> peakWeights = ws.weights;
+    if (sampled) {
+        double minDpar = grid.empty() ? 0.2 : grid[0].dpar;
+        for (const auto& params : grid) {
+            minDpar = std::min(minDpar, params.dpar);
+        }
+        peakIndices = sample_intervals(alignments, ws, maxAlignments, minDpar);
+        peakWeights = ws.sampleWeights;
+    }
+    const size_t n = peakIndices.size();
+
+    // Pairwise distances are computed once, up to the largest radius any configuration looks at
+    double radius = 0.2;
+    for (const auto& params : grid) {
+        radius = std::max({radius, params.dpar, params.delta_threshold});
+    }
+    bool useNeighbors = build_neighbors(alignments, peakIndices, radius, ws);
+
+    ws.rhoNoise.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        ws.rhoNoise[i] = density_noise(alignments[peakIndices[i]]);
+    }
+
+    ws.sweepLabels.resize(grid.size());
+    ws.rho.resize(n);
+    ws.delta.resize(n);
+    for (size_t c = 0; c < grid.size(); ++c) {
+        const ClusterParams& params = grid[c];
+
+        if (useNeighbors) {
+            neighbor_density_delta(alignments, peakIndices, peakWeights, params, ws);
+        } else {
+            calculate_density(alignments, peakIndices, peakWeights, ws.rho, params.dpar);
+            calculate_delta(alignments, peakIndices, ws.rho, ws.delta, ws.sortedIndices);
+        }
+
+        pick_peaks(ws.rho, ws.delta, ws.peaks, params.rho_threshold, params.delta_threshold, params.max_peaks);
+
+        label_alignments(alignments, validIndices, repIndices, sampled, params.dpar, ws, ws.sweepLabels[c]);
+    }
+
+    return ws.sweepLabels;
+}
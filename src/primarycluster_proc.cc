@@ -1,12 +1,53 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <omp.h>
+#include <sstream>
+#include <stdexcept>
 #include <vector>
 #include <span>
 
 #include <dpcstruct/primarycluster_core.h>
 #include <dpcstruct/primarycluster_proc.h>
+#include <dpcstruct/external_sort.h>
+#include <dpcstruct/sort.h>
 
-std::vector<int> process_by_query(const std::vector<Alignment>& alignments, int numThreads) {
+uint64_t query_store_fingerprint(size_t maxAlignments) {
+    // Only the per-query cap is configurable, the other parameters are fixed in cluster_alignments.
+    // The version invalidates the stores written by a clustering that labels queries differently.
+    return (static_cast<uint64_t>(CLUSTERING_VERSION) << 48) ^ maxAlignments;
+}
+
+// Clusters a single query, or copies its primary clusters from the store if its block is unchanged
+static void cluster_query(std::span<const Alignment> perQueryAlns, ClusterWorkspace& ws, size_t maxAlignments,
+                          QueryMemo* memo, std::vector<SmallPC>& pcs) {
+    if (memo == nullptr) {
+        emit_primary_clusters(perQueryAlns, cluster_alignments(perQueryAlns, ws, 0.2, maxAlignments), pcs);
+        return;
+    }
+
+    uint32_t queryID = perQueryAlns.front().queryID;
+    uint64_t hash = hash_query_block(perQueryAlns);
+    size_t first = pcs.size();
+
+    std::span<const SmallPC> cached;
+    if (memo->previous != nullptr && memo->previous->lookup(queryID, hash, cached)) {
+        pcs.insert(pcs.end(), cached.begin(), cached.end());
+        memo->reused.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        emit_primary_clusters(perQueryAlns, cluster_alignments(perQueryAlns, ws, 0.2, maxAlignments), pcs);
+    }
+
+    if (memo->current != nullptr) {
+        memo->current->append(queryID, hash, pcs.data() + first, pcs.size() - first);
+    }
+}
+
+std::vector<SmallPC> process_by_query(const std::vector<Alignment>& alignments, int numThreads, size_t maxAlignments,
+                                      QueryMemo* memo) {
 
     // Set number of threads
     omp_set_num_threads(numThreads);
@@ -29,21 +70,395 @@ std::vector<int> process_by_query(const std::vector<Alignment>& alignments, int
         }
     }
 
-    // define labels vector
-    std::vector<int> labels(alignments.size(), -1);
+    // Primary clusters found by each thread. With a static schedule every thread
+    // gets a contiguous range of queries, so concatenating them keeps the query order
+    std::vector<std::vector<SmallPC>> threadPCs(numThreads);
 
     // Parallel processing of each chunk
-    #pragma omp parallel for schedule(static)
-    for (size_t i = 0; i < chunks.size(); ++i) {
-        size_t start = chunks[i].first;
-        size_t end = chunks[i].second;
+    #pragma omp parallel
+    {
+        // Buffers reused by all the queries of this thread
+        ClusterWorkspace ws;
+        std::vector<SmallPC>& localPCs = threadPCs[omp_get_thread_num()];
+
+        #pragma omp for schedule(static)
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            size_t start = chunks[i].first;
+            size_t end = chunks[i].second;
+
+            // Process alignments for the current chunk
+            std::span<const Alignment> perQueryAlns(alignments.data() + start, end - start);
+            cluster_query(perQueryAlns, ws, maxAlignments, memo, localPCs);
+        }
+    }
+
+    size_t numPCs = 0;
+    for (const auto& localPCs : threadPCs) {
+        numPCs += localPCs.size();
+    }
+
+    std::vector<SmallPC> pcs;
+    pcs.reserve(numPCs);
+    for (auto& localPCs : threadPCs) {
+        pcs.insert(pcs.end(), localPCs.begin(), localPCs.end());
+        std::vector<SmallPC>().swap(localPCs);  // release as we go
+    }
+
+    return pcs;
+}
+
+
+std::vector<std::vector<SmallPC>> process_by_query_sweep(const std::vector<Alignment>& alignments, int numThreads,
+                                                         std::span<const ClusterParams> grid, size_t maxAlignments) {
+    if (alignments.empty()) {
+        throw std::invalid_argument("The alignments vector is empty");
+    }
+
+    std::vector<std::pair<size_t, size_t>> chunks;
+    size_t start = 0;
+    for (size_t i = 1; i <= alignments.size(); ++i) {
+        if (i == alignments.size() || alignments[i].queryID != alignments[start].queryID) {
+            chunks.push_back({start, i});
+            start = i;
+        }
+    }
+
+    // threadPCs[thread][config], concatenated in thread order as in process_by_query
+    std::vector<std::vector<std::vector<SmallPC>>> threadPCs(numThreads, std::vector<std::vector<SmallPC>>(grid.size()));
+
+    #pragma omp parallel num_threads(numThreads)
+    {
+        ClusterWorkspace ws;
+        auto& localPCs = threadPCs[omp_get_thread_num()];
+
+        #pragma omp for schedule(static)
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            std::span<const Alignment> perQueryAlns(alignments.data() + chunks[i].first, chunks[i].second - chunks[i].first);
+            const auto& perConfigLabels = cluster_alignments_sweep(perQueryAlns, ws, grid, maxAlignments);
+
+            for (size_t c = 0; c < grid.size(); ++c) {
+                emit_primary_clusters(perQueryAlns, perConfigLabels[c], localPCs[c]);
+            }
+        }
+    }
+
+    std::vector<std::vector<SmallPC>> pcs(grid.size());
+    for (size_t c = 0; c < grid.size(); ++c) {
+        size_t numPCs = 0;
+        for (const auto& localPCs : threadPCs) {
+            numPCs += localPCs[c].size();
+        }
+        pcs[c].reserve(numPCs);
+        for (auto& localPCs : threadPCs) {
+            pcs[c].insert(pcs[c].end(), localPCs[c].begin(), localPCs[c].end());
+            std::vector<SmallPC>().swap(localPCs[c]);
+        }
+    }
+
+    return pcs;
+}
+
+
+std::vector<ClusterParams> parse_param_grid(const std::string& spec) {
+    ClusterParams defaults;
+    std::vector<double> dpars{defaults.dpar};
+    std::vector<double> rhoThresholds{defaults.rho_threshold};
+    std::vector<double> deltaThresholds{defaults.delta_threshold};
+    std::vector<double> maxPeaks{static_cast<double>(defaults.max_peaks)};
+
+    std::stringstream specStream(spec);
+    std::string field;
+    while (std::getline(specStream, field, ':')) {
+        size_t eq = field.find('=');
+        if (eq == std::string::npos) {
+            throw std::invalid_argument("Invalid parameter grid entry (expected name=v1,v2,...): " + field);
+        }
+        std::string name = field.substr(0, eq);
+
+        std::vector<double> values;
+        std::stringstream valueStream(field.substr(eq + 1));
+        std::string value;
+        while (std::getline(valueStream, value, ',')) {
+            size_t parsed = 0;
+            try {
+                values.push_back(std::stod(value, &parsed));
+            } catch (const std::logic_error&) {
+                parsed = 0;
+            }
+            if (parsed == 0 || parsed != value.size()) {
+                throw std::invalid_argument("Invalid value for grid parameter " + name + ": " + value);
+            }
+        }
+        if (values.empty()) {
+            throw std::invalid_argument("No values for grid parameter " + name);
+        }
+
+        if (name == "dpar") dpars = values;
+        else if (name == "rho") rhoThresholds = values;
+        else if (name == "delta") deltaThresholds = values;
+        else if (name == "peaks") maxPeaks = values;
+        else throw std::invalid_argument("Unknown grid parameter " + name + " (use dpar, rho, delta, peaks)");
+    }
+
+    for (double dpar : dpars) {
+        if (!(dpar > 0)) throw std::invalid_argument("Grid parameter dpar must be positive: " + std::to_string(dpar));
+    }
+    for (double threshold : rhoThresholds) {
+        if (!(threshold >= 0)) throw std::invalid_argument("Grid parameter rho must be non-negative: " + std::to_string(threshold));
+    }
+    for (double threshold : deltaThresholds) {
+        if (!(threshold >= 0)) throw std::invalid_argument("Grid parameter delta must be non-negative: " + std::to_string(threshold));
+    }
+    // The labels of a query must fit in the qID*100 + label IDs of its primary clusters
+    for (double peaks : maxPeaks) {
+        if (!(peaks >= 1 && peaks <= MAX_PEAKS_PER_QUERY) || peaks != std::floor(peaks)) {
+            throw std::invalid_argument("Grid parameter peaks must be an integer in [1, " +
+                                        std::to_string(MAX_PEAKS_PER_QUERY) + "]: " + std::to_string(peaks));
+        }
+    }
+
+    // Cartesian product, dpar varying slowest
+    std::vector<ClusterParams> grid;
+    for (double dpar : dpars)
+        for (double rho : rhoThresholds)
+            for (double delta : deltaThresholds)
+                for (double peaks : maxPeaks)
+                    grid.push_back({dpar, rho, delta, static_cast<size_t>(peaks)});
+
+    return grid;
+}
+
+
+void emit_primary_clusters(std::span<const Alignment> alignments, std::span<const int> labels, std::vector<SmallPC>& pcs) {
+    // Population of each label: it is the qSize of the primary cluster
+    int numLabels = 0;
+    for (int label : labels) {
+        numLabels = std::max(numLabels, label + 1);
+    }
+    std::vector<uint32_t> counts(numLabels, 0);
+    for (int label : labels) {
+        if (label >= 0) ++counts[label];
+    }
+
+    // Emit label by label, keeping the alignments order inside each primary cluster
+    for (int label = 0; label < numLabels; ++label) {
+        for (size_t i = 0; i < alignments.size(); ++i) {
+            if (labels[i] != label) continue;
+
+            const Alignment& aln = alignments[i];
+            pcs.emplace_back(
+                aln.queryID * 100 + label,
+                counts[label],
+                aln.searchID,
+                static_cast<uint16_t>(aln.searchStart),
+                static_cast<uint16_t>(aln.searchEnd)
+            );
+        }
+    }
+}
+
+
+std::string shard_path(const std::string& outPath, int shard) {
+    std::filesystem::path out(outPath);
+    return ((out.parent_path() / out.stem()).string() + "_" + std::to_string(shard) + out.extension().string());
+}
+
+std::string shard_manifest_path(const std::string& outPath) {
+    std::filesystem::path out(outPath);
+    return (out.parent_path() / out.stem()).string() + "_shards.tsv";
+}
+
+
+std::vector<PCShard> write_shards(std::vector<SmallPC>& pcs, const std::string& outPath, int numShards, int numThreads) {
+    std::vector<PCShard> shards;
+    if (pcs.empty()) {
+        write_shard_manifest(shard_manifest_path(outPath), shards);
+        return shards;
+    }
+
+    uint32_t maxSID = 0;
+    #pragma omp parallel for num_threads(numThreads) reduction(max:maxSID)
+    for (size_t i = 0; i < pcs.size(); ++i) {
+        maxSID = std::max(maxSID, pcs[i].sID);
+    }
+
+    // Records per sID, then the shard of each sID: a shard is closed once it
+    // reaches its share of the records
+    std::vector<uint64_t> shardOf(static_cast<uint64_t>(maxSID) + 1, 0);
+    for (const auto& pc : pcs) {
+        ++shardOf[pc.sID];
+    }
+
+    std::vector<uint64_t> shardStart{0};
+    uint64_t cumulative = 0;
+    for (uint64_t sID = 0; sID <= maxSID; ++sID) {
+        uint64_t count = shardOf[sID];
+        shardOf[sID] = shardStart.size() - 1;
+        cumulative += count;
+
+        if (shardStart.size() < static_cast<size_t>(numShards) && cumulative > shardStart.back() &&
+            cumulative >= pcs.size() * shardStart.size() / numShards) {
+            shardStart.push_back(cumulative);
+        }
+    }
+    if (shardStart.back() != pcs.size()) shardStart.push_back(pcs.size());
+    size_t numWritten = shardStart.size() - 1;
+
+    // Stable bucketing, so each shard keeps the query order of its records
+    std::vector<SmallPC> bucketed(pcs.size());
+    std::vector<uint64_t> pos(shardStart.begin(), shardStart.end() - 1);
+    for (const auto& pc : pcs) {
+        bucketed[pos[shardOf[pc.sID]]++] = pc;
+    }
+    std::vector<SmallPC>().swap(pcs);
+    std::vector<uint64_t>().swap(shardOf);
+
+    shards.resize(numWritten);
+    std::string error;
+
+    #pragma omp parallel for num_threads(numThreads) schedule(dynamic, 1)
+    for (size_t k = 0; k < numWritten; ++k) {
+        SmallPC* shardData = bucketed.data() + shardStart[k];
+        uint64_t count = shardStart[k + 1] - shardStart[k];
+
+        radix_sort(shardData, count, [](const SmallPC& pc) { return pc.sID; }, 1);
+
+        std::string path = shard_path(outPath, k + 1);
+        std::ofstream outFile(path, std::ios::binary);
+        outFile.write(reinterpret_cast<const char*>(shardData), count * sizeof(SmallPC));
+        if (!outFile) {
+            #pragma omp critical(shard_error)
+            error = "Failed to write output file: " + path;
+        }
+
+        shards[k] = {shardData[0].sID, shardData[count - 1].sID, count, path};
+    }
+
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+
+    write_shard_manifest(shard_manifest_path(outPath), shards);
+    return shards;
+}
+
+
+ShardWriter::ShardWriter(const std::string& outPath, int numShards, uint64_t totalRecords)
+    : outPath(outPath), numShards(numShards), totalRecords(totalRecords), written(0) {}
+
+void ShardWriter::open_shard(uint32_t sID) {
+    outFile.close();
+    shards.push_back({sID, sID, 0, shard_path(outPath, shards.size() + 1)});
+    outFile.open(shards.back().filename, std::ios::binary);
+    if (!outFile) {
+        throw std::runtime_error("Failed to open output file: " + shards.back().filename);
+    }
+}
+
+void ShardWriter::write(const SmallPC* pcs, uint64_t count) {
+    uint64_t begin = 0;
+    while (begin < count) {
+        // A new shard starts on an sID change, once the current one has its share of the records
+        if (shards.empty()) {
+            open_shard(pcs[begin].sID);
+        } else if (pcs[begin].sID != shards.back().lastSID && shards.size() < static_cast<size_t>(numShards) &&
+                   written >= totalRecords * shards.size() / numShards) {
+            open_shard(pcs[begin].sID);
+        }
+
+        // Run of records that can go to the current shard
+        uint64_t end = begin + 1;
+        while (end < count && pcs[end].sID == pcs[end - 1].sID) ++end;
+
+        outFile.write(reinterpret_cast<const char*>(pcs + begin), (end - begin) * sizeof(SmallPC));
+        shards.back().lastSID = pcs[end - 1].sID;
+        shards.back().records += end - begin;
+        written += end - begin;
+        begin = end;
+    }
+}
+
+std::vector<PCShard> ShardWriter::finish() {
+    // Without records no shard was opened, the manifest is empty as with write_shards
+    if (shards.empty()) {
+        write_shard_manifest(shard_manifest_path(outPath), shards);
+        return shards;
+    }
+
+    outFile.close();
+    if (outFile.fail()) {
+        throw std::runtime_error("Failed to write output file: " + shards.back().filename);
+    }
+    write_shard_manifest(shard_manifest_path(outPath), shards);
+    return shards;
+}
+
+
+uint64_t process_stream(AlnsFileParser& parser, const std::string& outPath, const std::string& tmpDir,
+                        uint64_t memoryBytes, int numThreads, size_t maxAlignments, int numShards,
+                        QueryMemo* memo) {
+
+    // Runs are ordered by (sID, qID): a query never spans two runs, and inside
+    // a run its records keep the emission order
+    auto key = [](const SmallPC& pc) { return (static_cast<uint64_t>(pc.sID) << 32) | pc.qID; };
+    ExternalSorter<SmallPC, decltype(key)> sorter(key, memoryBytes, tmpDir, numThreads);
+
+    // Each worker fills its own run, the budget is split among them
+    size_t runSize = sorter.run_capacity(numThreads);
+    uint64_t numQueries = 0;
+
+    std::string error;  // exceptions can't leave the parallel region
+
+    #pragma omp parallel num_threads(numThreads)
+    try {
+        std::vector<Alignment> perQueryAlns;
+        ClusterWorkspace ws;
+        std::vector<SmallPC> run;
+        run.reserve(runSize);
+
+        while (true) {
+            // Only the block boundaries are found under the lock, parsing happens in parallel
+            const char* blockStart = nullptr;
+            const char* blockEnd = nullptr;
+            bool found;
+            #pragma omp critical(stream_reader)
+            found = parser.nextQueryBlock(blockStart, blockEnd);
+            if (!found) break;
+
+            perQueryAlns.clear();
+            parser.parseBlock(blockStart, blockEnd, perQueryAlns);
+            if (perQueryAlns.empty()) continue;
+
+            cluster_query(perQueryAlns, ws, maxAlignments, memo, run);
+
+            #pragma omp atomic
+            ++numQueries;
+
+            // Spill only between queries, so each query lives in a single run
+            if (run.size() >= runSize) {
+                sorter.spill(run);
+            }
+        }
+
+        sorter.spill(run);
+    } catch (const std::exception& e) {
+        #pragma omp critical(stream_error)
+        if (error.empty()) error = e.what();
+    }
+
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+
+    std::cout << "Number of queries: " << numQueries << std::endl;
+    std::cout << "Merging " << sorter.num_runs() << " runs..." << std::endl;
 
-        // Process alignments for the current chunk
-        std::span<const Alignment> perQueryAlns(alignments.data() + start, end - start);
-        std::vector<int> perQueryLabels = cluster_alignments(perQueryAlns, 0.2);
-        
-        std::copy(perQueryLabels.begin(), perQueryLabels.end(), labels.begin() + start);        
+    if (numShards > 0) {
+        uint64_t written = sorter.size();
+        std::vector<PCShard> shards = write_sorted_shards(sorter, outPath, numShards);
+        std::cout << "Number of shards: " << shards.size() << std::endl;
+        return written;
     }
 
-    return labels;
-}
\ No newline at end of file
+    return write_sorted(sorter, outPath);
+}
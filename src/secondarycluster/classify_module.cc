@@ -9,7 +9,7 @@
 
 void sc_classify_module(int argc, char** argv) {
     std::vector<Option> options = {
-        {'i', "INPUT", "list of space-separated files"},
+        {'i', "INPUT", "list of space-separated distance files (pairs or compact format)"},
         {'o', "OUTPUT", "output file containing the classified primary clusters"},
         {'t', "THREADS", "number of threads (TBI)", false}
     };
@@ -11,34 +11,9 @@
 
 #include <dpcstruct/secondarycluster/classify_proc.h>
 #include <dpcstruct/types/ProducerConsumer.h>
+#include <dpcstruct/fileparser/DistanceFile.h>
 
 
-template<typename T>
-int load_file(std::string filename, std::vector<T> & vector) {
-    std::ifstream inFile (filename, std::ifstream::binary);
-    
-    size_t bytes{0};
-    size_t totalEntries{0};
-
-    if (inFile) {
-        inFile.seekg (0, inFile.end);
-        bytes = inFile.tellg();
-        inFile.seekg (0, inFile.beg);
-        totalEntries = bytes/sizeof(T);
-
-        vector.resize(totalEntries);
-
-        // read data as a block into vector:
-        inFile.read(reinterpret_cast<char*>(vector.data()), bytes); // or &buf[0] for C++98
-    }
-    else {
-        throw std::ios_base::failure( "File " + filename + " could not be read." );  
-    }
-    inFile.close();
-
-    return 0;
-}
-
 // TODO: add overflow error check
 template <typename T>
 std::vector<uint32_t> sort_indexes(const std::vector<T> &v) {
@@ -133,7 +108,7 @@ void run_classification(const std::vector<std::string> filesList, const std::str
     std::vector<uint32_t> rev; // from ascending cIDs to og cIDs
     for (auto filename: filesList)
     {
-        load_file(filename, pcDistanceMat);
+        read_distance_file(filename, pcDistanceMat);
         for (auto & entry: pcDistanceMat)
         {
             cID_set.insert(entry.ID1);
@@ -174,7 +149,7 @@ void run_classification(const std::vector<std::string> filesList, const std::str
     for (auto filename: filesList)
     {
 
-        load_file(filename, pcDistanceMat);
+        read_distance_file(filename, pcDistanceMat);
 
         for (auto & entry: pcDistanceMat)
         {
@@ -208,7 +183,7 @@ void run_classification(const std::vector<std::string> filesList, const std::str
     for (auto filename: filesList)
     {
 
-	load_file(filename,pcDistanceMat);
+	read_distance_file(filename, pcDistanceMat);
 
         for (const auto & entry: pcDistanceMat)
         {
@@ -271,7 +246,7 @@ void run_classification(const std::vector<std::string> filesList, const std::str
     // loop threw all datapoints and compare distance to peaks
     for (auto filename: filesList) {
 
-        load_file(filename,pcDistanceMat);
+        read_distance_file(filename, pcDistanceMat);
 
         for (auto & entry: pcDistanceMat) {
             auto nID1 = fwd[entry.ID1];
@@ -351,7 +326,7 @@ void run_classification(const std::vector<std::string> filesList, const std::str
     // loop threw all datapoints and add distance to corresponding mc pair
     for (auto filename: filesList) {
 
-        load_file(filename,pcDistanceMat);
+        read_distance_file(filename, pcDistanceMat);
 
         for (auto & entry: pcDistanceMat)
         {
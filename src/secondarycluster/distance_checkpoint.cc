@@ -0,0 +1,191 @@
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <dpcstruct/secondarycluster/distance_proc.h>
+#include <dpcstruct/fileparser/TsvManifest.h>
+#include <dpcstruct/sort.h>
+
+static const std::string PROGRESS_HEADER = "chunk\tfirst_sID\tlast_sID\tpairs\tfile";
+
+std::string checkpoint_dir(const std::string& outputFile) {
+    return outputFile + ".ckpt";
+}
+
+static std::string progress_path(const std::string& checkpointDir) {
+    return (std::filesystem::path(checkpointDir) / "progress.tsv").string();
+}
+
+CheckpointProgress read_checkpoint_progress(const std::string& checkpointDir) {
+    CheckpointProgress progress{};
+    if (!std::filesystem::exists(progress_path(checkpointDir))) return progress;
+
+    TsvManifest manifest = read_tsv_manifest(progress_path(checkpointDir), PROGRESS_HEADER);
+    try {
+        progress.inputs.inputFileA = manifest_value(manifest, "input_a");
+        progress.inputs.inputFileB = manifest_value(manifest, "input_b");
+        progress.inputs.totalLinesA = std::stoull(manifest_value(manifest, "records_a"));
+        progress.inputs.totalLinesB = std::stoull(manifest_value(manifest, "records_b"));
+        progress.inputs.numCheckpoints = std::stoi(manifest_value(manifest, "checkpoints"));
+    } catch (const std::logic_error&) {
+        throw std::runtime_error("Error: " + progress_path(checkpointDir) + " does not name the inputs of its chunks");
+    }
+
+    for (const auto& line : manifest.entries) {
+        std::stringstream ss(line);
+        CheckpointChunk chunk;
+        if (!(ss >> chunk.chunk >> chunk.firstSID >> chunk.lastSID >> chunk.pairs >> chunk.filename)) {
+            throw std::runtime_error("Error: malformed line in " + progress_path(checkpointDir) + ": " + line);
+        }
+        chunk.filename = (std::filesystem::path(checkpointDir) / chunk.filename).string();
+        progress.chunks.push_back(chunk);
+    }
+
+    return progress;
+}
+
+// The manifest is replaced atomically, so it only lists chunks whose file is complete
+void write_checkpoint_progress(const std::string& checkpointDir, const CheckpointProgress& progress) {
+    TsvManifest manifest;
+    manifest.metadata = {{"input_a", progress.inputs.inputFileA},
+                         {"records_a", std::to_string(progress.inputs.totalLinesA)},
+                         {"input_b", progress.inputs.inputFileB},
+                         {"records_b", std::to_string(progress.inputs.totalLinesB)},
+                         {"checkpoints", std::to_string(progress.inputs.numCheckpoints)}};
+    for (const auto& chunk : progress.chunks) {
+        manifest.entries.push_back(std::to_string(chunk.chunk) + "\t" + std::to_string(chunk.firstSID) + "\t" +
+                                   std::to_string(chunk.lastSID) + "\t" + std::to_string(chunk.pairs) + "\t" +
+                                   std::filesystem::path(chunk.filename).filename().string());
+    }
+    write_tsv_manifest(progress_path(checkpointDir), PROGRESS_HEADER, manifest);
+}
+
+void remove_checkpoints(const std::string& outputFile) {
+    std::error_code ec;
+    std::filesystem::remove_all(checkpoint_dir(outputFile), ec);
+}
+
+
+// A chunk of a previous run is reused if it covers the same sIDs and its file is complete
+static bool load_chunk(const std::vector<CheckpointChunk>& done, const CheckpointChunk& chunk, std::vector<PairCount>& counts) {
+    for (const auto& previous : done) {
+        if (previous.chunk != chunk.chunk || previous.firstSID != chunk.firstSID || previous.lastSID != chunk.lastSID) continue;
+
+        std::ifstream infile(previous.filename, std::ios::binary | std::ios::ate);
+        if (!infile || static_cast<uint64_t>(infile.tellg()) != previous.pairs * sizeof(PairCount)) return false;
+
+        counts.resize(previous.pairs);
+        infile.seekg(0);
+        infile.read(reinterpret_cast<char*>(counts.data()), previous.pairs * sizeof(PairCount));
+        return static_cast<bool>(infile);
+    }
+    return false;
+}
+
+static void save_chunk(const CheckpointChunk& chunk, const std::vector<PairCount>& counts) {
+    std::string tmpPath = chunk.filename + ".tmp";
+    {
+        std::ofstream outfile(tmpPath, std::ios::binary);
+        outfile.write(reinterpret_cast<const char*>(counts.data()), counts.size() * sizeof(PairCount));
+        if (!outfile) {
+            throw std::runtime_error("Failed to write checkpoint file: " + tmpPath);
+        }
+    }
+    std::filesystem::rename(tmpPath, chunk.filename);
+}
+
+
+std::vector<std::vector<PairCount>> checkpointed_pair_counts(SmallPC* pcsBufferA, uint64_t totalLinesA, SmallPC* pcsBufferB,
+                                                             uint64_t totalLinesB, const std::string& inputFileA,
+                                                             const std::string& inputFileB, const std::string& outputFile,
+                                                             int numProducers, int numConsumers, DistanceEngine engine,
+                                                             int numCheckpoints, bool resume, uint64_t queueCapacity) {
+    std::string checkpointDir = checkpoint_dir(outputFile);
+    CheckpointProgress progress{{std::filesystem::absolute(inputFileA).string(), std::filesystem::absolute(inputFileB).string(),
+                                 totalLinesA, totalLinesB, numCheckpoints}, {}};
+    std::vector<CheckpointChunk> done;
+    if (resume) {
+        CheckpointProgress previous = read_checkpoint_progress(checkpointDir);
+        if (!previous.chunks.empty() && !(previous.inputs == progress.inputs)) {
+            throw std::runtime_error("Error: the checkpoints in " + checkpointDir + " are of " + previous.inputs.inputFileA +
+                                     " (" + std::to_string(previous.inputs.totalLinesA) + " records) and " +
+                                     previous.inputs.inputFileB + " (" + std::to_string(previous.inputs.totalLinesB) +
+                                     " records) in " + std::to_string(previous.inputs.numCheckpoints) +
+                                     " chunks: remove them or run without resuming");
+        }
+        done = std::move(previous.chunks);
+    } else {
+        remove_checkpoints(outputFile);
+    }
+    std::filesystem::create_directories(checkpointDir);
+
+    // Chunks cut at sID boundaries, as the ranges of producers. The chunks of a self join are
+    // still the same range of the buffer on both sides.
+    std::vector<std::array<uint64_t, 2>> chunkIndices(numCheckpoints + 1);
+    files_partition(chunkIndices, pcsBufferA, pcsBufferB, totalLinesA, totalLinesB, numCheckpoints, {0, totalLinesA});
+
+    // qID ranges of the whole block, which the counts of every chunk are routed to
+    std::vector<uint64_t> qIDs_partition(numConsumers - 1, 0);
+    balanced_partition(qIDs_partition, pcsBufferA, totalLinesA, pcsBufferB, totalLinesB, numConsumers);
+    ConsumerRouter router(qIDs_partition);
+    std::vector<std::vector<PairCount>> pairCounts(numConsumers);
+
+    for (int k = 0; k < numCheckpoints; ++k) {
+        uint64_t beginA = chunkIndices[k][0], endA = chunkIndices[k + 1][0];
+        uint64_t beginB = chunkIndices[k][1], endB = chunkIndices[k + 1][1];
+        if (beginA >= endA) continue;
+
+        CheckpointChunk chunk{k + 1, pcsBufferA[beginA].sID, pcsBufferA[endA - 1].sID, 0,
+                              (std::filesystem::path(checkpointDir) / ("chunk_" + std::to_string(k + 1) + ".bin")).string()};
+
+        std::vector<PairCount> counts;
+        if (load_chunk(done, chunk, counts)) {
+            std::cout << "Chunk " << chunk.chunk << "/" << numCheckpoints << ": restored from checkpoint" << std::endl;
+        } else {
+            std::cout << "Chunk " << chunk.chunk << "/" << numCheckpoints << ": sIDs " << chunk.firstSID << "-" << chunk.lastSID << std::endl;
+            SmallPC* chunkA = pcsBufferA + beginA;
+            SmallPC* chunkB = pcsBufferB + beginB;
+            auto chunkCounts = count_block_pairs(chunkA, endA - beginA, chunkB, endB - beginB, {0, endA - beginA},
+                                                 numProducers, numConsumers, engine, queueCapacity);
+            for (auto& partitionCounts : chunkCounts) {
+                counts.insert(counts.end(), partitionCounts.begin(), partitionCounts.end());
+                std::vector<PairCount>().swap(partitionCounts);
+            }
+            save_chunk(chunk, counts);
+        }
+
+        chunk.pairs = counts.size();
+        progress.chunks.push_back(chunk);
+        write_checkpoint_progress(checkpointDir, progress);
+
+        for (const auto& pairCount : counts) {
+            pairCounts[router(pairCount.ID1)].push_back(pairCount);
+        }
+    }
+
+    // A pair of primary clusters can match on the sIDs of several chunks: sum its partial counts,
+    // as the map-reduce engine does. The normalization only depends on the pair, so it is the
+    // same in every chunk.
+    std::vector<std::thread> workers;
+    for (int p = 0; p < numConsumers; ++p) {
+        workers.emplace_back([&counts = pairCounts[p]]() {
+            radix_sort(counts.data(), counts.size(), [](const PairCount& pc) { return pc.key(); }, 1);
+
+            size_t out = 0;
+            for (size_t i = 0; i < counts.size(); ++i) {
+                if (out > 0 && counts[out - 1].key() == counts[i].key()) {
+                    counts[out - 1].ratio.num += counts[i].ratio.num;
+                } else {
+                    counts[out++] = counts[i];
+                }
+            }
+            counts.resize(out);
+        });
+    }
+    for (auto& worker : workers) worker.join();
+
+    return pairCounts;
+}
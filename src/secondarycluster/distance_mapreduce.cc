@@ -0,0 +1,80 @@
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <dpcstruct/secondarycluster/distance_proc.h>
+#include <dpcstruct/secondarycluster/pair_matching.h>
+#include <dpcstruct/sort.h>
+
+// Map-reduce pair counting, with no queues and no shared maps.
+// Map: each worker takes tiles of the files from the shared pool and appends the matched
+// pairs to its own buffers, one per qID range. Reduce: each qID range gathers the buffers of
+// all workers, sorts them wrt (ID1, ID2) and run-length reduces them into the counts.
+std::vector<std::vector<PairCount>> mapreduce_pair_counts(ThreadData& threadData) {
+    int numWorkers = threadData.numProducers;
+    int numPartitions = threadData.numConsumers;
+
+    // buffers[worker][partition]
+    std::vector<std::vector<std::vector<MatchedPair>>> buffers(numWorkers, std::vector<std::vector<MatchedPair>>(numPartitions));
+
+    std::vector<std::thread> workers;
+    for (int w = 0; w < numWorkers; ++w) {
+        workers.emplace_back([&threadData, &buffers, w]() {
+            const SmallPC* bufferA = reinterpret_cast<const SmallPC*>(threadData.bufferA);
+            const SmallPC* bufferB = reinterpret_cast<const SmallPC*>(threadData.bufferB);
+
+            auto& localBuffers = buffers[w];
+            uint64_t t;
+            while ((t = threadData.nextTile.fetch_add(1)) < threadData.tiles.size()) {
+                for_each_tile_pair(bufferA, bufferB, threadData.tiles[t], threadData.countFactor, [&](const MatchedPair& pair) {
+                    localBuffers[threadData.router(pair.ID1)].push_back(pair);
+                });
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+
+    // Partitions are handed out dynamically, their sizes can differ a lot
+    std::vector<std::vector<PairCount>> pairCounts(numPartitions);
+    std::atomic<int> nextPartition{0};
+
+    for (int w = 0; w < numWorkers; ++w) {
+        workers.emplace_back([&]() {
+            int p;
+            while ((p = nextPartition.fetch_add(1)) < numPartitions) {
+                size_t numPairs = 0;
+                for (int v = 0; v < numWorkers; ++v) {
+                    numPairs += buffers[v][p].size();
+                }
+
+                std::vector<MatchedPair> pairs;
+                pairs.reserve(numPairs);
+                for (int v = 0; v < numWorkers; ++v) {
+                    pairs.insert(pairs.end(), buffers[v][p].begin(), buffers[v][p].end());
+                    std::vector<MatchedPair>().swap(buffers[v][p]);
+                }
+
+                auto key = [](const MatchedPair& pair) { return (static_cast<uint64_t>(pair.ID1) << 32) | pair.ID2; };
+                radix_sort(pairs.data(), pairs.size(), key, 1);
+
+                // The normalization only depends on the pair, any match of the run gives it
+                std::vector<PairCount>& counts = pairCounts[p];
+                for (size_t begin = 0, end; begin < pairs.size(); begin = end) {
+                    for (end = begin + 1; end < pairs.size() && key(pairs[end]) == key(pairs[begin]); ++end) {}
+                    counts.emplace_back(pairs[begin].ID1, pairs[begin].ID2, Ratio(end - begin, pairs[begin].normFactor));
+                }
+                std::vector<MatchedPair>().swap(pairs);
+                if (threadData.writer) threadData.writer->submit(p, counts);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    return pairCounts;
+}
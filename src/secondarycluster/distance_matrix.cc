@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+#include <dpcstruct/secondarycluster/distance_proc.h>
+#include <dpcstruct/fileparser/PCsFileParser.h>
+#include <dpcstruct/fileparser/ShardManifest.h>
+#include <dpcstruct/fileparser/TsvManifest.h>
+
+static const std::string TILE_MANIFEST_HEADER = "tile\ti\tj\tpairs\tfile";
+
+std::string tile_path(const std::string& outputFile, int i, int j) {
+    std::filesystem::path out(outputFile);
+    return (out.parent_path() / out.stem()).string() + "_" + std::to_string(i) + "_" + std::to_string(j) +
+           out.extension().string();
+}
+
+std::string tile_manifest_path(const std::string& outputFile) {
+    std::filesystem::path out(outputFile);
+    return (out.parent_path() / out.stem()).string() + "_tiles.tsv";
+}
+
+std::vector<DistanceTile> read_tile_manifest(const std::string& manifestPath) {
+    TsvManifest manifest = read_tsv_manifest(manifestPath, TILE_MANIFEST_HEADER);
+
+    std::filesystem::path baseDir = std::filesystem::path(manifestPath).parent_path();
+    std::vector<DistanceTile> tiles;
+    for (const auto& line : manifest.entries) {
+        std::stringstream ss(line);
+        int index;
+        DistanceTile tile;
+        if (!(ss >> index >> tile.i >> tile.j >> tile.pairs >> tile.filename)) {
+            throw std::runtime_error("Error: malformed line in " + manifestPath + ": " + line);
+        }
+        tile.filename = (baseDir / tile.filename).string();
+        tiles.push_back(tile);
+    }
+
+    return tiles;
+}
+
+// The manifest is replaced atomically, so it always lists complete tiles
+void write_tile_manifest(const std::string& manifestPath, const std::vector<DistanceTile>& tiles) {
+    TsvManifest manifest;
+    for (size_t k = 0; k < tiles.size(); ++k) {
+        manifest.entries.push_back(std::to_string(k + 1) + "\t" + std::to_string(tiles[k].i) + "\t" +
+                                   std::to_string(tiles[k].j) + "\t" + std::to_string(tiles[k].pairs) + "\t" +
+                                   std::filesystem::path(tiles[k].filename).filename().string());
+    }
+    write_tsv_manifest(manifestPath, TILE_MANIFEST_HEADER, manifest);
+}
+
+
+namespace {
+
+// Reads the files of a shard list, resolved wrt the list directory, with their sizes and sID ranges
+std::vector<PCShard> read_shard_list(const std::string& listPath) {
+    if (is_shard_manifest(listPath)) {
+        throw std::runtime_error("Error: " + listPath + " is an sID shard manifest, whose shards share queries: "
+                                 "use it as a single input file (-i/-j)");
+    }
+
+    std::ifstream infile(listPath);
+    if (!infile) {
+        throw std::runtime_error("Error: Unable to open file " + listPath);
+    }
+
+    std::filesystem::path baseDir = std::filesystem::path(listPath).parent_path();
+    std::vector<PCShard> shards;
+    std::string line;
+    while (std::getline(infile, line)) {
+        if (line.empty()) continue;
+
+        PCShard shard{0, 0, 0, (baseDir / line).string()};
+        std::ifstream pcsFile(shard.filename, std::ios::binary | std::ios::ate);
+        if (!pcsFile) {
+            throw std::runtime_error("Error: Unable to open file " + shard.filename);
+        }
+
+        shard.records = static_cast<uint64_t>(pcsFile.tellg()) / sizeof(SmallPC);
+        if (shard.records > 0) {
+            SmallPC first, last;
+            pcsFile.seekg(0);
+            pcsFile.read(reinterpret_cast<char*>(&first), sizeof(SmallPC));
+            pcsFile.seekg((shard.records - 1) * sizeof(SmallPC));
+            pcsFile.read(reinterpret_cast<char*>(&last), sizeof(SmallPC));
+            shard.firstSID = first.sID;
+            shard.lastSID = last.sID;
+        }
+        shards.push_back(shard);
+    }
+
+    if (shards.empty()) {
+        throw std::runtime_error("Error: " + listPath + " lists no primary cluster files");
+    }
+    return shards;
+}
+
+// Loaded shards, least recently used first evicted when a new one exceeds the memory budget.
+// The shards of the current tile are never evicted.
+class ShardCache {
+public:
+    ShardCache(const std::vector<PCShard>& shards, uint64_t memoryBytes)
+        : shards(shards), memoryBytes(memoryBytes), usedBytes(0), loads(0) {}
+
+    PCsFileParser& get(int shard, int pinned) {
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->first == shard) {
+                entries.splice(entries.end(), entries, it);
+                return *entries.back().second;
+            }
+        }
+
+        uint64_t bytes = shards[shard].records * sizeof(SmallPC);
+        for (auto it = entries.begin(); it != entries.end() && usedBytes + bytes > memoryBytes;) {
+            if (it->first == pinned) {
+                ++it;
+                continue;
+            }
+            usedBytes -= shards[it->first].records * sizeof(SmallPC);
+            it = entries.erase(it);
+        }
+
+        auto loader = std::make_unique<PCsFileParser>(shards[shard].filename);
+        loader->loadPCs();
+        usedBytes += bytes;
+        ++loads;
+        entries.emplace_back(shard, std::move(loader));
+        return *entries.back().second;
+    }
+
+    uint64_t num_loads() const { return loads; }
+
+private:
+    const std::vector<PCShard>& shards;
+    uint64_t memoryBytes;
+    uint64_t usedBytes;
+    uint64_t loads;
+    std::list<std::pair<int, std::unique_ptr<PCsFileParser>>> entries;
+};
+
+}
+
+
+void calculate_distance_matrix(const std::string& shardList,
+                               const std::string& outputFile,
+                               int numProducers,
+                               int numConsumers,
+                               DistanceEngine engine,
+                               uint64_t memoryBytes,
+                               bool resume,
+                               uint64_t queueCapacity,
+                               DistanceFormat format) {
+    try {
+        std::vector<PCShard> shards = read_shard_list(shardList);
+        int numShards = shards.size();
+
+        std::cout << "Calculating full distance matrix between primary clusters..." << std::endl;
+        std::cout << "Shard list: " << shardList << " (" << numShards << " shards)" << std::endl;
+        std::cout << "Tile manifest: " << tile_manifest_path(outputFile) << std::endl;
+        std::cout << "Producers: " << numProducers << std::endl;
+        std::cout << "Consumers: " << numConsumers << std::endl;
+        std::cout << "Engine: " << distance_engine_name(engine) << std::endl;
+        std::cout << "Format: " << distance_format_name(format) << std::endl;
+        std::cout << "Memory budget: " << (memoryBytes >> 20) << " MB" << std::endl;
+
+        // Upper triangle in serpentine order: consecutive rows share the shards at their turn,
+        // and the shard of the row stays loaded along it
+        std::vector<std::pair<int, int>> schedule;
+        for (int i = 0; i < numShards; ++i) {
+            for (int k = i; k < numShards; ++k) {
+                int j = (i % 2 == 0) ? k : numShards - 1 - (k - i);
+                schedule.emplace_back(i, j);
+            }
+        }
+
+        // Tiles of an interrupted run are kept if their file is complete
+        std::vector<DistanceTile> tiles;
+        std::string manifestPath = tile_manifest_path(outputFile);
+        if (resume && std::filesystem::exists(manifestPath)) {
+            for (const auto& tile : read_tile_manifest(manifestPath)) {
+                if (tile.i >= 1 && tile.j <= numShards && distance_file_complete(tile.filename, tile.pairs)) {
+                    tiles.push_back(tile);
+                }
+            }
+            std::cout << "Resuming: " << tiles.size() << " tiles already computed" << std::endl;
+        }
+        auto is_done = [&tiles](int i, int j) {
+            return std::any_of(tiles.begin(), tiles.end(), [i, j](const DistanceTile& tile) { return tile.i == i && tile.j == j; });
+        };
+
+        ShardCache cache(shards, memoryBytes);
+
+        for (const auto& [i, j] : schedule) {
+            DistanceTile tile{i + 1, j + 1, 0, tile_path(outputFile, i + 1, j + 1)};
+            if (is_done(tile.i, tile.j)) continue;
+            std::cout << "Tile (" << tile.i << ", " << tile.j << ")" << std::endl;
+
+            // Shards without a common sID have no pair
+            bool disjoint = shards[i].records == 0 || shards[j].records == 0 ||
+                            shards[i].lastSID < shards[j].firstSID || shards[j].lastSID < shards[i].firstSID;
+            if (disjoint) {
+                std::vector<std::vector<PairCount>> none;
+                write_distances(none, tile.filename, 1, format);
+            } else {
+                PCsFileParser& loaderA = cache.get(i, j);
+                PCsFileParser& loaderB = (i == j) ? loaderA : cache.get(j, i);
+                tile.pairs = compute_block_distance(loaderA.getData(), loaderA.getTotalLines(), loaderB.getData(),
+                                                    loaderB.getTotalLines(), loaderA.getShardOffsets(), tile.filename,
+                                                    numProducers, numConsumers, engine, queueCapacity, format);
+            }
+
+            tiles.push_back(tile);
+            write_tile_manifest(manifestPath, tiles);
+        }
+
+        std::cout << "Completed " << tiles.size() << " tiles, " << cache.num_loads() << " shard loads" << std::endl;
+
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        throw;
+    }
+}
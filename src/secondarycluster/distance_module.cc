@@ -5,29 +5,59 @@
 // Function to handle the arguments and run distance calculation
 void sc_distance_module(int argc, char** argv) {
     std::vector<Option> options = {
-        {'i', "INPUTA", "input file A"},
-        {'j', "INPUTB", "input file B"},
-        {'o', "OUTPUT", "output file for the distance matrix"},
-        {'p', "PRODUCERS", "producer threads"},
-        {'c', "CONSUMERS", "consumer threads"}
+        {'i', "INPUTA", "input file A (primary clusters or shard manifest)", false},
+        {'j', "INPUTB", "input file B (primary clusters or shard manifest)", false},
+        {'l', "LIST", "list of primary cluster files, one per line: computes the full matrix by tiles (replaces -i and -j)", false},
+        {'o', "OUTPUT", "output file for the distance matrix (with -l: stem of the tile files and manifest)"},
+        {'p', "PRODUCERS", "producer threads (mapreduce, spgemm: worker threads)"},
+        {'c', "CONSUMERS", "consumer threads (mapreduce, spgemm: qID partitions)"},
+        {'e', "ENGINE", "pair counting engine: queue (default), mapreduce or spgemm", false},
+        {'m', "MEMORY", "memory budget for the loaded shards in MB, with -l (default 4096)", false},
+        {'k', "CHECKPOINTS", "number of sID chunks checkpointed to OUTPUT.ckpt, with -i and -j (default 0: none)", false},
+        {'q', "CAPACITY", "bound of each consumer queue in pairs, producers wait for room (queue engine, default unbounded)", false},
+        {'f', "FORMAT", "distance file format: pairs (default) or compact (varint rows of the pair ratios)", false},
+        {'r', "", "resume an interrupted run: reuse the checkpointed chunks (-k) or the tiles of the manifest (-l)", false}
     };
 
-    std::string optstring = "i:j:o:p:c:";
+    std::string optstring = "i:j:l:o:p:c:e:m:k:q:f:r";
     std::string program_desc = "Calculate distances between primary clusters.";
 
     OptionParser dist_parser(options, optstring, program_desc);
     auto parsed_options = dist_parser.parse(argc, argv);
 
-    std::string inputFileA = parsed_options["i"];
-    std::string inputFileB = parsed_options["j"];
     std::string outputFile = parsed_options["o"];
     int producers = std::stoi(parsed_options["p"]);
     int consumers = std::stoi(parsed_options["c"]);
+    DistanceEngine engine = parse_distance_engine(parsed_options.count("e") ? parsed_options["e"] : "queue");
+    DistanceFormat format = parse_distance_format(parsed_options.count("f") ? parsed_options["f"] : "pairs");
 
     if (consumers < 2) {
         std::cerr << "Number of consumers should be greater than 1.\n";
         return;
     }
 
-    calculate_distance_matrix(inputFileA, inputFileB, outputFile, producers, consumers);
+    bool resume = parsed_options.count("r") > 0;
+    uint64_t queueCapacity = parsed_options.count("q") ? std::stoull(parsed_options["q"]) : 0;
+
+    if (parsed_options.count("l")) {
+        if (parsed_options.count("i") || parsed_options.count("j")) {
+            std::cerr << "Option -l replaces -i and -j.\n";
+            return;
+        }
+        uint64_t memoryMB = parsed_options.count("m") ? std::stoull(parsed_options["m"]) : 4096;
+        calculate_distance_matrix(parsed_options["l"], outputFile, producers, consumers, engine, memoryMB << 20, resume, queueCapacity, format);
+        return;
+    }
+
+    if (!parsed_options.count("i") || !parsed_options.count("j")) {
+        std::cerr << "Input files -i and -j (or a list -l) are required.\n";
+        return;
+    }
+    int checkpoints = parsed_options.count("k") ? std::stoi(parsed_options["k"]) : 0;
+    if (resume && checkpoints == 0) {
+        std::cerr << "Option -r needs the checkpoints (-k) of the interrupted run.\n";
+        return;
+    }
+    calculate_block_distance(parsed_options["i"], parsed_options["j"], outputFile, producers, consumers, engine,
+                             checkpoints, resume, queueCapacity, format);
 }
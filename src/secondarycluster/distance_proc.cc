@@ -1,37 +1,103 @@
 #include <map>
 #include <pthread.h>
 #include <math.h>
+#include <cmath>
 #include <cstdint>
 #include <fstream>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
 
 
 #include <dpcstruct/secondarycluster/distance_proc.h>
+#include <dpcstruct/secondarycluster/pair_matching.h>
 #include <dpcstruct/fileparser/PCsFileParser.h>
 #include <dpcstruct/distance.h>
 #include <moodycamel/concurrentqueue.h>
 
 using namespace moodycamel;
 
-typedef std::map<uint32_t, std::map<uint32_t, Ratio> >  map2_t;
-
 #define LOCAL_BUFFER_SIZE 10000 // Buffer size for each producer
+#define BALANCE_SAMPLE_RECORDS 32768 // Records of A in the sID groups sampled to balance the consumers
+
+
+// Splits the qIDs into `numConsumers` ranges with about the same number of pairs. The candidate
+// pairs of a sampled sID group are |A_s| x |B_s|, each one owned by the smaller of its two qIDs: the
+// split points are the quantiles of that empirical distribution. Without candidates, the split
+// falls back to the analytic partition of the sIDs.
+void balanced_partition(std::vector<uint64_t>& partitionArray, const SmallPC* bufferA, uint64_t totalLinesA,
+                        const SmallPC* bufferB, uint64_t totalLinesB, int numConsumers) {
+    // Sampled sID groups, evenly spread over A
+    uint64_t numGroups = 0;
+    for (uint64_t i = 0; i < totalLinesA; ++i) {
+        if (i == 0 || bufferA[i].sID != bufferA[i - 1].sID) ++numGroups;
+    }
+    uint64_t sampleGroups = std::max<uint64_t>(1, numGroups * BALANCE_SAMPLE_RECORDS / std::max<uint64_t>(1, totalLinesA));
+    uint64_t stride = std::max<uint64_t>(1, numGroups / sampleGroups);
+
+    // (qID, pairs it owns) of the sampled groups
+    std::vector<std::pair<uint32_t, uint64_t>> weights;
+    std::vector<uint32_t> qIDsA, qIDsB;
+    uint64_t group = 0, posB = 0;
+    for (uint64_t beginA = 0, endA; beginA < totalLinesA; beginA = endA, ++group) {
+        uint32_t sID = bufferA[beginA].sID;
+        for (endA = beginA + 1; endA < totalLinesA && bufferA[endA].sID == sID; ++endA) {}
+        if (group % stride != 0) continue;
+
+        while (posB < totalLinesB && bufferB[posB].sID < sID) ++posB;
+        uint64_t beginB = posB;
+        while (posB < totalLinesB && bufferB[posB].sID == sID) ++posB;
+        if (beginB == posB) continue;
+
+        qIDsA.clear();
+        qIDsB.clear();
+        for (uint64_t i = beginA; i < endA; ++i) qIDsA.push_back(bufferA[i].qID);
+        for (uint64_t i = beginB; i < posB; ++i) qIDsB.push_back(bufferB[i].qID);
+        std::sort(qIDsA.begin(), qIDsA.end());
+        std::sort(qIDsB.begin(), qIDsB.end());
+
+        // A record owns its pairs with the larger qIDs of the other side
+        for (uint32_t qID : qIDsA) {
+            uint64_t larger = qIDsB.end() - std::upper_bound(qIDsB.begin(), qIDsB.end(), qID);
+            if (larger > 0) weights.emplace_back(qID, larger);
+        }
+        for (uint32_t qID : qIDsB) {
+            uint64_t larger = qIDsA.end() - std::upper_bound(qIDsA.begin(), qIDsA.end(), qID);
+            if (larger > 0) weights.emplace_back(qID, larger);
+        }
+    }
 
+    uint64_t totalWeight = 0;
+    for (const auto& w : weights) totalWeight += w.second;
 
-void balanced_partition(std::vector<uint64_t>& partitionArray, SmallPC* buffer, uint64_t totalLines, int numConsumers) {
-    // Find the maximum searchID in the buffer
-    uint64_t maxSearchID = 0;
-    for (uint64_t i = 0; i < totalLines; ++i) {
-        if (buffer[i].sID > maxSearchID) {
-            maxSearchID = buffer[i].sID;
+    if (totalWeight == 0) {
+        // Find the maximum searchID in the buffer
+        uint64_t maxSearchID = 0;
+        for (uint64_t i = 0; i < totalLinesA; ++i) {
+            if (bufferA[i].sID > maxSearchID) {
+                maxSearchID = bufferA[i].sID;
+            }
+        }
+
+        // Calculate the balanced partitions based on maxSearchID
+        for (int i = 1; i < numConsumers; ++i) {
+            partitionArray[i - 1] = maxSearchID * (1 - sqrt(1 - i * ((maxSearchID - 1.0) / (maxSearchID * numConsumers))));
         }
+        return;
     }
 
-    // Calculate the balanced partitions based on maxSearchID
+    // Consumer i owns the qIDs in [partitionArray[i-1], partitionArray[i])
+    std::sort(weights.begin(), weights.end());
+    uint64_t cumulative = 0;
+    size_t w = 0;
     for (int i = 1; i < numConsumers; ++i) {
-        partitionArray[i - 1] = maxSearchID * (1 - sqrt(1 - i * ((maxSearchID - 1.0) / (maxSearchID * numConsumers))));
+        uint64_t target = totalWeight * i / numConsumers;
+        while (w < weights.size() && cumulative + weights[w].second <= target) {
+            cumulative += weights[w++].second;
+        }
+        partitionArray[i - 1] = (w < weights.size()) ? weights[w].first + 1ULL : weights.back().first + 1ULL;
+        if (i > 1) partitionArray[i - 1] = std::max(partitionArray[i - 1], partitionArray[i - 2]);
     }
-
-    return;
 }
 
 void files_partition(std::vector<std::array<uint64_t, 2>>& partIndices, 
@@ -39,7 +105,8 @@ void files_partition(std::vector<std::array<uint64_t, 2>>& partIndices,
                      SmallPC* bufferB, 
                      uint64_t totalLinesA, 
                      uint64_t totalLinesB, 
-                     int numProducers) {
+                     int numProducers,
+                     const std::vector<uint64_t>& shardOffsetsA) {
 
     // Index 0: bufferA and Index 1: bufferB
     SmallPC * alignment[2] = {bufferA, bufferB};
@@ -59,126 +126,166 @@ void files_partition(std::vector<std::array<uint64_t, 2>>& partIndices,
         }
     }
 
+    // A sharded file already starts a new sID at each shard: move the bounds to the closest shard
+    if (shardOffsetsA.size() > 2) {
+        for (int i = 1; i < numProducers; ++i)
+        {
+            auto next = std::lower_bound(shardOffsetsA.begin(), shardOffsetsA.end(), partIndices[i][0]);
+            uint64_t bound = *next;
+            if (next != shardOffsetsA.begin() && partIndices[i][0] - *(next - 1) < *next - partIndices[i][0]) {
+                bound = *(next - 1);
+            }
+            partIndices[i][0] = std::max(bound, partIndices[i-1][0]);
+        }
+    }
+
     // shift to match sID
     for (uint32_t i = 1; i <  numProducers; ++i)
     {
+        if (partIndices[i][0] >= totalLinesA) {
+            partIndices[i][0] = totalLinesA;
+            partIndices[i][1] = totalLinesB;
+            continue;
+        }
+
         // we use bufferA for picking the reference sID
         auto sValue = (alignment[0] + partIndices[i][0])->sID;
         
-        for (uint32_t f = 0; f < 2; ++f)
-        {
-            auto start = std::lower_bound(alignment[f] + partIndices[i-1][f], alignment[f] + partIndices[i+1][f], sValue, compare_sID<SmallPC>());
-            partIndices[i][f] -= (alignment[f] + partIndices[i][f]) - start; 
-        }
-        
+        auto startA = std::lower_bound(alignment[0] + partIndices[i-1][0], alignment[0] + partIndices[i][0], sValue, compare_sID<SmallPC>());
+        partIndices[i][0] = startA - alignment[0];
+
+        auto startB = std::lower_bound(alignment[1] + partIndices[i-1][1], alignment[1] + totalLinesB, sValue, compare_sID<SmallPC>());
+        partIndices[i][1] = startB - alignment[1];
     }
 
     return;
 }
 
+// Splits the pA x pB product into tasks of similar cost. Consecutive sID groups are packed into
+// a tile up to the cost bound, and a group above it is cut into a grid of sub-tiles, so a hot sID
+// is shared by all the producers. The tiles are ordered by decreasing cost.
+// When A and B are the same buffer the tiles are self joins: a group costs |A_s| (|A_s| - 1) / 2
+// and an oversized one keeps the upper triangle of its grid, with self joins on the diagonal.
+std::vector<PairTile> pair_tiles(const SmallPC* bufferA, const SmallPC* bufferB, uint64_t totalLinesA, uint64_t totalLinesB,
+                                 int numProducers) {
+    bool selfJoin = bufferA == bufferB && totalLinesA == totalLinesB;
+
+    // Visits the sID groups of A as (beginA, endA, beginB, endB)
+    auto for_each_group = [&](auto&& visit) {
+        uint64_t posB = 0;
+        for (uint64_t beginA = 0, endA; beginA < totalLinesA; beginA = endA) {
+            uint32_t sID = bufferA[beginA].sID;
+            for (endA = beginA + 1; endA < totalLinesA && bufferA[endA].sID == sID; ++endA) {}
+            while (posB < totalLinesB && bufferB[posB].sID < sID) ++posB;
+            uint64_t beginB = posB;
+            while (posB < totalLinesB && bufferB[posB].sID == sID) ++posB;
+            visit(beginA, endA, beginB, posB);
+        }
+    };
+    auto group_cost = [selfJoin](uint64_t linesA, uint64_t linesB) {
+        return selfJoin ? linesA * (linesA - 1) / 2 : linesA * linesB;
+    };
+
+    uint64_t totalCost = 0;
+    for_each_group([&](uint64_t beginA, uint64_t endA, uint64_t beginB, uint64_t endB) {
+        totalCost += group_cost(endA - beginA, endB - beginB);
+    });
+    uint64_t maxCost = std::max<uint64_t>(PAIR_TILE_MIN_COST, totalCost / (numProducers * PAIR_TILES_PER_PRODUCER));
+
+    std::vector<PairTile> tiles;
+    PairTile current{0, 0, 0, 0, 0, selfJoin};
+    for_each_group([&](uint64_t beginA, uint64_t endA, uint64_t beginB, uint64_t endB) {
+        uint64_t linesA = endA - beginA, linesB = endB - beginB;
+        uint64_t cost = group_cost(linesA, linesB);
+
+        if (cost > maxCost || current.cost + cost > maxCost) {
+            if (current.cost > 0) tiles.push_back(current);
+            current = PairTile{beginA, beginA, beginB, beginB, 0, selfJoin};
+        }
+
+        if (cost > maxCost) {
+            uint64_t splitA, splitB;
+            if (selfJoin) {
+                splitA = splitB = std::min<uint64_t>(linesA, std::ceil(linesA / std::sqrt(maxCost)));
+            } else {
+                splitA = std::min(linesA, (cost + maxCost - 1) / maxCost);
+                splitB = std::min(linesB, (cost + splitA * maxCost - 1) / (splitA * maxCost));
+            }
+
+            for (uint64_t i = 0; i < splitA; ++i) {
+                for (uint64_t j = selfJoin ? i : 0; j < splitB; ++j) {
+                    PairTile tile{beginA + linesA * i / splitA, beginA + linesA * (i + 1) / splitA,
+                                  beginB + linesB * j / splitB, beginB + linesB * (j + 1) / splitB, 0, selfJoin && i == j};
+                    tile.cost = tile.selfJoin ? group_cost(tile.endA - tile.beginA, 0)
+                                              : (tile.endA - tile.beginA) * (tile.endB - tile.beginB);
+                    tiles.push_back(tile);
+                }
+            }
+            current = PairTile{endA, endA, endB, endB, 0, selfJoin};
+            return;
+        }
+
+        current.endA = endA;
+        current.endB = endB;
+        current.cost += cost;
+    });
+    if (current.cost > 0) tiles.push_back(current);
+
+    // Largest tasks first, so that the last ones to finish are short
+    std::stable_sort(tiles.begin(), tiles.end(), [](const PairTile& x, const PairTile& y) { return x.cost > y.cost; });
+    return tiles;
+}
+
 
 void *producer(void *td) 
 {
 
     ThreadData* threadData = static_cast<ThreadData*>(td);
 
-    // Define own rank
-    threadData->rankMutex.lock();
-    int rank = threadData->producerRankCount;
-    ++threadData->producerRankCount;
-    threadData->rankMutex.unlock();
-
-    uint64_t linesA = threadData->partIndices[rank+1][0] - threadData->partIndices[rank][0];
-    uint64_t linesB = threadData->partIndices[rank+1][1] - threadData->partIndices[rank][1];
-
-    // define internal buffers
+    // define internal buffers, and the tokens of this producer in each queue
     uint64_t localBufferSize {LOCAL_BUFFER_SIZE}; 
     uint64_t localBufferIndex[threadData->numConsumers] = {0};
     MatchedPair **localBuffer = new MatchedPair* [threadData->numConsumers];
+    std::vector<ProducerToken> tokens;
+    tokens.reserve(threadData->numConsumers);
     for(uint32_t i = 0; i < threadData->numConsumers; ++i) 
     {
-        localBuffer[i] = new MatchedPair[LOCAL_BUFFER_SIZE]{};
+        localBuffer[i] = new MatchedPair[LOCAL_BUFFER_SIZE];
+        tokens.emplace_back(threadData->queues[i]);
     }
-   
-    // pointer to correspondant partition of buffers
-    SmallPC * alA = (SmallPC *) threadData->bufferA + threadData->partIndices[rank][0];  
-    SmallPC * alB = (SmallPC *) threadData->bufferB + threadData->partIndices[rank][1];
-    
-    
-    uint64_t posA{0}, posB{0};
-    uint32_t s0{0};
-
-    while(posA < linesA && posB < linesB) {
-        while(posB < linesB && alB->sID < alA->sID) {
-            ++alB;
-            ++posB;
-        }
-        while(posA < linesA && alB->sID > alA->sID) {
-            ++alA;
-            ++posA;
-        }
-
-        if(alB->sID == alA->sID) {
-            s0 = alA->sID;
-            const SmallPC * init_subA = alA;
-            const SmallPC * init_subB = alB;
-            
-            while(posA < linesA && alA->sID == s0 ) {
-                ++alA;
-                ++posA;
-            }
 
-            while(posB<linesB && alB->sID == s0 ) {
-                ++alB;
-                ++posB;
-            }            
-            
-            //compute distances on selected alignments with the same sID
-            for (auto pA = init_subA; pA < alA; ++pA) {
-                for (auto pB = init_subB; pB < alB; ++pB) {   
-
-                    // check if match
-                    if( distance(pA,pB) <= 0.2 ) 
-                    {
-
-                        auto qID1 = std::min(pA->qID, pB->qID);
-                        auto qID2 = std::max(pA->qID, pB->qID);
-                        auto norm = std::min(pA->qSize, pB->qSize);
-                        // auto norm = 1.;
-                
-                        if (qID1 == qID2) continue;
-
-                        auto pair = MatchedPair( qID1, qID2, threadData->countFactor*norm );
-            
-                        // decide to which queue the pair goes
-                        int tidx = threadData->numConsumers - 1;
-                        for (int i = 0; i < threadData->numConsumers - 1; ++i) {
-                            if (qID1 < threadData->qIDs_partition[i]) {
-                                tidx = i;
-                                break;
-                            }
-                        }
-                        
-                        localBuffer[tidx][localBufferIndex[tidx]] = pair;
-                        ++localBufferIndex[tidx];
-                        if (localBufferIndex[tidx] >= localBufferSize) {
-                            threadData->queues[tidx].enqueue_bulk(localBuffer[tidx], localBufferSize);
-                            localBufferIndex[tidx] = 0;
-                        }
-                        
-                    }                    
-                }
-            }            
-        }   
+    // enqueue the pairs buffered for a consumer, waiting for room in a bounded queue
+    auto flush = [&](int tidx) {
+        uint64_t count = localBufferIndex[tidx];
+        if (count == 0) return;
+
+        threadData->gates[tidx].reserve(count, threadData->queueCapacity);
+        threadData->queues[tidx].enqueue_bulk(tokens[tidx], localBuffer[tidx], count);
+        threadData->gates[tidx].notify();
+        localBufferIndex[tidx] = 0;
+    };
+
+    auto emit = [&](const MatchedPair& pair) {
+        // decide to which queue the pair goes
+        int tidx = threadData->router(pair.ID1);
+
+        localBuffer[tidx][localBufferIndex[tidx]] = pair;
+        ++localBufferIndex[tidx];
+        if (localBufferIndex[tidx] >= localBufferSize) flush(tidx);
+    };
+
+    // take tiles from the shared pool until it is empty
+    const SmallPC* bufferA = reinterpret_cast<const SmallPC*>(threadData->bufferA);
+    const SmallPC* bufferB = reinterpret_cast<const SmallPC*>(threadData->bufferB);
+    uint64_t t;
+    while ((t = threadData->nextTile.fetch_add(1)) < threadData->tiles.size()) {
+        for_each_tile_pair(bufferA, bufferB, threadData->tiles[t], threadData->countFactor, emit);
     }
 
-    // Fill remaining local buffer with zero elements (MatchedPair())
+    // Enqueue the exact remainder of each local buffer, then signal the end of the stream
     for (int i = 0; i < threadData->numConsumers; ++i) {
-        for (int j = localBufferIndex[i]; j < localBufferSize; ++j) {
-            localBuffer[i][j] = MatchedPair();
-        }
-        // Enqueue the last local buffer
-        threadData->queues[i].enqueue_bulk(localBuffer[i], localBufferSize);
+        flush(i);
+        threadData->gates[i].finish();
     }
 
     // Clean up local buffer
@@ -187,7 +294,6 @@ void *producer(void *td)
     }
     delete[] localBuffer;
     
-    threadData->doneProducers.fetch_add(1, std::memory_order_release);
     pthread_exit(NULL);
 }
 
@@ -205,32 +311,41 @@ void *consumer(void *td)
     ConcurrentQueue<MatchedPair>* queue = &(threadData->queues[rank]);
 
     // Allocate local buffer for dequeued items
-    MatchedPair* pairs = new MatchedPair[LOCAL_BUFFER_SIZE]();
-    std::pair<std::map<uint32_t, Ratio>::iterator, bool> ret;
-
-    bool itemsLeft;
-    do {
-        // Fence to check if producers are still active
-        itemsLeft = threadData->doneProducers.load(std::memory_order_acquire) != threadData->numProducers;
-        while (queue->try_dequeue_bulk(pairs, LOCAL_BUFFER_SIZE)) 
+    MatchedPair* pairs = new MatchedPair[LOCAL_BUFFER_SIZE];
+    PairAccumulator& accumulator = threadData->accumulators[rank];
+
+    QueueGate& gate = threadData->gates[rank];
+    ConsumerToken token(*queue);
+    while (true) {
+        // The state is read before the queue: a later enqueue or end of stream changes the version
+        uint32_t version = gate.version.load(std::memory_order_acquire);
+        bool producersDone = gate.finished.load(std::memory_order_acquire) == threadData->numProducers;
+
+        size_t count = queue->try_dequeue_bulk(token, pairs, LOCAL_BUFFER_SIZE);
+        if (count == 0) {
+            if (producersDone) break;
+
+            // Block until a producer enqueues or ends its stream, instead of spinning
+            gate.version.wait(version, std::memory_order_acquire);
+            continue;
+        }
+        gate.release(count);
+
+        // Consume dequeued data
+        for (size_t i = 0; i < count; ++i)
         {
-            itemsLeft = true;
-            // Consume dequeued data
-            for (int i = 0; i < LOCAL_BUFFER_SIZE; ++i)
-            {
-                Ratio countNorm(1, pairs[i].normFactor);
-
-                ret = threadData->vec_maps[rank][pairs[i].ID1].insert(std::make_pair(pairs[i].ID2, countNorm));
-                if (ret.second == false)
-                {
-                    ret.first->second.num += 1;
-                }
-            }
+            accumulator.add(pairs[i].ID1, pairs[i].ID2, pairs[i].normFactor);
         }
-    } while (itemsLeft);
+    }
 
     // Clean up allocated memory
     delete[] pairs;
+
+    // The range is written while the other consumers still count
+    if (threadData->writer) {
+        auto counts = accumulator.sorted();
+        threadData->writer->submit(rank, counts);
+    }
     
     // Terminate thread
     pthread_exit(NULL);
@@ -239,11 +354,254 @@ void *consumer(void *td)
 
 
 
+std::vector<std::vector<PairCount>> queue_pair_counts(ThreadData& threadData) {
+    int numProducers = threadData.numProducers;
+    int numConsumers = threadData.numConsumers;
+
+    // Create producer threads
+    std::vector<pthread_t> producerThreads(numProducers);
+    for (int i = 0; i < numProducers; ++i) {
+        pthread_create(&producerThreads[i], nullptr, producer,(void*)&threadData);
+    }
+    
+    pthread_t consumerThreads[numConsumers];
+    for (int i = 0; i < numConsumers; ++i) {
+        pthread_create(&consumerThreads[i], NULL, consumer, (void*)&threadData);
+    }
+
+    // /* Producer-consumer running */
+
+    // // Join producer threads
+    for (int i = 0; i < numProducers; ++i) {
+        pthread_join(producerThreads[i], nullptr);
+    }
+
+    // Join consumer threads
+    for (int i = 0; i < numConsumers; ++i) {
+        pthread_join(consumerThreads[i], nullptr);
+    }
+
+    std::vector<std::vector<PairCount>> pairCounts(numConsumers);
+    if (threadData.writer) return pairCounts;
+    for (int tidx = 0; tidx < numConsumers; ++tidx) {
+        pairCounts[tidx] = threadData.accumulators[tidx].sorted();
+    }
+    return pairCounts;
+}
+
+
+std::vector<std::vector<PairCount>> count_block_pairs(SmallPC* pcsBufferA, uint64_t totalLinesA, SmallPC* pcsBufferB, uint64_t totalLinesB,
+                                                      const std::vector<uint64_t>& shardOffsetsA,
+                                                      int numProducers, int numConsumers, DistanceEngine engine,
+                                                      uint64_t queueCapacity, DistanceWriter* writer) {
+    // Data for threads
+    ThreadData threadData(numProducers, numConsumers);  // Constructor handles initialization
+    threadData.queueCapacity = queueCapacity;
+    threadData.writer = writer;
+    threadData.bufferA = reinterpret_cast<char*>(pcsBufferA);
+    threadData.bufferB = reinterpret_cast<char*>(pcsBufferB);
+    threadData.totalLinesA = totalLinesA;
+    threadData.totalLinesB = totalLinesB;
+
+    // Define qIDs balanced partition per thread, from the pairs of sampled sID groups
+    balanced_partition(threadData.qIDs_partition, pcsBufferA, totalLinesA, pcsBufferB, totalLinesB, numConsumers);
+    threadData.router = ConsumerRouter(threadData.qIDs_partition);
+
+    // Partition files
+    files_partition(threadData.partIndices, pcsBufferA, pcsBufferB, totalLinesA, totalLinesB, numProducers, shardOffsetsA);
+    threadData.tiles = pair_tiles(pcsBufferA, pcsBufferB, totalLinesA, totalLinesB, numProducers);
+
+    // Pair counts of each qID range, sorted by (ID1, ID2)
+    if (engine == DistanceEngine::MapReduce) {
+        return mapreduce_pair_counts(threadData);
+    } else if (engine == DistanceEngine::SpGEMM) {
+        return spgemm_pair_counts(threadData);
+    }
+    return queue_pair_counts(threadData);
+}
+
+
+// Writes `bytes` at `offset`, across short writes
+static bool pwrite_all(int fd, const void* buffer, size_t bytes, off_t offset) {
+    const char* data = static_cast<const char*>(buffer);
+    while (bytes > 0) {
+        ssize_t n = pwrite(fd, data, bytes, offset);
+        if (n <= 0) return false;
+        data += n;
+        bytes -= n;
+        offset += n;
+    }
+    return true;
+}
+
+DistanceWriter::DistanceWriter(const std::string& outputFile, size_t numPartitions, DistanceFormat format)
+    : outputFile(outputFile), format(format), partitions(numPartitions), nextPlaced(0),
+      offset(format == DistanceFormat::Compact ? sizeof(CompactDistanceHeader) : 0), pairs(0), rows(0),
+      previousID1(0), failed(false), closed(false) {
+    // PRINT MAP
+    std::cout << "Writing to " << outputFile << " (" << distance_format_name(format) << ")... " << std::endl;
+
+    // The index of a previous file is stale until the new one is written
+    unlink(distance_index_path(outputFile).c_str());
+    fd = open(outputFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open output file: " + outputFile);
+    }
+}
+
+DistanceWriter::~DistanceWriter() {
+    if (!closed) ::close(fd);
+}
+
+void DistanceWriter::submit(size_t p, std::vector<PairCount>& counts) {
+    // Serialized with its rows, positioned wrt the partition
+    Partition partition;
+    partition.submitted = true;
+    partition.pairs = counts.size();
+    for (uint64_t i = 0; i < counts.size(); ++i) {
+        if (i > 0 && counts[i].ID1 == counts[i - 1].ID1) continue;
+        partition.rowIDs.push_back(counts[i].ID1);
+        if (format == DistanceFormat::Pairs) partition.rowStarts.push_back(i);
+    }
+    if (format == DistanceFormat::Pairs) {
+        partition.distances.resize(counts.size());
+        for (uint64_t i = 0; i < counts.size(); ++i) {
+            partition.distances[i] = {counts[i].ID1, counts[i].ID2, 1.0 - counts[i].ratio.as_double()};
+        }
+    } else if (!counts.empty()) {
+        // The ID1 delta of the first row depends on the previous partition
+        uint64_t firstRowEnd = 1;
+        while (firstRowEnd < counts.size() && counts[firstRowEnd].ID1 == counts[0].ID1) ++firstRowEnd;
+        partition.firstRow.assign(counts.begin(), counts.begin() + firstRowEnd);
+        partition.rowStarts.push_back(0);
+        encode_distance_rows(counts.data() + firstRowEnd, counts.size() - firstRowEnd, counts[0].ID1,
+                             partition.encoded, &partition.rowStarts);
+    }
+    std::vector<PairCount>().swap(counts);
+
+    std::vector<size_t> placed;
+    {
+        std::lock_guard<std::mutex> lock(placeMutex);
+        partitions[p] = std::move(partition);
+        placed = place_submitted();
+    }
+    for (size_t q : placed) {
+        write_partition(partitions[q]);
+    }
+}
+
+std::vector<size_t> DistanceWriter::place_submitted() {
+    std::vector<size_t> placed;
+    for (; nextPlaced < partitions.size() && partitions[nextPlaced].submitted; ++nextPlaced) {
+        Partition& partition = partitions[nextPlaced];
+        partition.fileOffset = offset;
+        indexIDs.insert(indexIDs.end(), partition.rowIDs.begin(), partition.rowIDs.end());
+        if (format == DistanceFormat::Pairs) {
+            for (uint64_t start : partition.rowStarts) rowPtr.push_back(pairs + start);
+            offset += partition.pairs * sizeof(NormalizedPair);
+        } else if (partition.pairs > 0) {
+            // Row pointers count the bytes after the header
+            rows += encode_distance_rows(partition.firstRow.data(), partition.firstRow.size(), previousID1, partition.head);
+            rows += partition.rowIDs.size() - 1;
+            uint64_t start = offset - sizeof(CompactDistanceHeader);
+            rowPtr.push_back(start);
+            for (size_t r = 1; r < partition.rowStarts.size(); ++r) {
+                rowPtr.push_back(start + partition.head.size() + partition.rowStarts[r]);
+            }
+            offset += partition.head.size() + partition.encoded.size();
+        }
+        if (partition.pairs > 0) previousID1 = partition.rowIDs.back();
+        pairs += partition.pairs;
+        placed.push_back(nextPlaced);
+    }
+    return placed;
+}
+
+void DistanceWriter::write_partition(Partition& partition) {
+    bool written;
+    if (format == DistanceFormat::Pairs) {
+        written = pwrite_all(fd, partition.distances.data(), partition.distances.size() * sizeof(NormalizedPair),
+                             partition.fileOffset);
+    } else {
+        written = pwrite_all(fd, partition.head.data(), partition.head.size(), partition.fileOffset) &&
+                  pwrite_all(fd, partition.encoded.data(), partition.encoded.size(), partition.fileOffset + partition.head.size());
+    }
+    if (!written) failed = true;
+
+    std::vector<NormalizedPair>().swap(partition.distances);
+    std::vector<uint8_t>().swap(partition.head);
+    std::vector<uint8_t>().swap(partition.encoded);
+}
+
+uint64_t DistanceWriter::close() {
+    closed = true;
+    if (nextPlaced != partitions.size()) failed = true;
+
+    // The header goes last, so an interrupted write is not a valid file
+    uint64_t encodedBytes = offset - sizeof(CompactDistanceHeader);
+    if (format == DistanceFormat::Compact && !failed) {
+        CompactDistanceHeader header = compact_distance_header(pairs, rows, encodedBytes);
+        failed = !pwrite_all(fd, &header, sizeof(header), 0);
+    }
+
+    // Close the output file
+    if (::close(fd) != 0 || failed) {
+        throw std::runtime_error("Failed to write output file: " + outputFile);
+    }
+
+    // Index of the distinct ID1s, the last pointer being the end of the data
+    rowPtr.push_back(format == DistanceFormat::Pairs ? pairs : encodedBytes);
+    write_distance_index(distance_index_path(outputFile), format, indexIDs, rowPtr);
+    std::cout << "Done writing " << outputFile << std::endl;
+
+    return pairs;
+}
+
+uint64_t write_distances(std::vector<std::vector<PairCount>>& pairCounts, const std::string& outputFile, int numThreads,
+                         DistanceFormat format) {
+    DistanceWriter writer(outputFile, pairCounts.size(), format);
+
+    std::atomic<size_t> nextPartition{0};
+    auto worker = [&]() {
+        for (size_t p = nextPartition++; p < pairCounts.size(); p = nextPartition++) {
+            writer.submit(p, pairCounts[p]);
+        }
+    };
+    std::vector<std::thread> workers;
+    numThreads = std::max<int>(1, std::min<size_t>(numThreads, pairCounts.size()));
+    for (int t = 1; t < numThreads; ++t) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers) {
+        thread.join();
+    }
+
+    return writer.close();
+}
+
+
+uint64_t compute_block_distance(SmallPC* pcsBufferA, uint64_t totalLinesA, SmallPC* pcsBufferB, uint64_t totalLinesB,
+                                const std::vector<uint64_t>& shardOffsetsA, const std::string& outputFile,
+                                int numProducers, int numConsumers, DistanceEngine engine, uint64_t queueCapacity,
+                                DistanceFormat format) {
+    DistanceWriter writer(outputFile, numConsumers, format);
+    count_block_pairs(pcsBufferA, totalLinesA, pcsBufferB, totalLinesB, shardOffsetsA, numProducers, numConsumers, engine,
+                      queueCapacity, &writer);
+    return writer.close();
+}
+
+
 void calculate_block_distance(const std::string& inputFileA, 
                         const std::string& inputFileB,
                         const std::string& outputFile,
                         int numProducers,
-                        int numConsumers) {  
+                        int numConsumers,
+                        DistanceEngine engine,
+                        int numCheckpoints,
+                        bool resume,
+                        uint64_t queueCapacity,
+                        DistanceFormat format) {  
 
     try {
 
@@ -253,111 +611,70 @@ void calculate_block_distance(const std::string& inputFileA,
         std::cout << "Output file: " << outputFile << std::endl;
         std::cout << "Producers: " << numProducers << std::endl;
         std::cout << "Consumers: " << numConsumers << std::endl;
+        std::cout << "Engine: " << distance_engine_name(engine) << std::endl;
+        std::cout << "Format: " << distance_format_name(format) << std::endl;
+        if (queueCapacity > 0 && engine == DistanceEngine::Queue) {
+            std::cout << "Queue capacity: " << queueCapacity << " pairs" << std::endl;
+        }
+        if (numCheckpoints > 0) {
+            std::cout << "Checkpoints: " << numCheckpoints << " in " << checkpoint_dir(outputFile)
+                      << (resume ? " (resuming)" : "") << std::endl;
+        }
+        if (inputFileA == inputFileB) {
+            std::cout << "Self join: upper triangle only" << std::endl;
+        }
 
-        // Open both files containing clustered alignments
+        // Open both files containing clustered alignments. A self join loads the file once,
+        // and only visits each unordered pair of records once.
+        bool selfJoin = inputFileA == inputFileB;
         PCsFileParser loaderA(inputFileA);
         PCsFileParser loaderB(inputFileB);
 
         // Load the primary clusters
         loaderA.loadPCs();
-        loaderB.loadPCs();
+        if (!selfJoin) loaderB.loadPCs();
 
         // Access the loaded data
         SmallPC* pcsBufferA = loaderA.getData();
-        SmallPC* pcsBufferB = loaderB.getData();
+        SmallPC* pcsBufferB = selfJoin ? pcsBufferA : loaderB.getData();
         uint64_t totalLinesA = loaderA.getTotalLines();
-        uint64_t totalLinesB = loaderB.getTotalLines();
+        uint64_t totalLinesB = selfJoin ? totalLinesA : loaderB.getTotalLines();
 
         // Now pcsBufferA and pcsBufferB point to the loaded data
         std::cout << "Total lines from file A: " << totalLinesA << std::endl;
         std::cout << "Total lines from file B: " << totalLinesB << std::endl;
-
-        // Data for threads
-        ThreadData threadData(numProducers, numConsumers);  // Constructor handles initialization
-        threadData.bufferA = reinterpret_cast<char*>(pcsBufferA);
-        threadData.bufferB = reinterpret_cast<char*>(pcsBufferB);
-        threadData.totalLinesA = totalLinesA;
-        threadData.totalLinesB = totalLinesB;
-
-        // if filenames are the same, countFactor is 2
-        if (inputFileA == inputFileB) {
-            threadData.countFactor = 2.0;
-        }
-
-        // Define qIDs balanced partition per thread (based on only one file)
-        balanced_partition(threadData.qIDs_partition, pcsBufferA, totalLinesA, numConsumers);
-
-        // Partition files
-        std::vector<std::array<uint64_t, 2>> partIndices(numProducers + 1);
-        files_partition(threadData.partIndices, pcsBufferA, pcsBufferB, totalLinesA, totalLinesB, numProducers);
-
-        // Create producer threads
-        std::vector<pthread_t> producerThreads(numProducers);
-        for (int i = 0; i < numProducers; ++i) {
-            pthread_create(&producerThreads[i], nullptr, producer,(void*)&threadData);
-        }
-        
-        pthread_t consumerThreads[numConsumers];
-        for (int i = 0; i < numConsumers; ++i) {
-            pthread_create(&consumerThreads[i], NULL, consumer, (void*)&threadData);
-        }
-
-        // /* Producer-consumer running */
-
-        // // Join producer threads
-        for (int i = 0; i < numProducers; ++i) {
-            pthread_join(producerThreads[i], nullptr);
-        }
-
-        // Join consumer threads
-        for (int i = 0; i < numConsumers; ++i) {
-            pthread_join(consumerThreads[i], nullptr);
+        if (loaderA.getShardOffsets().size() > 2) {
+            std::cout << "Shards from file A: " << loaderA.getShardOffsets().size() - 1 << std::endl;
         }
 
-        // PRINT MAP
-        std::cout << "Writing to " << outputFile << "... ";
-        std::fstream outfile(outputFile, std::ios::out | std::ios::binary);
-        NormalizedPair outLine;
-
-        for (int tidx = 0; tidx < threadData.numConsumers; ++tidx)
-        {
-            for (auto itr_out = threadData.vec_maps[tidx].cbegin(); itr_out != threadData.vec_maps[tidx].cend(); ++itr_out) 
-            { 
-                if (itr_out->first == 0) continue;  // Skip entries with key == 0
-
-                for (auto itr_in = itr_out->second.cbegin(); itr_in != itr_out->second.cend(); ++itr_in)
-                {        
-                    auto distance = 1.0 - itr_in->second.as_double();
-                    outLine.ID1 = itr_out->first; 
-                    outLine.ID2 = itr_in->first;
-                    outLine.distance = distance;
-
-                    outfile.write((char*)&outLine, sizeof(NormalizedPair));  // Write to binary output file
-                }   
-            } 
+        if (numCheckpoints > 0) {
+            auto pairCounts = checkpointed_pair_counts(pcsBufferA, totalLinesA, pcsBufferB, totalLinesB, inputFileA,
+                                                       inputFileB, outputFile, numProducers, numConsumers, engine,
+                                                       numCheckpoints, resume, queueCapacity);
+            write_distances(pairCounts, outputFile, numConsumers, format);
+            remove_checkpoints(outputFile);
+        } else {
+            compute_block_distance(pcsBufferA, totalLinesA, pcsBufferB, totalLinesB, loaderA.getShardOffsets(), outputFile,
+                                   numProducers, numConsumers, engine, queueCapacity, format);
         }
 
-        // Close the output file
-        outfile.close();
-        std::cout << "Done writing" << std::endl;
-
     } catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
         throw;
     }
 }
 
-// Function that calculates distances between primary clusters (dummy implementation)
-void calculate_distance_matrix(const std::string& inputFileA, 
-                            const std::string& inputFileB,
-                            const std::string& outputFile,
-                            int producers,
-                            int consumers) {    
-    // TODO: Handle whole distance matrix calculation here
-    // For now its just a placeholder. It handles only one block
-    calculate_block_distance(inputFileA, inputFileB, outputFile, producers, consumers);
-    
+DistanceEngine parse_distance_engine(const std::string& name) {
+    if (name == "queue") return DistanceEngine::Queue;
+    if (name == "mapreduce") return DistanceEngine::MapReduce;
+    if (name == "spgemm") return DistanceEngine::SpGEMM;
+    throw std::invalid_argument("Unknown distance engine: " + name + " (use queue, mapreduce or spgemm)");
 }
 
-
-
+const char* distance_engine_name(DistanceEngine engine) {
+    switch (engine) {
+        case DistanceEngine::MapReduce: return "mapreduce";
+        case DistanceEngine::SpGEMM: return "spgemm";
+        default: return "queue";
+    }
+}
@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+#include <dpcstruct/secondarycluster/distance_proc.h>
+#include <dpcstruct/secondarycluster/pair_matching.h>
+#include <dpcstruct/sort.h>
+
+#define SPGEMM_ROW_BLOCK 256 // Rows of the product computed per task
+
+// Pair counting as a sparse matrix product. The distinct intervals (sID, sstart, send) of file B
+// are the inner dimension: N maps each of them to the primary clusters of B holding it (with
+// multiplicity), and M maps each primary cluster of A to the B intervals its domains overlap.
+// The counts are C = M x N, computed row by row (Gustavson) with a dense accumulator per thread.
+namespace {
+
+// Dense numbering of the qIDs of a file, in increasing qID order
+struct QIDIndex {
+    std::vector<uint32_t> qIDs;
+    std::vector<uint32_t> qSizes;
+
+    explicit QIDIndex(const SmallPC* pcs, uint64_t count) {
+        std::vector<SmallPC> byQID(pcs, pcs + count);
+        radix_sort(byQID.data(), byQID.size(), [](const SmallPC& pc) { return pc.qID; }, 1);
+        for (const auto& pc : byQID) {
+            if (qIDs.empty() || qIDs.back() != pc.qID) {
+                qIDs.push_back(pc.qID);
+                qSizes.push_back(pc.qSize);
+            }
+        }
+    }
+
+    uint32_t index_of(uint32_t qID) const {
+        return std::lower_bound(qIDs.begin(), qIDs.end(), qID) - qIDs.begin();
+    }
+};
+
+// Sparse matrix in CSR format
+struct CSR {
+    std::vector<uint64_t> offsets{0};
+    std::vector<uint32_t> cols;
+    std::vector<uint32_t> values;
+};
+
+// Part of N and M built by one worker over its sID range
+struct IncidenceBlock {
+    CSR intervals;                   // B interval -> (B column, multiplicity)
+    std::vector<uint64_t> overlapOffsets{0};
+    std::vector<uint32_t> overlaps;  // A record -> B intervals (local numbering)
+};
+
+void build_incidence_block(const SmallPC* alA, uint64_t linesA, const SmallPC* alB, uint64_t linesB,
+                           const QIDIndex& columns, IncidenceBlock& block) {
+    std::vector<uint32_t> order;
+    std::vector<const SmallPC*> representatives;  // one domain per distinct interval of the sID
+    uint64_t posA = 0, posB = 0;
+
+    while (posA < linesA) {
+        uint32_t sID = alA[posA].sID;
+
+        // Distinct intervals of B on this sID
+        while (posB < linesB && alB[posB].sID < sID) ++posB;
+        uint64_t beginB = posB;
+        while (posB < linesB && alB[posB].sID == sID) ++posB;
+
+        order.resize(posB - beginB);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) {
+            const SmallPC& p = alB[beginB + x];
+            const SmallPC& q = alB[beginB + y];
+            if (p.sstart != q.sstart) return p.sstart < q.sstart;
+            if (p.send != q.send) return p.send < q.send;
+            return p.qID < q.qID;
+        });
+
+        uint32_t firstInterval = block.intervals.offsets.size() - 1;
+        representatives.clear();
+        for (size_t k = 0; k < order.size(); ++k) {
+            const SmallPC& pc = alB[beginB + order[k]];
+            if (k == 0 || pc.sstart != representatives.back()->sstart || pc.send != representatives.back()->send) {
+                if (k > 0) block.intervals.offsets.push_back(block.intervals.cols.size());
+                representatives.push_back(&pc);
+            } else if (block.intervals.cols.back() == columns.index_of(pc.qID)) {
+                ++block.intervals.values.back();
+                continue;
+            }
+            block.intervals.cols.push_back(columns.index_of(pc.qID));
+            block.intervals.values.push_back(1);
+        }
+        if (!order.empty()) block.intervals.offsets.push_back(block.intervals.cols.size());
+
+        // Overlapping intervals of each A domain on this sID
+        for (; posA < linesA && alA[posA].sID == sID; ++posA) {
+            auto [lo, hi] = match_start_window(alA[posA]);
+            auto v = std::lower_bound(representatives.begin(), representatives.end(), lo,
+                                      [](const SmallPC* pc, int start) { return pc->sstart < start; });
+            for (; v != representatives.end() && (*v)->sstart <= hi; ++v) {
+                if (domains_match(alA[posA], **v)) {
+                    block.overlaps.push_back(firstInterval + (v - representatives.begin()));
+                }
+            }
+            block.overlapOffsets.push_back(block.overlaps.size());
+        }
+    }
+}
+
+}
+
+
+std::vector<std::vector<PairCount>> spgemm_pair_counts(ThreadData& threadData) {
+    int numWorkers = threadData.numProducers;
+    const SmallPC* pcsA = reinterpret_cast<const SmallPC*>(threadData.bufferA);
+    const SmallPC* pcsB = reinterpret_cast<const SmallPC*>(threadData.bufferB);
+    bool selfJoin = pcsA == pcsB;
+
+    QIDIndex rows(pcsA, threadData.totalLinesA);
+    QIDIndex columns(pcsB, threadData.totalLinesB);
+
+    // Incidence structures, built in parallel over the sID ranges of the producers
+    std::vector<IncidenceBlock> blocks(numWorkers);
+    std::vector<std::thread> workers;
+    for (int w = 0; w < numWorkers; ++w) {
+        workers.emplace_back([&, w]() {
+            build_incidence_block(pcsA + threadData.partIndices[w][0],
+                                  threadData.partIndices[w + 1][0] - threadData.partIndices[w][0],
+                                  pcsB + threadData.partIndices[w][1],
+                                  threadData.partIndices[w + 1][1] - threadData.partIndices[w][1],
+                                  columns, blocks[w]);
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    workers.clear();
+
+    // Concatenate the blocks: N (intervals) and the overlaps of each A record
+    CSR intervals;
+    std::vector<uint64_t> overlapOffsets{0};
+    std::vector<uint32_t> overlaps;
+    for (auto& block : blocks) {
+        uint32_t intervalBase = intervals.offsets.size() - 1;
+        uint64_t colBase = intervals.cols.size();
+        for (size_t v = 1; v < block.intervals.offsets.size(); ++v) {
+            intervals.offsets.push_back(colBase + block.intervals.offsets[v]);
+        }
+        intervals.cols.insert(intervals.cols.end(), block.intervals.cols.begin(), block.intervals.cols.end());
+        intervals.values.insert(intervals.values.end(), block.intervals.values.begin(), block.intervals.values.end());
+
+        uint64_t overlapBase = overlaps.size();
+        for (size_t r = 1; r < block.overlapOffsets.size(); ++r) {
+            overlapOffsets.push_back(overlapBase + block.overlapOffsets[r]);
+        }
+        for (uint32_t v : block.overlaps) overlaps.push_back(intervalBase + v);
+        block = IncidenceBlock();
+    }
+
+    // A records grouped by row (primary cluster of A)
+    uint32_t numRows = rows.qIDs.size();
+    std::vector<uint64_t> rowOffsets(numRows + 1, 0);
+    std::vector<uint32_t> rowOf(threadData.totalLinesA);
+    for (uint64_t i = 0; i < threadData.totalLinesA; ++i) {
+        rowOf[i] = rows.index_of(pcsA[i].qID);
+        ++rowOffsets[rowOf[i] + 1];
+    }
+    std::partial_sum(rowOffsets.begin(), rowOffsets.end(), rowOffsets.begin());
+    std::vector<uint64_t> rowRecords(threadData.totalLinesA);
+    {
+        std::vector<uint64_t> pos(rowOffsets.begin(), rowOffsets.end() - 1);
+        for (uint64_t i = 0; i < threadData.totalLinesA; ++i) {
+            rowRecords[pos[rowOf[i]]++] = i;
+        }
+    }
+    std::vector<uint32_t>().swap(rowOf);
+
+    // Gustavson over blocks of rows. A self join is symmetric and each unordered pair of records
+    // counts once, so only the upper triangle is kept. Otherwise C[x][y] and C[y][x] both count for the
+    // pair (x, y) and are summed in the reduction below.
+    uint32_t numBlocks = (numRows + SPGEMM_ROW_BLOCK - 1) / SPGEMM_ROW_BLOCK;
+    std::vector<std::vector<PairCount>> blockCounts(numBlocks);
+    std::atomic<uint32_t> nextBlock{0};
+    double countFactor = threadData.countFactor;
+
+    for (int w = 0; w < numWorkers; ++w) {
+        workers.emplace_back([&]() {
+            std::vector<uint32_t> accumulator(columns.qIDs.size(), 0);
+            std::vector<uint32_t> touched;
+
+            uint32_t b;
+            while ((b = nextBlock.fetch_add(1)) < numBlocks) {
+                std::vector<PairCount>& counts = blockCounts[b];
+                uint32_t rowEnd = std::min<uint32_t>(numRows, (b + 1) * SPGEMM_ROW_BLOCK);
+
+                for (uint32_t row = b * SPGEMM_ROW_BLOCK; row < rowEnd; ++row) {
+                    for (uint64_t r = rowOffsets[row]; r < rowOffsets[row + 1]; ++r) {
+                        uint64_t record = rowRecords[r];
+                        for (uint64_t e = overlapOffsets[record]; e < overlapOffsets[record + 1]; ++e) {
+                            uint32_t interval = overlaps[e];
+                            for (uint64_t c = intervals.offsets[interval]; c < intervals.offsets[interval + 1]; ++c) {
+                                uint32_t col = intervals.cols[c];
+                                if (accumulator[col] == 0) touched.push_back(col);
+                                accumulator[col] += intervals.values[c];
+                            }
+                        }
+                    }
+
+                    // Columns follow the qID order
+                    std::sort(touched.begin(), touched.end());
+                    uint32_t qID1 = rows.qIDs[row];
+                    for (uint32_t col : touched) {
+                        uint32_t qID2 = columns.qIDs[col];
+                        uint32_t count = accumulator[col];
+                        accumulator[col] = 0;
+
+                        if (qID1 == qID2 || (selfJoin && qID2 < qID1)) continue;
+
+                        uint32_t norm = countFactor * std::min(rows.qSizes[row], columns.qSizes[col]);
+                        counts.emplace_back(std::min(qID1, qID2), std::max(qID1, qID2), Ratio(count, norm));
+                    }
+                    touched.clear();
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    workers.clear();
+
+    // Split the counts in the qID ranges of the consumers, as in the map-reduce engine
+    int numPartitions = threadData.numConsumers;
+    std::vector<std::vector<PairCount>> pairCounts(numPartitions);
+    for (auto& counts : blockCounts) {
+        for (const auto& pairCount : counts) {
+            pairCounts[threadData.router(pairCount.ID1)].push_back(pairCount);
+        }
+        std::vector<PairCount>().swap(counts);
+    }
+
+    // Rows are in qID order: the upper triangle is already sorted in each range. Otherwise sum
+    // C[x][y] and C[y][x].
+    std::atomic<int> nextPartition{0};
+    for (int w = 0; w < numWorkers; ++w) {
+        workers.emplace_back([&]() {
+            int p;
+            while ((p = nextPartition.fetch_add(1)) < numPartitions) {
+                std::vector<PairCount>& counts = pairCounts[p];
+                if (!selfJoin) {
+                    radix_sort(counts.data(), counts.size(), [](const PairCount& pc) { return pc.key(); }, 1);
+
+                    size_t out = 0;
+                    for (size_t i = 0; i < counts.size(); ++i) {
+                        if (out > 0 && counts[out - 1].key() == counts[i].key()) {
+                            counts[out - 1].ratio.num += counts[i].ratio.num;
+                        } else {
+                            counts[out++] = counts[i];
+                        }
+                    }
+                    counts.resize(out);
+                }
+                if (threadData.writer) threadData.writer->submit(p, counts);
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+
+    return pairCounts;
+}
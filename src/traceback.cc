@@ -10,6 +10,7 @@
 
 #include <commandparser/CommandParser.h>
 #include <dpcstruct/sort.h>
+#include <dpcstruct/external_sort.h>
 #include <dpcstruct/types/PrimaryCluster.h>
 #include <dpcstruct/fileparser/PCsFileParser.h>
 
@@ -87,6 +88,105 @@ std::vector<SequenceLabel> assign_search_label(SmallPC * clusterAlign,  std::uno
     return searchLabel;
 }
 
+// Splits the label-sorted domains into about `numFiles` files of similar size.
+// A file is closed once it holds its share of the domains and the current label ends,
+// so a metacluster never spans two files. The last file takes the remainder.
+class LabelFileWriter {
+public:
+    LabelFileWriter(const std::string& outputPath, int numFiles, uint64_t totalLines)
+        : outputPath(outputPath), numFiles(numFiles), avgLines(totalLines / numFiles),
+          fileIndex(0), countInFile(0), closing(false), boundaryLabel(0) {}
+
+    void write(const SequenceLabel* records, uint64_t count) {
+        for (uint64_t i = 0; i < count; ++i) {
+            const SequenceLabel& sl = records[i];
+
+            if (fileIndex > 0 && fileIndex < numFiles && countInFile >= avgLines) {
+                if (!closing) {
+                    closing = true;
+                    boundaryLabel = sl.label;
+                }
+                if (sl.label != boundaryLabel) next_file();
+            }
+            if (fileIndex == 0) next_file();
+
+            outFile.write(reinterpret_cast<const char*>(&sl), sizeof(SequenceLabel));
+            ++countInFile;
+        }
+    }
+
+    // Number of files written so far
+    int close() {
+        outFile.close();
+        return fileIndex;
+    }
+
+private:
+    void next_file() {
+        outFile.close();
+        ++fileIndex;
+        std::string outFilename = outputPath + "sequence-labels_" + std::to_string(fileIndex) + ".bin";
+        outFile.open(outFilename, std::ofstream::binary);
+        if (!outFile) {
+            throw std::runtime_error("Error: Unable to open file " + outFilename);
+        }
+        countInFile = 0;
+        closing = false;
+    }
+
+    std::string outputPath;
+    int numFiles;
+    uint64_t avgLines;
+    int fileIndex;
+    uint64_t countInFile;
+    bool closing;
+    int boundaryLabel;
+    std::ofstream outFile;
+};
+
+// Out-of-core version of the traceback: primary clusters are sorted wrt qID and the
+// labelled domains wrt (label, sID) within `memoryBytes`, spilling sorted runs to `tmpDir`.
+int traceback_external(const std::vector<std::string>& filesList, std::unordered_map<int32_t, int64_t>& labels,
+                       const std::string& outputPath, int numOutputFiles, uint64_t memoryBytes,
+                       const std::string& tmpDir, int numThreads)
+{
+    auto qIDKey = [](const SmallPC& pc) { return pc.qID; };
+    auto labelKey = [](const SequenceLabel& sl) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(sl.label)) << 32) | sl.sID;
+    };
+
+    // Both sorters hold data at the same time during the first merge
+    ExternalSorter<SmallPC, decltype(qIDKey)> pcSorter(qIDKey, memoryBytes / 2, tmpDir, numThreads);
+    ExternalSorter<SequenceLabel, decltype(labelKey)> labelSorter(labelKey, memoryBytes / 2, tmpDir, numThreads);
+
+    std::vector<SmallPC> chunk(EXTERNAL_MERGE_BUFFER);
+    for (const auto& filename : filesList) {
+        std::ifstream inFile(filename, std::ifstream::binary);
+        if (!inFile) {
+            throw std::runtime_error("Error: Unable to open file " + filename);
+        }
+        while (inFile.read(reinterpret_cast<char*>(chunk.data()), chunk.size() * sizeof(SmallPC)) || inFile.gcount() > 0) {
+            pcSorter.push(chunk.data(), inFile.gcount() / sizeof(SmallPC));
+        }
+    }
+
+    std::cout << "totalLines: " << pcSorter.size() << std::endl;
+
+    // skip non assigned cIDs
+    pcSorter.merge([&](const SmallPC* pcs, uint64_t count) {
+        for (uint64_t i = 0; i < count; ++i) {
+            auto itLabel = labels.find(pcs[i].qID);
+            if (itLabel == labels.end() || itLabel->second < 0) {continue;}
+            labelSorter.push(SequenceLabel(pcs[i].sID, pcs[i].sstart, pcs[i].send, itLabel->second));
+        }
+    });
+
+    LabelFileWriter writer(outputPath, numOutputFiles, labelSorter.size());
+    labelSorter.merge([&](const SequenceLabel* records, uint64_t count) { writer.write(records, count); });
+
+    return writer.close();
+}
+
 
 int main(int argc, char *argv[]) {
     try {
@@ -97,13 +197,16 @@ int main(int argc, char *argv[]) {
 
         // Argument parser options
         std::vector<Option> options = {
-            {'i',"INPUT", "input files containing all primary cluster domains", true},
+            {'i',"INPUT", "input files (or shard manifests) containing all primary cluster domains", true},
             {'l', "MC_LABELS", "file containing a metacluster label for each primary cluster", true},
             {'o', "OUTDIR", "output path (optional, default is ./)", false},
-            {'n', "NUM_OUTPUT", "estimated number of output files (optional)", false}
+            {'n', "NUM_OUTPUT", "estimated number of output files (optional)", false},
+            {'t', "THREADS", "number of threads (optional, default is system threads)", false},
+            {'m', "MEMORY", "memory budget for sorting in MB, larger inputs are sorted out of core (optional, default: in memory)", false},
+            {'d', "TMPDIR", "directory for temporary sort files (optional, default is OUTDIR)", false}
         };
 
-        std::string optstring = "l:o:n:";
+        std::string optstring = "l:o:n:t:m:d:";
         std::string program_desc = "Assign a metacluster label to each domain inside a primary cluster.";
 
         // Initialize the command parser
@@ -115,9 +218,20 @@ int main(int argc, char *argv[]) {
         std::string labelFilename = parsed_options["l"];  // Required option
         std::string outputPath = parsed_options.count("o") ? parsed_options["o"] : "./"; 
         int num_output_files = parsed_options.count("n") ? std::stoi(parsed_options["n"]) : 1;
-
-        // Collect input filenames
-        std::vector<std::string> filesList = OptionParser::split_filenames(filenames);
+        int numThreads = parsed_options.count("t") ? std::stoi(parsed_options["t"]) : omp_get_max_threads();
+        uint64_t memoryMB = parsed_options.count("m") ? std::stoull(parsed_options["m"]) : 0;
+
+        // Collect input filenames, a shard manifest stands for its shards
+        std::vector<std::string> filesList;
+        for (const auto& filename : OptionParser::split_filenames(filenames)) {
+            if (is_shard_manifest(filename)) {
+                for (const auto& shard : read_shard_manifest(filename)) {
+                    filesList.push_back(shard.filename);
+                }
+            } else {
+                filesList.push_back(filename);
+            }
+        }
         // check if the input files are valid
         for (const auto& filename : filesList) {
             if (!std::filesystem::exists(filename)) {
@@ -137,6 +251,11 @@ int main(int argc, char *argv[]) {
             outputPath += '/';
         }
 
+        std::string tmpDir = parsed_options.count("d") ? parsed_options["d"] : outputPath;
+        if (memoryMB > 0 && !std::filesystem::is_directory(tmpDir)) {
+            throw std::invalid_argument("Error: Temporary directory (" + tmpDir + ") does not exist.");
+        }
+
         if (!std::filesystem::exists(labelFilename)) {
             throw std::invalid_argument("Error: MC labels file (" + labelFilename + ") does not exist.");
         }
@@ -146,9 +265,20 @@ int main(int argc, char *argv[]) {
         std::cout << "MC labels file: " << labelFilename << std::endl;
         
         // Processing..
-        
+
+        if (memoryMB > 0) {
+            load_labels(labelFilename, labels);
+            num_output_files = traceback_external(filesList, labels, outputPath, num_output_files,
+                                                  memoryMB << 20, tmpDir, numThreads);
+
+            std::cout << "Total output files: " << num_output_files << "\n";
+            std::cout << "Processing complete." << std::endl;
+            return 0;
+        }
+
         // Vector to hold parsers
         std::vector<PCsFileParser> fileParsers;
+        fileParsers.reserve(filesList.size());  // parsers own their buffer, they must not be copied
         uint64_t totalLines = 0;
 
         for (const auto& filename : filesList) {
@@ -178,7 +308,7 @@ int main(int argc, char *argv[]) {
 
         load_labels(labelFilename, labels);
 
-        radix_sort(reinterpret_cast<unsigned char*>(bufferPC), totalLines, 16, 4, 0);
+        radix_sort(bufferPC, totalLines, [](const SmallPC& pc) { return pc.qID; }, numThreads);
         if (!std::is_sorted(bufferPC, bufferPC + totalLines, compare_qID())) {
             throw std::runtime_error("Radix sort failed! Check if qIDs are 32-bit unsigned integers.");
         }
@@ -188,44 +318,15 @@ int main(int argc, char *argv[]) {
         // Clean up
         delete[] bufferPC;
         
-        // sort wrt to sID
-        radix_sort((unsigned char*) searchLabel.data(), searchLabel.size(), 12, 4, 0);
-        // sort wrt label
-        radix_sort((unsigned char*) searchLabel.data(), searchLabel.size(), 12, 4, 8);
-        // TODO: implement radix_sort for std::vector
+        // sort wrt label and then sID (labels of the output are never negative)
+        radix_sort(searchLabel.data(), searchLabel.size(), [](const SequenceLabel& sl) {
+            return (static_cast<uint64_t>(static_cast<uint32_t>(sl.label)) << 32) | sl.sID;
+        }, numThreads);
 
         // Output
-        size_t avgLines = searchLabel.size() / num_output_files;
-        auto startIt = searchLabel.begin();
-        auto endIt = startIt;
-
-        for (int i = 1; i <= num_output_files; ++i) {
-            if (endIt == searchLabel.end()) {
-                num_output_files = i - 1; 
-                break;
-            }
-
-            std::string outFilename = outputPath + "sequence-labels_" + std::to_string(i) + ".bin";
-            std::ofstream outFile(outFilename, std::ofstream::binary);
-
-            // Move endIt to the approximate avgLines position
-            endIt = startIt + avgLines;
-
-            if (endIt < searchLabel.end()) {
-                int current_label = endIt->label;
-                // Move endIt forward while elements have the same label
-                while (endIt != searchLabel.end() && endIt->label == current_label) {
-                    ++endIt;
-                }
-            }
-
-            // Write the chunk to file
-            outFile.write(reinterpret_cast<const char*>(&(*startIt)), (endIt - startIt) * sizeof(SequenceLabel));
-            
-            // Move to the next chunk
-            startIt = endIt;
-            outFile.close();
-        }
+        LabelFileWriter writer(outputPath, num_output_files, searchLabel.size());
+        writer.write(searchLabel.data(), searchLabel.size());
+        num_output_files = writer.close();
 
         std::cout << "Total output files: " << num_output_files << "\n";
         std::cout << "Processing complete." << std::endl;
@@ -1,7 +1,12 @@
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/catch_approx.hpp>
 
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+
 #include <dpcstruct/primarycluster_core.h>
+#include <dpcstruct/primarycluster_proc.h>
 #include <dpcstruct/types/Alignment.h>
 
 // Test the density calculation logic
@@ -39,4 +44,159 @@ TEST_CASE("Test primary cluster density calculation", "[rho]") {
     REQUIRE(rho[5] == Catch::Approx(3.0).epsilon(0.1));
     REQUIRE(rho[6] == Catch::Approx(1.0).epsilon(0.1)); 
     // REQUIRE(rho[7] == Catch::Approx(1.0).epsilon(0.1)); 
-}
\ No newline at end of file
+}
+
+// Test the density of representatives of identical query intervals
+TEST_CASE("Test weighted density of collapsed intervals", "[rho]") {
+    std::vector<Alignment> alignments = {
+        {1, 101, 50, 100, 100, 150, 100, 200, 40, 50, 0.95, 15, 0.8, 0.9},
+        {1, 102, 50, 100, 110, 160, 100, 200, 40, 50, 0.95, 15, 0.8, 0.9}, // same interval as 0
+        {1, 103, 55, 105, 105, 155, 100, 200, 50, 60, 0.92, 16, 0.7, 0.85}, // overlaps with 0,1
+        {1, 104, 50, 100, 120, 170, 100, 200, 40, 50, 0.95, 15, 0.8, 0.9}, // same interval as 0
+        {1, 105, 10, 150, 150, 200, 100, 200, 40, 50, 0.82, 19, 0.4, 0.7},
+    };
+    std::vector<size_t> validIndices = {0, 1, 2, 3, 4};
+    double dpar = 0.2;
+
+    ClusterWorkspace ws;
+    auto repIndices = collapse_intervals(alignments, validIndices, ws);
+
+    REQUIRE(repIndices.size() == 3);
+    REQUIRE(ws.groupOf[0] == ws.groupOf[1]);
+    REQUIRE(ws.groupOf[0] == ws.groupOf[3]);
+    REQUIRE(ws.weights[ws.groupOf[0]] == 3);
+    REQUIRE(ws.weights[ws.groupOf[2]] == 1);
+
+    std::vector<double> rho(repIndices.size());
+    calculate_density(alignments, repIndices, ws.weights, rho, dpar);
+    auto rhoAll = calculate_density(alignments, validIndices, dpar);
+
+    // each representative gets the density of its densest copy
+    for (size_t k = 0; k < validIndices.size(); ++k) {
+        REQUIRE(rho[ws.groupOf[k]] >= rhoAll[k]);
+        REQUIRE(rho[ws.groupOf[k]] == Catch::Approx(rhoAll[k]).margin(0.1));
+    }
+    REQUIRE(rho[ws.groupOf[0]] == Catch::Approx(4.0).epsilon(0.1));
+}
+
+
+// Test the stratified subsample of the representatives
+TEST_CASE("Test sampling of collapsed intervals", "[rho]") {
+    std::vector<Alignment> alignments;
+    for (uint32_t i = 0; i < 40; ++i) {
+        uint32_t start = 10 + (i % 20) * 5;  // 20 distinct intervals, 2 copies each
+        alignments.emplace_back(1, 100 + i, start, start + 60, 1, 61, 200, 200, 60, 0.9, 1e-5, 50, 0.5, 0.5);
+    }
+    alignments.emplace_back(1, 200, 10, 70, 5, 65, 200, 200, 60, 0.9, 1e-5, 50, 0.5, 0.5); // third copy of the first
+
+    std::vector<size_t> validIndices(alignments.size());
+    std::iota(validIndices.begin(), validIndices.end(), 0);
+
+    ClusterWorkspace ws;
+    collapse_intervals(alignments, validIndices, ws);
+    REQUIRE(ws.repIndices.size() == 20);
+
+    // intervals 5 apart are within dpar of each other, 10 apart are not: the cap holds anyway
+    for (size_t maxSamples : {1, 4, 8}) {
+        auto sampleIndices = sample_intervals(alignments, ws, maxSamples, 0.2);
+
+        REQUIRE(sampleIndices.size() == maxSamples);
+        REQUIRE(std::accumulate(ws.sampleWeights.begin(), ws.sampleWeights.end(), 0u) <= alignments.size());
+        // the most populated interval represents its neighbors
+        auto first = std::find_if(sampleIndices.begin(), sampleIndices.end(), [&](size_t i) { return alignments[i].queryStart == 10; });
+        REQUIRE(first != sampleIndices.end());
+        REQUIRE(ws.sampleWeights[first - sampleIndices.begin()] == 5);
+        REQUIRE(std::is_sorted(ws.samplePos.begin(), ws.samplePos.end()));
+    }
+
+    // intervals far apart
+    REQUIRE(sample_intervals(alignments, ws, 20, 0.01).size() == 20);
+    REQUIRE(sample_intervals(alignments, ws, 6, 0.01).size() == 6);
+
+    auto labels = cluster_alignments(alignments, 0.2, 4);
+    REQUIRE(labels.size() == alignments.size());
+}
+
+
+// Test that a capped query with strata spanning two domains keeps the labels of the full clustering
+TEST_CASE("Test capped clustering of spread-out strata", "[rho]") {
+    std::vector<Alignment> alignments;
+    uint32_t sID = 100;
+    for (uint32_t start = 10; start < 25; ++start) {  // a large domain of 30 intervals, 2 copies each
+        for (uint32_t end : {110u, 111u}) {
+            for (int copy = 0; copy < 2; ++copy) {
+                alignments.emplace_back(1, sID++, start, end, 1, end - start + 1, 400, 200, end - start, 0.9, 1e-5, 50, 0.5, 0.5);
+            }
+        }
+    }
+    for (uint32_t i = 0; i < 12; ++i) {  // a small domain far away, all in the last stratum
+        uint32_t start = 300 + i % 4, end = 360 + i / 4;
+        alignments.emplace_back(1, sID++, start, end, 1, end - start + 1, 400, 200, end - start, 0.9, 1e-5, 50, 0.5, 0.5);
+    }
+
+    auto labels = cluster_alignments(alignments, 0.2);
+    REQUIRE(*std::max_element(labels.begin(), labels.end()) == 1);
+    for (size_t maxAlignments : {2, 5}) {
+        REQUIRE(cluster_alignments(alignments, 0.2, maxAlignments) == labels);
+    }
+}
+
+
+// Test that the alignments are labelled within the dpar of the configuration
+TEST_CASE("Test labels within dpar of the peaks", "[sweep]") {
+    std::vector<Alignment> alignments;
+    for (uint32_t i = 0; i < 20; ++i) {
+        uint32_t start = 100 + i % 3;
+        alignments.emplace_back(1, 100 + i, start, 199, 1, 200 - start, 400, 200, 199 - start, 0.9, 1e-5, 50, 0.5, 0.5);
+    }
+    for (uint32_t i = 0; i < 3; ++i) {  // about 0.15 from the peak
+        alignments.emplace_back(1, 200 + i, 100, 217, 1, 118, 400, 200, 117, 0.9, 1e-5, 50, 0.5, 0.5);
+    }
+
+    auto wide = cluster_alignments(alignments, 0.2);
+    auto narrow = cluster_alignments(alignments, 0.1);
+    REQUIRE(std::all_of(wide.begin(), wide.end(), [](int label) { return label == 0; }));
+    REQUIRE(std::count(narrow.begin(), narrow.end(), -1) == 3);
+
+    std::vector<ClusterParams> grid = {{0.1, 10.0, 0.4, 10}, {0.2, 10.0, 0.4, 10}};
+    ClusterWorkspace ws;
+    const auto& perConfigLabels = cluster_alignments_sweep(alignments, ws, grid);
+    REQUIRE(perConfigLabels[0] == narrow);
+    REQUIRE(perConfigLabels[1] == wide);
+}
+
+
+// Test the parsing of a sweep grid, and the rejection of parameters out of range
+TEST_CASE("Test parameter grid parsing", "[sweep]") {
+    auto grid = parse_param_grid("dpar=0.1,0.2:peaks=5");
+    REQUIRE(grid.size() == 2);
+    REQUIRE(grid[1].dpar == 0.2);
+    REQUIRE(grid[1].max_peaks == 5);
+    REQUIRE(parse_param_grid("peaks=100")[0].max_peaks == 100);
+
+    for (const char* spec : {"dpar=-1", "dpar=0", "rho=-1", "delta=-0.1", "peaks=-1", "peaks=0", "peaks=101",
+                             "peaks=2.5", "dpar=0.1x", "peaks=", "dpar=abc"}) {
+        REQUIRE_THROWS_AS(parse_param_grid(spec), std::invalid_argument);
+    }
+}
+
+
+// Test that a sweep reproduces the single-configuration clustering
+TEST_CASE("Test parameter sweep of a query", "[sweep]") {
+    std::vector<Alignment> alignments;
+    for (uint32_t i = 0; i < 60; ++i) {
+        uint32_t start = (i % 3 == 0) ? 10 + i % 7 : 200 + i % 5;  // two domains
+        alignments.emplace_back(1, 100 + i, start, start + 80, 1, 81, 400, 200, 80, 0.9, 1e-5, 50, 0.5, 0.5);
+    }
+
+    std::vector<ClusterParams> grid = {{0.1, 5.0, 0.4, 10}, ClusterParams{}, {0.3, 10.0, 0.5, 1}};
+
+    ClusterWorkspace ws;
+    const auto& perConfigLabels = cluster_alignments_sweep(alignments, ws, grid);
+
+    REQUIRE(perConfigLabels.size() == grid.size());
+    REQUIRE(perConfigLabels[1] == cluster_alignments(alignments, 0.2));
+
+    // a single peak at most
+    REQUIRE(*std::max_element(perConfigLabels[2].begin(), perConfigLabels[2].end()) <= 0);
+}
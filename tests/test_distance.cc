@@ -0,0 +1,667 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <dpcstruct/distance.h>
+#include <dpcstruct/secondarycluster/pair_accumulator.h>
+#include <dpcstruct/secondarycluster/pair_matching.h>
+#include <dpcstruct/secondarycluster/distance_proc.h>
+#include <dpcstruct/sort.h>
+
+// Random primary clusters sorted by sID, with a few domain positions per sID so that pairs match
+static std::vector<SmallPC> random_pcs(uint32_t numRecords, uint32_t numSIDs, uint32_t numQIDs, std::mt19937& gen) {
+    std::vector<SmallPC> pcs;
+    for (uint32_t i = 0; i < numRecords; ++i) {
+        uint32_t sID = gen() % numSIDs;
+        uint32_t qID = 1 + gen() % numQIDs;
+        uint16_t start = 10 * (gen() % 4) + gen() % 5;
+        pcs.emplace_back(qID, 1 + qID % 7, sID, start, start + 40 + gen() % 5);
+    }
+    radix_sort(pcs.data(), pcs.size(), [](const SmallPC& pc) { return pc.sID; }, 1);
+    return pcs;
+}
+
+// Runs a pair counting engine on A x B, a self join when both are the same vector
+static std::vector<std::vector<PairCount>> count_pairs(std::vector<SmallPC>& pcsA, std::vector<SmallPC>& pcsB,
+                                                       int numProducers, int numConsumers, DistanceEngine engine,
+                                                       uint64_t queueCapacity = 0) {
+    ThreadData threadData(numProducers, numConsumers);
+    threadData.queueCapacity = queueCapacity;
+    threadData.bufferA = reinterpret_cast<char*>(pcsA.data());
+    threadData.bufferB = reinterpret_cast<char*>(pcsB.data());
+    threadData.totalLinesA = pcsA.size();
+    threadData.totalLinesB = pcsB.size();
+
+    balanced_partition(threadData.qIDs_partition, pcsA.data(), pcsA.size(), pcsB.data(), pcsB.size(), numConsumers);
+    threadData.router = ConsumerRouter(threadData.qIDs_partition);
+    files_partition(threadData.partIndices, pcsA.data(), pcsB.data(), pcsA.size(), pcsB.size(), numProducers, {0, pcsA.size()});
+    threadData.tiles = pair_tiles(pcsA.data(), pcsB.data(), pcsA.size(), pcsB.size(), numProducers);
+
+    if (engine == DistanceEngine::MapReduce) return mapreduce_pair_counts(threadData);
+    if (engine == DistanceEngine::SpGEMM) return spgemm_pair_counts(threadData);
+    return queue_pair_counts(threadData);
+}
+
+// Flattens the per-partition counts
+static std::vector<PairCount> flatten(const std::vector<std::vector<PairCount>>& pairCounts) {
+    std::vector<PairCount> pairs;
+    for (const auto& partition : pairCounts) pairs.insert(pairs.end(), partition.begin(), partition.end());
+    return pairs;
+}
+
+static bool same_counts(const std::vector<PairCount>& a, const std::vector<PairCount>& b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const PairCount& x, const PairCount& y) {
+        return x.ID1 == y.ID1 && x.ID2 == y.ID2 && x.ratio.num == y.ratio.num && x.ratio.denom == y.ratio.denom;
+    });
+}
+
+// Test the flat pair accumulator against the nested maps it replaces
+TEST_CASE("Test pair accumulator", "[distance]") {
+    std::mt19937 gen(3);
+
+    PairAccumulator accumulator;
+    std::map<uint32_t, std::map<uint32_t, Ratio>> expected;
+
+    for (int i = 0; i < 100000; ++i) {
+        uint32_t id1 = gen() % 500;
+        uint32_t id2 = id1 + 1 + gen() % 300;
+        uint32_t norm = 1 + gen() % 50;
+
+        accumulator.add(id1, id2, norm);
+        auto ret = expected[id1].insert({id2, Ratio(1, norm)});
+        if (!ret.second) ret.first->second.num += 1;
+    }
+
+    size_t numExpected = 0;
+    for (const auto& row : expected) numExpected += row.second.size();
+    REQUIRE(accumulator.size() == numExpected);
+
+    std::vector<PairCount> pairs = accumulator.sorted();
+    REQUIRE(pairs.size() == numExpected);
+    REQUIRE(accumulator.size() == 0);
+
+    size_t k = 0;
+    for (const auto& row : expected) {
+        for (const auto& entry : row.second) {
+            REQUIRE(pairs[k].ID1 == row.first);
+            REQUIRE(pairs[k].ID2 == entry.first);
+            REQUIRE(pairs[k].ratio.num == entry.second.num);
+            REQUIRE(pairs[k].ratio.denom == entry.second.denom);
+            ++k;
+        }
+    }
+}
+
+// Test the integer match and its start window against the distance threshold
+TEST_CASE("Test domain matching", "[distance]") {
+    for (uint16_t startA = 0; startA < 60; ++startA) {
+        for (uint16_t endA = startA; endA < 60; ++endA) {
+            SmallPC a(1, 1, 0, startA, endA);
+            auto [lo, hi] = match_start_window(a);
+
+            for (uint16_t startB = 0; startB < 60; ++startB) {
+                for (uint16_t endB = startB; endB < 60; ++endB) {
+                    SmallPC b(2, 1, 0, startB, endB);
+                    bool match = distance(&a, &b) <= 0.2;
+                    REQUIRE(domains_match(a, b) == match);
+                    if (match) REQUIRE((lo <= startB && startB <= hi));
+                }
+            }
+        }
+    }
+}
+
+// Test the engines against the producer-consumer queues
+TEST_CASE("Test pair counting engines", "[distance]") {
+    std::mt19937 gen(5);
+    std::vector<SmallPC> pcsA = random_pcs(20000, 400, 3000, gen);
+    std::vector<SmallPC> pcsB = random_pcs(15000, 400, 3000, gen);
+
+    SECTION("Self join") {
+        auto expected = flatten(count_pairs(pcsA, pcsA, 3, 4, DistanceEngine::Queue));
+        REQUIRE(!expected.empty());
+        REQUIRE(same_counts(flatten(count_pairs(pcsA, pcsA, 3, 4, DistanceEngine::MapReduce)), expected));
+        REQUIRE(same_counts(flatten(count_pairs(pcsA, pcsA, 3, 4, DistanceEngine::SpGEMM)), expected));
+    }
+
+    SECTION("Two files") {
+        auto expected = flatten(count_pairs(pcsA, pcsB, 2, 3, DistanceEngine::Queue));
+        REQUIRE(!expected.empty());
+        REQUIRE(same_counts(flatten(count_pairs(pcsA, pcsB, 2, 3, DistanceEngine::MapReduce)), expected));
+        REQUIRE(same_counts(flatten(count_pairs(pcsA, pcsB, 2, 3, DistanceEngine::SpGEMM)), expected));
+    }
+
+    SECTION("Bounded queues") {
+        auto expected = flatten(count_pairs(pcsA, pcsB, 2, 3, DistanceEngine::Queue));
+        REQUIRE(same_counts(flatten(count_pairs(pcsA, pcsB, 4, 2, DistanceEngine::Queue, 1)), expected));
+        REQUIRE(same_counts(flatten(count_pairs(pcsA, pcsB, 4, 2, DistanceEngine::Queue, 25000)), expected));
+    }
+
+    SECTION("One partition per consumer") {
+        for (auto engine : {DistanceEngine::Queue, DistanceEngine::MapReduce, DistanceEngine::SpGEMM}) {
+            for (std::vector<SmallPC>* pcsOther : {&pcsA, &pcsB}) {
+                auto partitions = count_pairs(pcsA, *pcsOther, 3, 4, engine);
+                REQUIRE(partitions.size() == 4);
+                std::vector<uint64_t> partition(3);
+                balanced_partition(partition, pcsA.data(), pcsA.size(), pcsOther->data(), pcsOther->size(), 4);
+                for (size_t p = 0; p < partitions.size(); ++p) {
+                    REQUIRE(std::all_of(partitions[p].begin(), partitions[p].end(), [&](const PairCount& pc) {
+                        return consumer_of(pc.ID1, partition) == int(p);
+                    }));
+                }
+            }
+        }
+    }
+}
+
+
+// Test the split of oversized sID groups into sub-tiles
+TEST_CASE("Test pair tiles", "[distance]") {
+    std::mt19937 gen(7);
+    std::vector<SmallPC> pcsA = random_pcs(4000, 3, 2000, gen);
+    std::vector<SmallPC> pcsB = random_pcs(3000, 3, 2000, gen);
+
+    // Each group is above the cost bound, so it is split
+    std::vector<PairTile> tiles = pair_tiles(pcsA.data(), pcsB.data(), pcsA.size(), pcsB.size(), 4);
+    REQUIRE(tiles.size() > 3);
+
+    uint64_t covered = 0;
+    for (const auto& tile : tiles) {
+        REQUIRE(tile.cost <= PAIR_TILE_MIN_COST);
+        covered += tile.cost;
+    }
+    REQUIRE(covered == [&]() {
+        uint64_t cost = 0;
+        for (uint32_t s = 0; s < 3; ++s) {
+            auto inA = std::count_if(pcsA.begin(), pcsA.end(), [s](const SmallPC& pc) { return pc.sID == s; });
+            auto inB = std::count_if(pcsB.begin(), pcsB.end(), [s](const SmallPC& pc) { return pc.sID == s; });
+            cost += inA * inB;
+        }
+        return cost;
+    }());
+
+    // The counts do not depend on the split
+    PairAccumulator accumulator;
+    for_each_matched_pair(pcsA.data(), pcsA.size(), pcsB.data(), pcsB.size(), 1.0, [&](const MatchedPair& pair) {
+        accumulator.add(pair.ID1, pair.ID2, pair.normFactor);
+    });
+    auto expected = accumulator.sorted();
+    REQUIRE(!expected.empty());
+    REQUIRE(same_counts(flatten(count_pairs(pcsA, pcsB, 4, 3, DistanceEngine::Queue)), expected));
+    REQUIRE(same_counts(flatten(count_pairs(pcsA, pcsB, 4, 3, DistanceEngine::MapReduce)), expected));
+}
+
+// Test the self join against the full product, in which each pair is matched in both orders
+TEST_CASE("Test self join", "[distance]") {
+    std::mt19937 gen(9);
+    std::vector<SmallPC> pcs = random_pcs(6000, 3, 2000, gen);
+
+    // Groups are above the cost bound: diagonal and off-diagonal sub-tiles
+    REQUIRE(pair_tiles(pcs.data(), pcs.data(), pcs.size(), pcs.size(), 3).size() > 3);
+
+    PairAccumulator accumulator;
+    for_each_matched_pair(pcs.data(), pcs.size(), pcs.data(), pcs.size(), 2.0, [&](const MatchedPair& pair) {
+        accumulator.add(pair.ID1, pair.ID2, pair.normFactor);
+    });
+    auto expected = accumulator.sorted();
+    REQUIRE(!expected.empty());
+
+    for (auto engine : {DistanceEngine::Queue, DistanceEngine::MapReduce, DistanceEngine::SpGEMM}) {
+        auto pairs = flatten(count_pairs(pcs, pcs, 3, 2, engine));
+        REQUIRE(std::equal(pairs.begin(), pairs.end(), expected.begin(), expected.end(), [](const PairCount& x, const PairCount& y) {
+            return x.ID1 == y.ID1 && x.ID2 == y.ID2 && 2 * x.ratio.num == y.ratio.num && 2 * x.ratio.denom == y.ratio.denom;
+        }));
+    }
+}
+
+// Reads a distance file
+static std::vector<NormalizedPair> read_distances(const std::string& path) {
+    std::ifstream infile(path, std::ios::binary | std::ios::ate);
+    std::vector<NormalizedPair> pairs(infile.tellg() / sizeof(NormalizedPair));
+    infile.seekg(0);
+    infile.read(reinterpret_cast<char*>(pairs.data()), pairs.size() * sizeof(NormalizedPair));
+    return pairs;
+}
+
+static std::vector<char> read_file(const std::string& path) {
+    std::ifstream infile(path, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(infile), std::istreambuf_iterator<char>());
+}
+
+// Test the tiled matrix over shards of disjoint queries against a single self join
+TEST_CASE("Test tiled distance matrix", "[distance]") {
+    std::mt19937 gen(11);
+    std::vector<SmallPC> pcs = random_pcs(6000, 50, 1500, gen);
+
+    std::filesystem::path tmpDir = std::filesystem::temp_directory_path() / "dpcstruct-test-tiles";
+    std::filesystem::create_directories(tmpDir);
+
+    // Shards by qID range, each sorted by sID
+    int numShards = 3;
+    std::ofstream list(tmpDir / "list.txt");
+    for (int k = 0; k < numShards; ++k) {
+        std::vector<SmallPC> shard;
+        std::copy_if(pcs.begin(), pcs.end(), std::back_inserter(shard),
+                     [&](const SmallPC& pc) { return (pc.qID - 1) * numShards / 1500 == uint32_t(k); });
+        std::string name = "shard" + std::to_string(k) + ".bin";
+        std::ofstream(tmpDir / name, std::ios::binary).write(reinterpret_cast<const char*>(shard.data()), shard.size() * sizeof(SmallPC));
+        list << name << "\n";
+    }
+    list.close();
+
+    std::string expectedPath = (tmpDir / "expected.bin").string();
+    compute_block_distance(pcs.data(), pcs.size(), pcs.data(), pcs.size(), {0, pcs.size()}, expectedPath, 2, 3, DistanceEngine::Queue);
+    auto expected = read_distances(expectedPath);
+    REQUIRE(!expected.empty());
+
+    // A budget of a single shard forces reloads
+    std::string outputFile = (tmpDir / "dist.bin").string();
+    calculate_distance_matrix((tmpDir / "list.txt").string(), outputFile, 2, 3, DistanceEngine::Queue, 1);
+
+    auto tiles = read_tile_manifest(tile_manifest_path(outputFile));
+    REQUIRE(tiles.size() == 6);
+
+    // An interrupted run only keeps the manifest of its first tiles
+    tiles.resize(2);
+    write_tile_manifest(tile_manifest_path(outputFile), tiles);
+    std::filesystem::remove(tile_path(outputFile, 3, 3));
+    calculate_distance_matrix((tmpDir / "list.txt").string(), outputFile, 2, 3, DistanceEngine::Queue, 1, true);
+    tiles = read_tile_manifest(tile_manifest_path(outputFile));
+    REQUIRE(tiles.size() == 6);
+
+    std::vector<NormalizedPair> pairs;
+    for (const auto& tile : tiles) {
+        REQUIRE(tile.i <= tile.j);
+        auto tilePairs = read_distances(tile.filename);
+        REQUIRE(tilePairs.size() == tile.pairs);
+        pairs.insert(pairs.end(), tilePairs.begin(), tilePairs.end());
+    }
+    std::sort(pairs.begin(), pairs.end(), [](const NormalizedPair& x, const NormalizedPair& y) {
+        return x.ID1 != y.ID1 ? x.ID1 < y.ID1 : x.ID2 < y.ID2;
+    });
+    REQUIRE(std::equal(pairs.begin(), pairs.end(), expected.begin(), expected.end(), [](const NormalizedPair& x, const NormalizedPair& y) {
+        return x.ID1 == y.ID1 && x.ID2 == y.ID2 && x.distance == y.distance;
+    }));
+
+    std::filesystem::remove_all(tmpDir);
+}
+
+// Test the checkpointed chunks, and a run resumed after losing the last ones
+TEST_CASE("Test checkpointed distances", "[distance]") {
+    std::mt19937 gen(13);
+    std::vector<SmallPC> pcsA = random_pcs(8000, 200, 2000, gen);
+    std::vector<SmallPC> pcsB = random_pcs(6000, 200, 2000, gen);
+
+    std::filesystem::path tmpDir = std::filesystem::temp_directory_path() / "dpcstruct-test-checkpoints";
+    std::filesystem::create_directories(tmpDir);
+    std::string outputFile = (tmpDir / "dist.bin").string();
+
+    for (bool selfJoin : {true, false}) {
+        std::vector<SmallPC>& other = selfJoin ? pcsA : pcsB;
+        auto expected = flatten(count_pairs(pcsA, other, 3, 3, DistanceEngine::Queue));
+
+        std::string inputFileB = selfJoin ? "pcsA.bin" : "pcsB.bin";
+        auto partitions = checkpointed_pair_counts(pcsA.data(), pcsA.size(), other.data(), other.size(), "pcsA.bin",
+                                                   inputFileB, outputFile, 3, 3, DistanceEngine::Queue, 5, false);
+        REQUIRE(partitions.size() == 3);
+        auto chunked = flatten(partitions);
+        REQUIRE(same_counts(chunked, expected));
+
+        auto progress = read_checkpoint_progress(checkpoint_dir(outputFile));
+        REQUIRE(progress.chunks.size() == 5);
+        REQUIRE(progress.inputs.totalLinesB == other.size());
+        REQUIRE(progress.inputs.numCheckpoints == 5);
+
+        // Interrupted after two chunks, the third one half written
+        progress.chunks.resize(2);
+        write_checkpoint_progress(checkpoint_dir(outputFile), progress);
+        std::filesystem::resize_file(tmpDir / "dist.bin.ckpt" / "chunk_3.bin", 10);
+
+        // The chunks of other inputs, or of another chunking, are not reused
+        REQUIRE_THROWS_AS(checkpointed_pair_counts(pcsA.data(), pcsA.size(), other.data(), other.size(), "pcsA.bin",
+                                                   "pcsC.bin", outputFile, 3, 3, DistanceEngine::Queue, 5, true),
+                          std::runtime_error);
+        REQUIRE_THROWS_AS(checkpointed_pair_counts(pcsA.data(), pcsA.size(), other.data(), other.size(), "pcsA.bin",
+                                                   inputFileB, outputFile, 3, 3, DistanceEngine::Queue, 4, true),
+                          std::runtime_error);
+
+        auto resumed = flatten(checkpointed_pair_counts(pcsA.data(), pcsA.size(), other.data(), other.size(), "pcsA.bin",
+                                                        inputFileB, outputFile, 3, 3, DistanceEngine::MapReduce, 5, true));
+        REQUIRE(same_counts(resumed, expected));
+        REQUIRE(read_checkpoint_progress(checkpoint_dir(outputFile)).chunks.size() == 5);
+
+        remove_checkpoints(outputFile);
+        REQUIRE(!std::filesystem::exists(checkpoint_dir(outputFile)));
+    }
+
+    std::filesystem::remove_all(tmpDir);
+}
+
+// Test the consumer balance on qIDs skewed towards small values
+TEST_CASE("Test balanced partition", "[distance]") {
+    std::mt19937 gen(17);
+    std::vector<SmallPC> pcs = random_pcs(20000, 300, 3000, gen);
+    for (auto& pc : pcs) pc.qID = 1 + (pc.qID * pc.qID) / 3000;
+
+    int numConsumers = 4;
+    std::vector<uint64_t> partition(numConsumers - 1);
+    balanced_partition(partition, pcs.data(), pcs.size(), pcs.data(), pcs.size(), numConsumers);
+    REQUIRE(std::is_sorted(partition.begin(), partition.end()));
+
+    std::vector<uint64_t> loads(numConsumers, 0);
+    for_each_self_matched_pair(pcs.data(), pcs.size(), 1.0, [&](const MatchedPair& pair) {
+        ++loads[consumer_of(pair.ID1, partition)];
+    });
+    uint64_t total = 0;
+    for (auto load : loads) total += load;
+    for (auto load : loads) {
+        REQUIRE(load * numConsumers < 2 * total);
+        REQUIRE(2 * load * numConsumers > total);
+    }
+}
+
+// Test the routing table against the scan of the qID ranges
+TEST_CASE("Test consumer router", "[distance]") {
+    std::mt19937 gen(19);
+    std::vector<std::vector<uint64_t>> partitions = {
+        {}, {0}, {1, 1, 2}, {100, 200, 300}, {5, 6, 7, 8, 9, 10, 4000000}, {1000000000, 4000000000ULL}};
+    for (int k = 0; k < 5; ++k) {
+        std::vector<uint64_t> partition(1 + gen() % 40);
+        for (auto& bound : partition) bound = gen() % (1u << (8 + 4 * k));
+        std::sort(partition.begin(), partition.end());
+        partitions.push_back(partition);
+    }
+
+    for (const auto& partition : partitions) {
+        ConsumerRouter router(partition);
+        for (uint64_t bound : partition) {
+            for (uint64_t qID = bound > 0 ? bound - 1 : 0; qID <= bound + 1 && qID <= UINT32_MAX; ++qID) {
+                REQUIRE(router(qID) == consumer_of(qID, partition));
+            }
+        }
+        for (int i = 0; i < 10000; ++i) {
+            uint32_t qID = gen() >> (gen() % 32);
+            REQUIRE(router(qID) == consumer_of(qID, partition));
+        }
+    }
+}
+
+// Test that a pair with qID 0 is counted and written like any other
+TEST_CASE("Test pairs of qID 0", "[distance]") {
+    std::vector<SmallPC> pcs = {SmallPC(0, 3, 1, 10, 50), SmallPC(7, 4, 1, 12, 50), SmallPC(0, 3, 2, 5, 40), SmallPC(7, 4, 2, 5, 41)};
+
+    for (auto engine : {DistanceEngine::Queue, DistanceEngine::MapReduce, DistanceEngine::SpGEMM}) {
+        auto pairs = flatten(count_pairs(pcs, pcs, 2, 2, engine));
+        REQUIRE(pairs.size() == 1);
+        REQUIRE(pairs[0].ID1 == 0);
+        REQUIRE(pairs[0].ID2 == 7);
+        REQUIRE(pairs[0].ratio.num == 2);
+        REQUIRE(pairs[0].ratio.denom == 3);
+    }
+
+    std::string outputFile = (std::filesystem::temp_directory_path() / "dpcstruct-test-qid0.bin").string();
+    REQUIRE(compute_block_distance(pcs.data(), pcs.size(), pcs.data(), pcs.size(), {0, pcs.size()}, outputFile, 2, 2,
+                                   DistanceEngine::Queue) == 1);
+    auto distances = read_distances(outputFile);
+    REQUIRE(distances.size() == 1);
+    REQUIRE(distances[0].ID1 == 0);
+    std::filesystem::remove(outputFile);
+    std::filesystem::remove(distance_index_path(outputFile));
+}
+
+// Test that the partitions written in parallel land in order, whatever the order they are submitted in
+TEST_CASE("Test parallel distance writer", "[distance]") {
+    std::vector<uint64_t> sizes = {3, 0, (1 << 20) + 5, 1000, 0, 7};
+    std::vector<std::vector<PairCount>> partitions;
+    uint32_t ID1 = 0;
+    for (uint64_t size : sizes) {
+        std::vector<PairCount> counts;
+        for (uint64_t i = 0; i < size; ++i) {
+            if (i % 100 == 0) ++ID1;
+            counts.emplace_back(ID1, uint32_t(i + 1), Ratio(uint32_t(i % 9), 10));
+        }
+        partitions.push_back(std::move(counts));
+    }
+    std::vector<PairCount> expected = flatten(partitions);
+
+    std::string outputFile = (std::filesystem::temp_directory_path() / "dpcstruct-test-writer.bin").string();
+    for (int numThreads : {1, 4}) {
+        auto pairCounts = partitions;
+        REQUIRE(write_distances(pairCounts, outputFile, numThreads) == expected.size());
+        for (const auto& counts : pairCounts) {
+            REQUIRE(counts.empty());
+        }
+
+        auto distances = read_distances(outputFile);
+        REQUIRE(std::equal(distances.begin(), distances.end(), expected.begin(), expected.end(), [](const NormalizedPair& x, const PairCount& y) {
+            return x.ID1 == y.ID1 && x.ID2 == y.ID2 && x.distance == 1.0 - y.ratio.as_double();
+        }));
+
+        // Rows on both sides of the end of the large partition
+        DistanceFileView view(outputFile);
+        uint32_t boundaryID1 = expected[3 + (1 << 20)].ID1;
+        for (uint32_t ID1 : {boundaryID1 - 1, boundaryID1, boundaryID1 + 1}) {
+            auto row = view.row(ID1);
+            REQUIRE(row.size() == uint64_t(std::count_if(expected.begin(), expected.end(), [ID1](const PairCount& pc) { return pc.ID1 == ID1; })));
+            REQUIRE(row.front().ID1 == ID1);
+        }
+    }
+
+    // Partitions submitted in reverse order, each by its own thread, give the same files
+    for (DistanceFormat format : {DistanceFormat::Pairs, DistanceFormat::Compact}) {
+        std::string inOrderFile = outputFile + ".in_order";
+        auto pairCounts = partitions;
+        write_distances(pairCounts, inOrderFile, 1, format);
+
+        pairCounts = partitions;
+        DistanceWriter writer(outputFile, pairCounts.size(), format);
+        std::vector<std::thread> submitters;
+        for (size_t p = pairCounts.size(); p-- > 0;) {
+            submitters.emplace_back([&writer, &pairCounts, p]() { writer.submit(p, pairCounts[p]); });
+            if (p % 2 == 0) submitters.back().join();
+        }
+        for (auto& submitter : submitters) {
+            if (submitter.joinable()) submitter.join();
+        }
+        REQUIRE(writer.close() == expected.size());
+
+        REQUIRE(read_file(outputFile) == read_file(inOrderFile));
+        REQUIRE(read_file(distance_index_path(outputFile)) == read_file(distance_index_path(inOrderFile)));
+        std::filesystem::remove(inOrderFile);
+        std::filesystem::remove(distance_index_path(inOrderFile));
+    }
+    std::filesystem::remove(outputFile);
+    std::filesystem::remove(distance_index_path(outputFile));
+}
+
+// Test that a compact file decodes to the distances of the pairs format, in less space
+TEST_CASE("Test compact distance format", "[distance]") {
+    std::mt19937 gen(17);
+    std::vector<SmallPC> pcs = random_pcs(8000, 100, 2000, gen);
+    auto pairCounts = count_pairs(pcs, pcs, 3, 4, DistanceEngine::Queue);
+
+    std::filesystem::path tmpDir = std::filesystem::temp_directory_path() / "dpcstruct-test-compact";
+    std::filesystem::create_directories(tmpDir);
+    std::string pairsFile = (tmpDir / "pairs.bin").string();
+    std::string compactFile = (tmpDir / "compact.bin").string();
+
+    auto copy = pairCounts;
+    uint64_t written = write_distances(copy, pairsFile, 2, DistanceFormat::Pairs);
+    REQUIRE(write_distances(pairCounts, compactFile, 3, DistanceFormat::Compact) == written);
+    REQUIRE(distance_file_format(pairsFile) == DistanceFormat::Pairs);
+    REQUIRE(distance_file_format(compactFile) == DistanceFormat::Compact);
+    REQUIRE(distance_file_complete(compactFile, written));
+    REQUIRE(2 * std::filesystem::file_size(compactFile) < std::filesystem::file_size(pairsFile));
+
+    std::vector<NormalizedPair> expected, pairs;
+    read_distance_file(pairsFile, expected);
+    read_distance_file(compactFile, pairs);
+    REQUIRE(expected.size() == written);
+    REQUIRE(std::equal(pairs.begin(), pairs.end(), expected.begin(), expected.end(), [](const NormalizedPair& x, const NormalizedPair& y) {
+        return x.ID1 == y.ID1 && x.ID2 == y.ID2 && x.distance == y.distance;
+    }));
+
+    // A file cut before its header was written is neither complete nor readable
+    std::filesystem::resize_file(compactFile, std::filesystem::file_size(compactFile) - 1);
+    REQUIRE(!distance_file_complete(compactFile, written));
+    REQUIRE_THROWS(read_distance_file(compactFile, pairs));
+
+    // Rows split across encoded segments and empty files
+    std::vector<PairCount> counts = {{5, 6, Ratio(1, 2)}, {5, 900, Ratio(3, 4)}, {7, 8, Ratio(0, 1)}, {300000, 300001, Ratio(70000, 70000)}};
+    std::vector<uint8_t> rows;
+    REQUIRE(encode_distance_rows(counts.data(), 1, 0, rows) == 1);
+    REQUIRE(encode_distance_rows(counts.data() + 1, 3, 5, rows) == 3);
+    pairs.clear();
+    decode_distance_rows(rows.data(), rows.size(), pairs);
+    REQUIRE(pairs.size() == 4);
+    REQUIRE(pairs[1].ID1 == 5);
+    REQUIRE(pairs[1].ID2 == 900);
+    REQUIRE(pairs[3].ID1 == 300000);
+    REQUIRE(pairs[3].distance == 0.0);
+
+    std::vector<std::vector<PairCount>> none;
+    REQUIRE(write_distances(none, compactFile, 2, DistanceFormat::Compact) == 0);
+    REQUIRE(distance_file_complete(compactFile, 0));
+    read_distance_file(compactFile, pairs);
+    REQUIRE(pairs.empty());
+
+    std::filesystem::remove_all(tmpDir);
+}
+
+// Test the row lookups of the mapped index against a scan, in both formats
+TEST_CASE("Test distance row index", "[distance]") {
+    std::mt19937 gen(19);
+    std::vector<SmallPC> pcs = random_pcs(6000, 80, 3000, gen);
+    auto pairCounts = count_pairs(pcs, pcs, 2, 3, DistanceEngine::MapReduce);
+    std::vector<PairCount> expected = flatten(pairCounts);
+    REQUIRE(!expected.empty());
+
+    std::filesystem::path tmpDir = std::filesystem::temp_directory_path() / "dpcstruct-test-index";
+    std::filesystem::create_directories(tmpDir);
+
+    for (auto format : {DistanceFormat::Pairs, DistanceFormat::Compact}) {
+        std::string outputFile = (tmpDir / (std::string(distance_format_name(format)) + ".bin")).string();
+        auto counts = pairCounts;
+        write_distances(counts, outputFile, 2, format);
+
+        DistanceFileView view(outputFile);
+        REQUIRE(view.format() == format);
+        REQUIRE(view.num_pairs() == expected.size());
+        std::vector<uint32_t> ID1s;
+        for (const auto& pc : expected) {
+            if (ID1s.empty() || ID1s.back() != pc.ID1) ID1s.push_back(pc.ID1);
+        }
+        REQUIRE(std::equal(view.row_ids().begin(), view.row_ids().end(), ID1s.begin(), ID1s.end()));
+
+        // Every ID1 of the range and a few outside it
+        std::vector<NormalizedPair> pairs;
+        for (uint32_t ID1 = 0; ID1 <= expected.back().ID1 + 2; ++ID1) {
+            view.read_row(ID1, pairs);
+        }
+        REQUIRE(std::equal(pairs.begin(), pairs.end(), expected.begin(), expected.end(), [](const NormalizedPair& x, const PairCount& y) {
+            return x.ID1 == y.ID1 && x.ID2 == y.ID2 && x.distance == 1.0 - y.ratio.as_double();
+        }));
+        if (format == DistanceFormat::Pairs) {
+            REQUIRE(view.row(expected.front().ID1).front().ID2 == expected.front().ID2);
+            REQUIRE(view.row(expected.back().ID1 + 1).empty());
+            REQUIRE_THROWS(view.encoded_row(expected.front().ID1));
+        } else {
+            REQUIRE(!view.encoded_row(expected.front().ID1).empty());
+            REQUIRE_THROWS(view.row(expected.front().ID1));
+        }
+    }
+
+    // An empty file still has an index
+    std::string emptyFile = (tmpDir / "empty.bin").string();
+    std::vector<std::vector<PairCount>> none;
+    write_distances(none, emptyFile);
+    DistanceFileView empty(emptyFile);
+    REQUIRE(empty.num_pairs() == 0);
+    REQUIRE(empty.row(1).empty());
+
+    // A rewritten file does not match the index of the previous one
+    std::ofstream(emptyFile, std::ios::binary | std::ios::app).write("0123456789abcdef", 16);
+    REQUIRE_THROWS(DistanceFileView(emptyFile));
+
+    std::filesystem::remove_all(tmpDir);
+}
+
+// Test the index size and lookups on the IDs of primary clusters, queryID * 100 + label
+TEST_CASE("Test distance row index of primary cluster IDs", "[distance]") {
+    std::mt19937 gen(23);
+    std::vector<std::vector<PairCount>> pairCounts(3);
+    std::vector<uint32_t> ID1s;
+    for (uint32_t queryID = 1000; queryID < 31000; queryID += 1 + gen() % 3) {
+        for (uint32_t label = 0; label < 1 + gen() % 4; ++label) {
+            uint32_t ID1 = queryID * 100 + label;
+            ID1s.push_back(ID1);
+            for (uint32_t k = 0, ID2 = ID1; k < 1 + gen() % 5; ++k) {
+                ID2 += 1 + gen() % 500;
+                pairCounts[queryID * 3 / 31000].emplace_back(ID1, ID2, Ratio(1 + gen() % 5, 8));
+            }
+        }
+    }
+    std::vector<PairCount> expected = flatten(pairCounts);
+
+    std::string outputFile = (std::filesystem::temp_directory_path() / "dpcstruct-test-pc-index.bin").string();
+    write_distances(pairCounts, outputFile, 2);
+
+    // A few bytes per row, whatever the gaps between the IDs
+    uint64_t indexBytes = std::filesystem::file_size(distance_index_path(outputFile));
+    REQUIRE(indexBytes <= sizeof(DistanceIndexHeader) + 8 + ID1s.size() * (sizeof(uint32_t) + 2 * sizeof(uint64_t)));
+
+    DistanceFileView view(outputFile);
+    REQUIRE(view.row_ids().size() == ID1s.size());
+    uint64_t found = 0;
+    for (uint32_t ID1 = ID1s.front() - 5; ID1 <= ID1s.back() + 5; ++ID1) {
+        auto row = view.row(ID1);
+        REQUIRE(row.size() == uint64_t(std::count_if(expected.begin() + found, expected.begin() + found + row.size(),
+                                                     [ID1](const PairCount& pc) { return pc.ID1 == ID1; })));
+        REQUIRE(std::all_of(row.begin(), row.end(), [ID1](const NormalizedPair& pair) { return pair.ID1 == ID1; }));
+        found += row.size();
+    }
+    REQUIRE(found == expected.size());
+
+    std::filesystem::remove(outputFile);
+    std::filesystem::remove(distance_index_path(outputFile));
+}
+
+// Test lookups when a dense block of IDs and an outlier share the index: the block falls
+// into a single bucket of the lookup table
+TEST_CASE("Test distance row index of skewed IDs", "[distance]") {
+    std::vector<std::vector<PairCount>> pairCounts(1);
+    for (uint32_t ID1 = 100; ID1 < 40100; ID1 += 2) {
+        pairCounts[0].emplace_back(ID1, ID1 + 1, Ratio(1, 2));
+    }
+    pairCounts[0].emplace_back(4000000000u, 4000000001u, Ratio(1, 4));
+    uint64_t numRows = pairCounts[0].size();
+
+    std::string outputFile = (std::filesystem::temp_directory_path() / "dpcstruct-test-skewed-index.bin").string();
+    write_distances(pairCounts, outputFile, 1);
+
+    DistanceFileView view(outputFile);
+    REQUIRE(view.row_ids().size() == numRows);
+    for (uint32_t ID1 = 99; ID1 <= 40101; ++ID1) {
+        auto row = view.row(ID1);
+        if (ID1 >= 100 && ID1 < 40100 && ID1 % 2 == 0) {
+            REQUIRE(row.size() == 1);
+            REQUIRE(row.front().ID2 == ID1 + 1);
+        } else {
+            REQUIRE(row.empty());
+        }
+    }
+    REQUIRE(view.row(4000000000u).size() == 1);
+    REQUIRE(view.row(3999999999u).empty());
+    REQUIRE(view.row(4000000001u).empty());
+
+    std::filesystem::remove(outputFile);
+    std::filesystem::remove(distance_index_path(outputFile));
+}
@@ -0,0 +1,66 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include <dpcstruct/primarycluster_proc.h>
+#include <dpcstruct/fileparser/QueryStore.h>
+#include <dpcstruct/types/Alignment.h>
+#include <dpcstruct/types/PrimaryCluster.h>
+
+// Test a query store round trip
+TEST_CASE("Test query store of primary clusters", "[query_store]") {
+    std::string storePath = (std::filesystem::temp_directory_path() / "dpcstruct-test.store").string();
+
+    std::vector<Alignment> block = {
+        {7, 101, 50, 100, 100, 150, 100, 200, 40, 50, 0.95, 15, 0.8, 0.9},
+        {7, 102, 55, 105, 105, 155, 100, 200, 50, 60, 0.92, 16, 0.7, 0.85},
+    };
+    std::vector<SmallPC> pcs = {{700, 2, 101, 100, 150}, {700, 2, 102, 105, 155}};
+    uint64_t hash = hash_query_block(block);
+
+    {
+        QueryStoreWriter writer(storePath, 42);
+        writer.append(7, hash, pcs.data(), pcs.size());
+        writer.append(8, 1234, nullptr, 0);
+        writer.close();
+    }
+
+    QueryStore store(storePath, 42);
+    REQUIRE(store.valid());
+    REQUIRE(store.size() == 2);
+
+    std::span<const SmallPC> cached;
+    REQUIRE(store.lookup(7, hash, cached));
+    REQUIRE(cached.size() == 2);
+    REQUIRE(cached[1].sID == 102);
+    REQUIRE(store.lookup(8, 1234, cached));
+    REQUIRE(cached.empty());
+
+    // changed alignment block
+    block[1].queryEnd += 1;
+    REQUIRE_FALSE(store.lookup(7, hash_query_block(block), cached));
+    REQUIRE_FALSE(store.lookup(9, hash, cached));
+
+    // other parameters
+    REQUIRE_FALSE(QueryStore(storePath, 43).valid());
+    REQUIRE(query_store_fingerprint(0) != query_store_fingerprint(1));
+    REQUIRE(query_store_fingerprint(0) != 0);
+
+    // an entry pointing past the records, the index being followed by a 24-byte trailer
+    {
+        uint64_t count = 3;
+        uint64_t entries = std::filesystem::file_size(storePath) - 24 - 2 * sizeof(QueryStoreEntry);
+        std::fstream file(storePath, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(entries + offsetof(QueryStoreEntry, count));
+        file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    }
+    REQUIRE_THROWS_AS(QueryStore(storePath, 42), std::runtime_error);
+
+    std::filesystem::remove(storePath);
+}
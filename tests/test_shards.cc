@@ -0,0 +1,73 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <vector>
+
+#include <dpcstruct/external_sort.h>
+#include <dpcstruct/primarycluster_proc.h>
+#include <dpcstruct/fileparser/ShardManifest.h>
+#include <dpcstruct/types/PrimaryCluster.h>
+
+// Test the sID-range shards against the sorted output
+TEST_CASE("Test sharded primary cluster output", "[shards]") {
+    std::mt19937 gen(11);
+    std::filesystem::path tmpDir = std::filesystem::temp_directory_path() / "dpcstruct-test-shards";
+    std::filesystem::create_directories(tmpDir);
+    std::string outPath = (tmpDir / "pcs.bin").string();
+
+    std::vector<SmallPC> pcs;
+    for (uint32_t i = 0; i < 20000; ++i) {
+        pcs.emplace_back(i, 1, gen() % 300, 0, 0);
+    }
+    std::vector<SmallPC> expected = pcs;
+    std::stable_sort(expected.begin(), expected.end(), compare_sID<SmallPC>());
+
+    std::vector<PCShard> shards = write_shards(pcs, outPath, 4, 2);
+    REQUIRE(shards.size() == 4);
+
+    std::vector<PCShard> manifest = read_shard_manifest(shard_manifest_path(outPath));
+    REQUIRE(manifest.size() == shards.size());
+
+    std::vector<SmallPC> concatenated;
+    for (size_t k = 0; k < manifest.size(); ++k) {
+        REQUIRE(manifest[k].records > 0);
+        if (k > 0) REQUIRE(manifest[k].firstSID > manifest[k - 1].lastSID);
+
+        std::vector<SmallPC> shard(manifest[k].records);
+        std::ifstream inFile(manifest[k].filename, std::ios::binary);
+        inFile.read(reinterpret_cast<char*>(shard.data()), shard.size() * sizeof(SmallPC));
+        REQUIRE(inFile);
+        concatenated.insert(concatenated.end(), shard.begin(), shard.end());
+    }
+
+    REQUIRE(std::equal(concatenated.begin(), concatenated.end(), expected.begin(), expected.end(),
+                       [](const SmallPC& a, const SmallPC& b) { return a.qID == b.qID; }));
+
+    std::filesystem::remove_all(tmpDir);
+}
+
+
+// Test the sharded outputs of a run without primary clusters
+TEST_CASE("Test sharded output of no records", "[shards]") {
+    std::filesystem::path tmpDir = std::filesystem::temp_directory_path() / "dpcstruct-test-empty-shards";
+    std::filesystem::create_directories(tmpDir);
+    std::string outPath = (tmpDir / "pcs.bin").string();
+
+    std::vector<SmallPC> pcs;
+    REQUIRE(write_shards(pcs, outPath, 2, 2).empty());
+    REQUIRE(read_shard_manifest(shard_manifest_path(outPath)).empty());
+    std::filesystem::remove(shard_manifest_path(outPath));
+
+    // The streaming path drains an empty sorter
+    auto key = [](const SmallPC& pc) { return pc.sID; };
+    ExternalSorter<SmallPC, decltype(key)> sorter(key, 1 << 20, tmpDir.string());
+    sorter.spill(pcs);
+    REQUIRE(write_sorted_shards(sorter, outPath, 2).empty());
+    REQUIRE(read_shard_manifest(shard_manifest_path(outPath)).empty());
+
+    std::filesystem::remove_all(tmpDir);
+}
@@ -0,0 +1,209 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <dpcstruct/sort.h>
+#include <dpcstruct/external_sort.h>
+#include <dpcstruct/primarycluster_proc.h>
+#include <dpcstruct/types/PrimaryCluster.h>
+
+// Test the typed radix sort against std::stable_sort
+TEST_CASE("Test radix sort of primary cluster records", "[radix_sort]") {
+    std::mt19937 gen(42);
+
+    SECTION("Sort wrt sID is stable") {
+        std::vector<SmallPC> pcs;
+        for (uint32_t i = 0; i < 200000; ++i) {
+            pcs.emplace_back(i, 1, gen() % 5000, 0, 0);  // qID keeps track of the original order
+        }
+        std::vector<SmallPC> expected = pcs;
+        std::stable_sort(expected.begin(), expected.end(), compare_sID<SmallPC>());
+
+        radix_sort(pcs.data(), pcs.size(), [](const SmallPC& pc) { return pc.sID; }, 4);
+
+        REQUIRE(std::equal(pcs.begin(), pcs.end(), expected.begin(), [](const SmallPC& a, const SmallPC& b) {
+            return a.qID == b.qID && a.sID == b.sID;
+        }));
+    }
+
+    SECTION("Composite 64-bit key") {
+        std::vector<SequenceLabel> labels;
+        for (uint32_t i = 0; i < 1000; ++i) {
+            labels.emplace_back(gen() % 100, i, 0, gen() % 7);
+        }
+        std::vector<SequenceLabel> expected = labels;
+        std::stable_sort(expected.begin(), expected.end(), [](const SequenceLabel& a, const SequenceLabel& b) {
+            return a.label != b.label ? a.label < b.label : a.sID < b.sID;
+        });
+
+        radix_sort(labels.data(), labels.size(), [](const SequenceLabel& sl) {
+            return (static_cast<uint64_t>(sl.label) << 32) | sl.sID;
+        });
+
+        REQUIRE(std::equal(labels.begin(), labels.end(), expected.begin(), [](const SequenceLabel& a, const SequenceLabel& b) {
+            return a.sstart == b.sstart;
+        }));
+    }
+
+    SECTION("Keys sharing every byte are left untouched") {
+        std::vector<SmallPC> pcs;
+        for (uint32_t i = 0; i < 100; ++i) {
+            pcs.emplace_back(i, 1, 7, 0, 0);
+        }
+
+        radix_sort(pcs.data(), pcs.size(), [](const SmallPC& pc) { return pc.sID; });
+
+        for (uint32_t i = 0; i < pcs.size(); ++i) {
+            REQUIRE(pcs[i].qID == i);
+        }
+    }
+
+    SECTION("Empty and single element input") {
+        std::vector<SmallPC> pcs;
+        radix_sort(pcs.data(), pcs.size(), [](const SmallPC& pc) { return pc.sID; });
+        REQUIRE(pcs.empty());
+
+        pcs.emplace_back(1, 2, 3, 4, 5);
+        radix_sort(pcs.data(), pcs.size(), [](const SmallPC& pc) { return pc.sID; });
+        REQUIRE(pcs[0].sID == 3);
+    }
+}
+
+// Test the out-of-core sort against std::stable_sort
+TEST_CASE("Test external sort of primary cluster records", "[external_sort]") {
+    std::mt19937 gen(7);
+    std::string tmpDir = std::filesystem::temp_directory_path().string();
+    auto sIDKey = [](const SmallPC& pc) { return pc.sID; };
+
+    std::vector<SmallPC> pcs;
+    for (uint32_t i = 0; i < 50000; ++i) {
+        pcs.emplace_back(i, 1, gen() % 1000, 0, 0);
+    }
+    std::vector<SmallPC> expected = pcs;
+    std::stable_sort(expected.begin(), expected.end(), compare_sID<SmallPC>());
+
+    auto sort_with_budget = [&](uint64_t memoryBytes, size_t& numRuns) {
+        ExternalSorter<SmallPC, decltype(sIDKey)> sorter(sIDKey, memoryBytes, tmpDir, 2);
+        sorter.push(pcs.data(), pcs.size());
+        numRuns = sorter.num_runs();
+
+        std::vector<SmallPC> sorted;
+        sorter.merge([&](const SmallPC* records, uint64_t count) { sorted.insert(sorted.end(), records, records + count); });
+        return sorted;
+    };
+    auto same_order = [](const SmallPC& a, const SmallPC& b) { return a.qID == b.qID; };
+
+    SECTION("Data within the budget is sorted in memory") {
+        size_t numRuns;
+        auto sorted = sort_with_budget(1 << 22, numRuns);
+        REQUIRE(numRuns == 0);
+        REQUIRE(std::equal(sorted.begin(), sorted.end(), expected.begin(), expected.end(), same_order));
+    }
+
+    SECTION("Spilled runs are merged stably") {
+        size_t numRuns;
+        auto sorted = sort_with_budget(1 << 16, numRuns);
+        REQUIRE(numRuns > 1);
+        REQUIRE(std::equal(sorted.begin(), sorted.end(), expected.begin(), expected.end(), same_order));
+    }
+
+    SECTION("More runs than the merge opens at once are merged in passes") {
+        size_t numRuns;
+        auto sorted = sort_with_budget(1 << 10, numRuns);
+        REQUIRE(numRuns > EXTERNAL_MERGE_MAX_FANIN);
+        REQUIRE(std::equal(sorted.begin(), sorted.end(), expected.begin(), expected.end(), same_order));
+    }
+}
+
+
+// Test two sorters of different record types spilling while the other one merges,
+// as the out-of-core traceback does: their run files must not collide
+TEST_CASE("Test concurrent external sorts of different records", "[external_sort]") {
+    struct Labelled {
+        uint64_t key;
+        uint32_t qID;
+        uint32_t pad;
+    };
+
+    std::mt19937 gen(9);
+    std::string tmpDir = std::filesystem::temp_directory_path().string();
+    auto qIDKey = [](const SmallPC& pc) { return pc.qID; };
+    auto labelKey = [](const Labelled& l) { return l.key; };
+
+    std::vector<SmallPC> pcs;
+    for (uint32_t i = 0; i < 400000; ++i) {
+        pcs.emplace_back(gen() % 5000, 1, i, 0, 0);
+    }
+
+    // Runs longer than the merge buffer, so the merge still reads them after the other sorter spills
+    ExternalSorter<SmallPC, decltype(qIDKey)> pcSorter(qIDKey, 1 << 22, tmpDir);
+    ExternalSorter<Labelled, decltype(labelKey)> labelSorter(labelKey, 1 << 22, tmpDir);
+    pcSorter.push(pcs.data(), pcs.size());
+    REQUIRE(pcSorter.num_runs() > 1);
+
+    std::vector<SmallPC> sortedPCs;
+    pcSorter.merge([&](const SmallPC* records, uint64_t count) {
+        sortedPCs.insert(sortedPCs.end(), records, records + count);
+        for (uint64_t i = 0; i < count; ++i) {
+            labelSorter.push(Labelled{uint64_t(records[i].sID % 977) << 32 | records[i].sID, records[i].qID, 0});
+        }
+    });
+    REQUIRE(labelSorter.num_runs() > 1);
+
+    std::vector<Labelled> sortedLabels;
+    labelSorter.merge([&](const Labelled* records, uint64_t count) { sortedLabels.insert(sortedLabels.end(), records, records + count); });
+
+    REQUIRE(sortedPCs.size() == pcs.size());
+    REQUIRE(std::is_sorted(sortedPCs.begin(), sortedPCs.end(), [](const SmallPC& a, const SmallPC& b) { return a.qID < b.qID; }));
+    REQUIRE(sortedLabels.size() == pcs.size());
+    REQUIRE(std::is_sorted(sortedLabels.begin(), sortedLabels.end(), [](const Labelled& a, const Labelled& b) { return a.key < b.key; }));
+    REQUIRE(std::all_of(sortedLabels.begin(), sortedLabels.end(), [&](const Labelled& l) { return pcs[l.key & 0xffffffff].qID == l.qID; }));
+}
+
+
+// Test the streaming mode on a budget that spills more runs than the merge opens at once:
+// the output must not depend on the budget nor on the number of workers
+TEST_CASE("Test streaming primary clustering on a small budget", "[external_sort]") {
+    std::mt19937 gen(11);
+    std::string tmpDir = std::filesystem::temp_directory_path().string();
+    std::string inPath = tmpDir + "/dpcstruct-test-stream.tsv";
+
+    {
+        std::ofstream inFile(inPath);
+        for (uint32_t qID = 1; qID <= 1500; ++qID) {
+            // Two domains per query, hit with small jitter
+            for (uint32_t k = 0; k < 24; ++k) {
+                uint32_t qStart = (k % 2 ? 100 : 10) + gen() % 4;
+                uint32_t qEnd = qStart + 40 + gen() % 4;
+                inFile << qID << '\t' << (qID * 7 + k * 13) % 3000 << '\t' << qStart << '\t' << qEnd << '\t'
+                       << 10 << '\t' << 60 << "\t200\t200\t50\t90\t1e-5\t50\t0.5\t0.5\n";
+            }
+        }
+    }
+
+    auto stream_with_budget = [&](uint64_t memoryBytes, int numThreads) {
+        std::string outPath = tmpDir + "/dpcstruct-test-stream-" + std::to_string(numThreads) + ".bin";
+        AlnsFileParser parser(inPath);
+        uint64_t written = process_stream(parser, outPath, tmpDir, memoryBytes, numThreads, 0, 0, nullptr);
+
+        std::ifstream outFile(outPath, std::ios::binary);
+        std::vector<char> bytes((std::istreambuf_iterator<char>(outFile)), std::istreambuf_iterator<char>());
+        std::filesystem::remove(outPath);
+        REQUIRE(bytes.size() == written * sizeof(SmallPC));
+        return bytes;
+    };
+
+    auto inMemory = stream_with_budget(1 << 30, 1);
+    auto outOfCore = stream_with_budget(1 << 10, 4);
+    std::filesystem::remove(inPath);
+
+    REQUIRE(!inMemory.empty());
+    REQUIRE(outOfCore == inMemory);
+}